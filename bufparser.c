@@ -19,21 +19,109 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
 #include "bufparser.h"
 
+#define BUFFER_READ_CHUNK	4096
+
+/*
+ * Map a regular file into memory. The mapping is private and writable,
+ * so that buffer_free_secret() can still wipe it.
+ */
+static buffer_t *
+buffer_map_file(int fd, size_t size, const char *display_name)
+{
+	buffer_t *bp;
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		debug("Cannot map %s: %m\n", display_name);
+		return NULL;
+	}
+
+	bp = calloc(1, sizeof(*bp));
+	buffer_init_read(bp, addr, size);
+	bp->mapped = true;
+
+	debug("Mapped %lu bytes from %s\n", (unsigned long) size, display_name);
+	return bp;
+}
+
+void
+buffer_unmap(buffer_t *bp)
+{
+	munmap(bp->data, bp->size);
+	free(bp);
+}
+
+/*
+ * Read until EOF. This works for pipes and sockets, where we do not
+ * know the size up front.
+ */
+static buffer_t *
+buffer_read_stream(int fd, size_t size_hint, const char *display_name, int flags)
+{
+	size_t size = size_hint + BUFFER_READ_CHUNK;
+	buffer_t *bp, *grown;
+	int count;
+
+	bp = buffer_alloc_write(size);
+	while (true) {
+		if (buffer_tailroom(bp) == 0) {
+			size = 2 * bp->size;
+			grown = realloc(bp, sizeof(*bp) + size);
+			if (grown == NULL) {
+				if (!(flags & BUFFER_READ_NOFATAL))
+					fatal("Cannot allocate buffer of %lu bytes for %s: %m\n",
+							(unsigned long) size, display_name);
+				error("Cannot allocate buffer of %lu bytes for %s: %m\n",
+						(unsigned long) size, display_name);
+				goto failed;
+			}
+			bp = grown;
+			bp->data = (unsigned char *) (bp + 1);
+			bp->size = size;
+		}
+
+		count = read(fd, buffer_write_pointer(bp), buffer_tailroom(bp));
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!(flags & BUFFER_READ_NOFATAL))
+				fatal("Error while reading from %s: %m\n", display_name);
+			error("Error while reading from %s: %m\n", display_name);
+			goto failed;
+		}
+
+		if (count == 0)
+			break;
+
+		bp->wpos += count;
+	}
+
+	debug("Read %u bytes from %s\n", buffer_available(bp), display_name);
+	return bp;
+
+failed:
+	buffer_free(bp);
+	return NULL;
+}
+
 buffer_t *
 buffer_read_file(const char *filename, int flags)
 {
 	const char *display_name = filename;
 	bool closeit = true;
-	buffer_t *bp;
+	buffer_t *bp = NULL;
 	struct stat stb;
-	int count;
 	int fd;
 
 	if (filename == NULL || !strcmp(filename, "-")) {
@@ -42,30 +130,30 @@ buffer_read_file(const char *filename, int flags)
 		fd = 0;
 	} else
 	if ((fd = open(filename, O_RDONLY)) < 0) {
-		fatal("Unable to open file %s: %m\n", filename);
+		if (!(flags & BUFFER_READ_NOFATAL))
+			fatal("Unable to open file %s: %m\n", filename);
+		error("Unable to open file %s: %m\n", filename);
+		return NULL;
 	}
 
-	if (fstat(fd, &stb) < 0)
-		fatal("Cannot stat %s: %m\n", display_name);
-
-	bp = buffer_alloc_write(stb.st_size);
-	if (bp == NULL)
-		fatal("Cannot allocate buffer of %lu bytes for %s: %m\n",
-				(unsigned long) stb.st_size,
-				display_name);
+	if (fstat(fd, &stb) < 0) {
+		if (!(flags & BUFFER_READ_NOFATAL))
+			fatal("Cannot stat %s: %m\n", display_name);
+		error("Cannot stat %s: %m\n", display_name);
+		goto out;
+	}
 
-	count = read(fd, bp->data, stb.st_size);
-	if (count < 0)
-		fatal("Error while reading from %s: %m\n", display_name);
+	/* Some files in /proc and /sys claim to be empty, so we read those, too */
+	if (S_ISREG(stb.st_mode) && stb.st_size > 0 && !(flags & BUFFER_READ_NOMAP))
+		bp = buffer_map_file(fd, stb.st_size, display_name);
 
-	if (count != stb.st_size)
-		fatal("Short read from %s\n", display_name);
+	if (bp == NULL)
+		bp = buffer_read_stream(fd, S_ISREG(stb.st_mode)? stb.st_size : 0, display_name, flags);
 
+out:
 	if (closeit)
 		close(fd);
 
-	debug("Read %u bytes from %s\n", count, display_name);
-	bp->wpos = count;
 	return bp;
 }
 
@@ -101,3 +189,339 @@ buffer_write_file(const char *filename, buffer_t *bp)
 	debug("Wrote %u bytes to %s\n", written, display_name);
 	return true;
 }
+
+/*
+ * A simple pool of buffers, so that we do not have to go through malloc
+ * and free for every APDU and CCID packet we exchange with the card.
+ *
+ * Buffers come in a handful of size classes. Requests that are larger
+ * than the largest class are served by a plain buffer_alloc_write().
+ * Buffers handed out hold a reference on the pool, so it's okay for
+ * a buffer to outlive the object that owns the pool.
+ */
+#define BUFFER_POOL_NCLASSES	3
+#define BUFFER_POOL_MAX_FREE	8
+
+typedef struct buffer_pool_class {
+	size_t			size;
+	unsigned int		count;
+	buffer_t *		free_list;
+} buffer_pool_class_t;
+
+struct buffer_pool {
+	unsigned int		refcount;
+	bool			dead;
+	bool			secure;
+	buffer_pool_class_t	class[BUFFER_POOL_NCLASSES];
+};
+
+/*
+ * Secure arena. Buffers holding secrets (PINs, cleartext, and any APDU
+ * that may carry them) are allocated from a single region that is locked
+ * into memory once at startup, and excluded from core dumps. Chunks are
+ * powers of two, and are wiped when released.
+ *
+ * If the arena is exhausted, we fall back to the heap. Those buffers are
+ * still wiped on release, but may be swapped out. If the lock fails (for
+ * instance, because of RLIMIT_MEMLOCK), we keep using the arena anyway:
+ * it may be swapped out as well, but it still stays out of core dumps,
+ * which the heap does not.
+ *
+ * The arena is shared by all threads, and a buffer may be released by
+ * a different thread than the one that allocated it. So unlike the rest
+ * of the buffer code, the arena needs a lock.
+ */
+#define SECURE_ARENA_SIZE	(64 * 1024)
+#define SECURE_CHUNK_MIN_SHIFT	6
+#define SECURE_CHUNK_NCLASSES	8
+
+static struct secure_arena {
+	pthread_mutex_t		lock;
+	bool			initialized;
+	unsigned char *		base;
+	size_t			used;
+	void *			free_list[SECURE_CHUNK_NCLASSES];
+} secure_arena = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static bool
+secure_arena_init(void)
+{
+	struct secure_arena *arena = &secure_arena;
+	void *addr;
+
+	if (arena->initialized)
+		return arena->base != NULL;
+	arena->initialized = true;
+
+	addr = mmap(NULL, SECURE_ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		debug("Unable to allocate secure arena: %m\n");
+		return false;
+	}
+
+	if (mlock(addr, SECURE_ARENA_SIZE) < 0)
+		warning("Unable to lock memory for secrets, they may be swapped out: %m\n");
+	madvise(addr, SECURE_ARENA_SIZE, MADV_DONTDUMP);
+
+	arena->base = addr;
+	return true;
+}
+
+static inline bool
+secure_arena_contains(const void *p)
+{
+	const unsigned char *addr = p;
+
+	return secure_arena.base != NULL
+	    && secure_arena.base <= addr && addr < secure_arena.base + SECURE_ARENA_SIZE;
+}
+
+static int
+secure_chunk_class(size_t size)
+{
+	unsigned int k;
+
+	for (k = 0; k < SECURE_CHUNK_NCLASSES; ++k) {
+		if (size <= (1UL << (SECURE_CHUNK_MIN_SHIFT + k)))
+			return k;
+	}
+	return -1;
+}
+
+static void *
+secure_arena_alloc(size_t size)
+{
+	struct secure_arena *arena = &secure_arena;
+	size_t chunk_size;
+	void *p = NULL;
+	int k;
+
+	if ((k = secure_chunk_class(size)) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&arena->lock);
+	if (!secure_arena_init())
+		goto out;
+
+	if ((p = arena->free_list[k]) != NULL) {
+		arena->free_list[k] = *(void **) p;
+		goto out;
+	}
+
+	chunk_size = 1UL << (SECURE_CHUNK_MIN_SHIFT + k);
+	if (arena->used + chunk_size <= SECURE_ARENA_SIZE) {
+		p = arena->base + arena->used;
+		arena->used += chunk_size;
+	}
+
+out:
+	pthread_mutex_unlock(&arena->lock);
+	return p;
+}
+
+static void
+secure_arena_free(void *p, size_t size)
+{
+	int k = secure_chunk_class(size);
+
+	pthread_mutex_lock(&secure_arena.lock);
+	*(void **) p = secure_arena.free_list[k];
+	secure_arena.free_list[k] = p;
+	pthread_mutex_unlock(&secure_arena.lock);
+}
+
+buffer_t *
+buffer_alloc_secret(unsigned long size)
+{
+	buffer_t *bp;
+
+	size = (size + 7) & ~7UL;
+	if ((bp = secure_arena_alloc(sizeof(*bp) + size)) == NULL) {
+		debug2("Secure arena exhausted, allocating %lu bytes from heap\n", size);
+		bp = malloc(sizeof(*bp) + size);
+	}
+
+	buffer_init_write(bp, (void *) (bp + 1), size);
+	bp->secure = true;
+	return bp;
+}
+
+void
+buffer_secure_release(buffer_t *bp)
+{
+	size_t total = sizeof(*bp) + bp->size;
+
+	explicit_bzero(bp, total);
+	if (secure_arena_contains(bp))
+		secure_arena_free(bp, total);
+	else
+		free(bp);
+}
+
+static buffer_pool_t *
+__buffer_pool_create(size_t max_size, bool secure)
+{
+	static const size_t class_size[BUFFER_POOL_NCLASSES] = { 64, 512, 0 };
+	buffer_pool_t *pool;
+	unsigned int i;
+
+	max_size = (max_size + 7) & ~7UL;
+
+	pool = calloc(1, sizeof(*pool));
+	pool->refcount = 1;
+	for (i = 0; i < BUFFER_POOL_NCLASSES; ++i) {
+		size_t size = class_size[i]?: max_size;
+
+		if (size > max_size)
+			size = max_size;
+		pool->class[i].size = size;
+	}
+
+	pool->secure = secure;
+	return pool;
+}
+
+buffer_pool_t *
+buffer_pool_create(size_t max_size)
+{
+	return __buffer_pool_create(max_size, false);
+}
+
+/*
+ * A pool whose buffers come from the secure arena, and are wiped
+ * before they go back on the free list.
+ */
+buffer_pool_t *
+buffer_pool_create_secure(size_t max_size)
+{
+	return __buffer_pool_create(max_size, true);
+}
+
+static void
+__buffer_pool_drain(buffer_pool_t *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < BUFFER_POOL_NCLASSES; ++i) {
+		buffer_pool_class_t *cls = &pool->class[i];
+		buffer_t *bp;
+
+		while ((bp = cls->free_list) != NULL) {
+			cls->free_list = bp->next;
+			bp->next = NULL;
+			buffer_free(bp);
+		}
+		cls->count = 0;
+	}
+}
+
+static void
+__buffer_pool_put(buffer_pool_t *pool)
+{
+	if (--(pool->refcount) == 0)
+		free(pool);
+}
+
+void
+buffer_pool_free(buffer_pool_t *pool)
+{
+	if (pool == NULL)
+		return;
+
+	__buffer_pool_drain(pool);
+	pool->dead = true;
+	__buffer_pool_put(pool);
+}
+
+buffer_t *
+buffer_pool_acquire(buffer_pool_t *pool, size_t size)
+{
+	buffer_pool_class_t *cls = NULL;
+	buffer_t *bp;
+	unsigned int i;
+
+	if (pool == NULL || pool->dead)
+		return buffer_alloc_write(size);
+
+	for (i = 0; i < BUFFER_POOL_NCLASSES && cls == NULL; ++i) {
+		if (size <= pool->class[i].size)
+			cls = &pool->class[i];
+	}
+
+	if (cls == NULL)
+		return pool->secure? buffer_alloc_secret(size) : buffer_alloc_write(size);
+
+	if ((bp = cls->free_list) != NULL) {
+		cls->free_list = bp->next;
+		cls->count--;
+		buffer_init_write(bp, (void *) (bp + 1), cls->size);
+		bp->secure = pool->secure;
+	} else if (pool->secure) {
+		bp = buffer_alloc_secret(cls->size);
+	} else {
+		bp = buffer_alloc_write(cls->size);
+	}
+
+	bp->pool = pool;
+	pool->refcount++;
+	return bp;
+}
+
+void
+buffer_pool_release(buffer_t *bp)
+{
+	buffer_pool_t *pool = bp->pool;
+	buffer_pool_class_t *cls = NULL;
+	unsigned int i;
+
+	for (i = 0; i < BUFFER_POOL_NCLASSES && cls == NULL; ++i) {
+		if (bp->size == pool->class[i].size)
+			cls = &pool->class[i];
+	}
+
+	if (pool->dead || cls == NULL || cls->count >= BUFFER_POOL_MAX_FREE) {
+		bp->pool = NULL;
+		buffer_free(bp);
+	} else {
+		if (bp->secure)
+			explicit_bzero(bp->data, bp->size);
+
+		bp->pool = NULL;
+		bp->next = cls->free_list;
+		cls->free_list = bp;
+		cls->count++;
+	}
+
+	__buffer_pool_put(pool);
+}
+
+/*
+ * Turn a buffer chain into a single contiguous buffer.
+ * On success, the chain is consumed.
+ */
+buffer_t *
+buffer_chain_flatten(buffer_t *bp)
+{
+	buffer_cursor_t cursor;
+	buffer_t *result;
+	size_t total;
+
+	if (bp->next == NULL)
+		return bp;
+
+	total = buffer_chain_available(bp);
+	result = buffer_alloc_secret(total);
+
+	buffer_cursor_init(&cursor, bp);
+	if (!buffer_cursor_get(&cursor, buffer_write_pointer(result), total)) {
+		buffer_free(result);
+		return NULL;
+	}
+	result->wpos = total;
+
+	buffer_free_secret(bp);
+	return result;
+}
@@ -26,6 +26,8 @@
 #include <string.h>
 #include "util.h"
 
+typedef struct buffer_pool buffer_pool_t;
+
 typedef struct buffer buffer_t;
 struct buffer {
 	/* we make these size_t's to be compatible with the TSS2 marshal/unmarshal api */
@@ -33,8 +35,31 @@ struct buffer {
 	size_t			wpos;
 	size_t			size;
 	unsigned char *		data;
+
+	/* If the buffer came from a pool, it returns there when freed */
+	buffer_pool_t *		pool;
+	buffer_t *		next;
+
+	/* Set if data points to a file mapping */
+	bool			mapped;
+
+	/* Set if the buffer lives in locked memory and is wiped when freed */
+	bool			secure;
 };
 
+/* Flags for buffer_read_file */
+#define BUFFER_READ_NOMAP	0x0001
+#define BUFFER_READ_NOFATAL	0x0002	/* report errors and return NULL */
+
+extern buffer_pool_t *		buffer_pool_create(size_t max_size);
+extern buffer_pool_t *		buffer_pool_create_secure(size_t max_size);
+extern void			buffer_pool_free(buffer_pool_t *);
+extern buffer_t *		buffer_pool_acquire(buffer_pool_t *, size_t size);
+extern void			buffer_pool_release(buffer_t *);
+extern void			buffer_unmap(buffer_t *);
+extern buffer_t *		buffer_alloc_secret(unsigned long size);
+extern void			buffer_secure_release(buffer_t *);
+
 static inline void
 buffer_init_read(buffer_t *bp, void *data, unsigned int len)
 {
@@ -42,6 +67,10 @@ buffer_init_read(buffer_t *bp, void *data, unsigned int len)
 	bp->rpos = 0;
 	bp->wpos = len;
 	bp->size = len;
+	bp->pool = NULL;
+	bp->next = NULL;
+	bp->mapped = false;
+	bp->secure = false;
 }
 
 static inline bool
@@ -193,6 +222,10 @@ buffer_init_write(buffer_t *bp, void *data, unsigned int len)
 	bp->rpos = 0;
 	bp->wpos = 0;
 	bp->size = len;
+	bp->pool = NULL;
+	bp->next = NULL;
+	bp->mapped = false;
+	bp->secure = false;
 }
 
 static inline buffer_t *
@@ -207,17 +240,37 @@ buffer_alloc_write(unsigned long size)
 	return bp;
 }
 
+/*
+ * Buffers can be linked into a chain through the next pointer.
+ * Freeing the head of a chain frees all buffers in it.
+ */
 static inline void
 buffer_free(buffer_t *bp)
 {
-	free(bp);
+	while (bp != NULL) {
+		buffer_t *next = bp->next;
+
+		bp->next = NULL;
+		if (bp->pool)
+			buffer_pool_release(bp);
+		else if (bp->mapped)
+			buffer_unmap(bp);
+		else if (bp->secure)
+			buffer_secure_release(bp);
+		else
+			free(bp);
+		bp = next;
+	}
 }
 
 static inline void
 buffer_free_secret(buffer_t *bp)
 {
-	memset(bp->data, 0, bp->size);
-	free(bp);
+	buffer_t *chunk;
+
+	for (chunk = bp; chunk; chunk = chunk->next)
+		memset(chunk->data, 0, chunk->size);
+	buffer_free(bp);
 }
 
 static inline void *
@@ -232,6 +285,44 @@ buffer_tailroom(const buffer_t *bp)
 	return bp->size - bp->wpos;
 }
 
+/*
+ * Headroom: space in front of the data that a lower layer can use to
+ * prepend its own header without copying the payload.
+ * Headroom can only be reserved while the buffer is still empty.
+ */
+static inline bool
+buffer_reserve_headroom(buffer_t *bp, unsigned int count)
+{
+	if (bp->rpos != bp->wpos || count > bp->size - bp->wpos)
+		return false;
+
+	bp->rpos += count;
+	bp->wpos += count;
+	return true;
+}
+
+static inline unsigned int
+buffer_headroom(const buffer_t *bp)
+{
+	return bp->rpos;
+}
+
+static inline void *
+buffer_push_header(buffer_t *bp, unsigned int count)
+{
+	if (count > bp->rpos)
+		return NULL;
+
+	bp->rpos -= count;
+	return bp->data + bp->rpos;
+}
+
+static inline bool
+buffer_pull_header(buffer_t *bp, unsigned int count)
+{
+	return buffer_skip(bp, count);
+}
+
 static inline bool
 buffer_put(buffer_t *bp, const void *src, unsigned int count)
 {
@@ -332,6 +423,117 @@ buffer_truncate(buffer_t *bp, size_t len)
 	return true;
 }
 
+/*
+ * Remove count bytes from the end of the buffer, and copy them to dest
+ */
+static inline bool
+buffer_get_tail(buffer_t *bp, void *dest, unsigned int count)
+{
+	if (count > buffer_available(bp))
+		return false;
+
+	bp->wpos -= count;
+	memcpy(dest, bp->data + bp->wpos, count);
+	return true;
+}
+
+static inline void
+buffer_chain_append(buffer_t *head, buffer_t *bp)
+{
+	while (head->next)
+		head = head->next;
+	head->next = bp;
+}
+
+static inline size_t
+buffer_chain_available(const buffer_t *bp)
+{
+	size_t total = 0;
+
+	for (; bp; bp = bp->next)
+		total += buffer_available(bp);
+	return total;
+}
+
+/*
+ * A cursor for reading through a buffer chain without copying it first.
+ * Reading through the cursor does not modify the buffers themselves.
+ */
+typedef struct buffer_cursor {
+	const buffer_t *	chunk;
+	size_t			pos;
+} buffer_cursor_t;
+
+static inline void
+buffer_cursor_init(buffer_cursor_t *cursor, const buffer_t *bp)
+{
+	cursor->chunk = bp;
+	cursor->pos = bp? bp->rpos : 0;
+}
+
+static inline size_t
+buffer_cursor_available(const buffer_cursor_t *cursor)
+{
+	const buffer_t *bp = cursor->chunk;
+
+	if (bp == NULL)
+		return 0;
+	return (bp->wpos - cursor->pos) + buffer_chain_available(bp->next);
+}
+
+/* Make sure the cursor does not sit at the end of a chunk */
+static inline void
+__buffer_cursor_advance(buffer_cursor_t *cursor)
+{
+	while (cursor->chunk && cursor->pos >= cursor->chunk->wpos) {
+		cursor->chunk = cursor->chunk->next;
+		if (cursor->chunk)
+			cursor->pos = cursor->chunk->rpos;
+	}
+}
+
+static inline bool
+buffer_cursor_get(buffer_cursor_t *cursor, void *dest, size_t count)
+{
+	unsigned char *out = dest;
+
+	if (count > buffer_cursor_available(cursor))
+		return false;
+
+	while (count) {
+		const buffer_t *bp;
+		size_t n;
+
+		__buffer_cursor_advance(cursor);
+		bp = cursor->chunk;
+
+		n = bp->wpos - cursor->pos;
+		if (n > count)
+			n = count;
+		if (out) {
+			memcpy(out, bp->data + cursor->pos, n);
+			out += n;
+		}
+		cursor->pos += n;
+		count -= n;
+	}
+
+	return true;
+}
+
+static inline bool
+buffer_cursor_skip(buffer_cursor_t *cursor, size_t count)
+{
+	return buffer_cursor_get(cursor, NULL, count);
+}
+
+static inline bool
+buffer_cursor_get_u8(buffer_cursor_t *cursor, uint8_t *vp)
+{
+	return buffer_cursor_get(cursor, vp, 1);
+}
+
+extern buffer_t *		buffer_chain_flatten(buffer_t *bp);
 extern buffer_t *		buffer_read_file(const char *filename, int flags);
 extern bool			buffer_write_file(const char *filename, buffer_t *bp);
 
@@ -0,0 +1,357 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * LUKS2 token handler. cryptsetup loads this as
+ * libcryptsetup-token-utoken.so for tokens of type "utoken", and we
+ * decrypt the keyslot passphrase in-process. The token JSON looks like
+ * this:
+ *
+ *   { "type": "utoken", "keyslots": [ "1" ],
+ *     "utoken-secret": "<base64 encoded ciphertext>",
+ *     "utoken-type": "1050", "utoken-key-slot": "9d" }
+ *
+ * Only "utoken-secret" is required. Instead of "utoken-type", the token
+ * can say "utoken-pcsc": "<reader name>" to go through pcscd.
+ *
+ * We hold on to the token (and the PIN verification) until cryptsetup
+ * unloads us, so that unlocking several volumes in one run only brings
+ * up the card once.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <errno.h>
+
+#include "utoken.h"
+#include "scard.h"
+#include "util.h"
+
+/* We don't build against libcryptsetup; these are resolved at load time */
+struct crypt_device;
+extern int		crypt_token_json_get(struct crypt_device *, int token, const char **json);
+extern void		crypt_log(struct crypt_device *, int level, const char *msg);
+
+#define CRYPT_LOG_NORMAL	0
+
+#define TOKEN_VERSION		"1.0"
+#define TOKEN_DEFAULT_TYPE	"1050"
+#define TOKEN_LOCK_DIR		"/run/lock/utoken-decrypt"
+#define TOKEN_TIMEOUT		30000
+
+#define TOKEN_MAX_SECRET	1024
+#define TOKEN_MAX_VALUE		(2 * TOKEN_MAX_SECRET)
+#define TOKEN_MAX_PIN		64
+
+__thread unsigned int	opt_debug = 0;
+
+typedef struct token_params {
+	char			type[32];
+	char			key_slot[8];
+	char			pcsc[128];
+	bool			use_pcsc;
+	unsigned int		secret_len;
+	unsigned char		secret[TOKEN_MAX_SECRET];
+} token_params_t;
+
+static pthread_mutex_t	token_lock = PTHREAD_MUTEX_INITIALIZER;
+static utoken_t *	token_cached;
+static char		token_cached_id[160];
+
+/*
+ * Find "key": "value" in the token JSON. The token object is flat, so
+ * a plain scan is enough; we only have to deal with escapes.
+ */
+static bool
+token_json_get_string(const char *json, const char *key, char *value, size_t size)
+{
+	size_t keylen = strlen(key);
+	const char *pos = json;
+	unsigned int i = 0;
+
+	while ((pos = strchr(pos, '"')) != NULL) {
+		pos++;
+		if (strncmp(pos, key, keylen) || pos[keylen] != '"') {
+			/* skip over this string */
+			while (*pos && *pos != '"')
+				pos += (*pos == '\\' && pos[1])? 2 : 1;
+			if (*pos)
+				pos++;
+			continue;
+		}
+
+		pos += keylen + 1;
+		pos += strspn(pos, " \t\r\n");
+		if (*pos++ != ':')
+			continue;
+		pos += strspn(pos, " \t\r\n");
+		if (*pos++ != '"')
+			return false;
+
+		while (*pos && *pos != '"') {
+			char cc = *pos++;
+
+			if (cc == '\\') {
+				cc = *pos++;
+				if (cc != '"' && cc != '\\' && cc != '/')
+					return false;
+			}
+			if (i + 1 >= size)
+				return false;
+			value[i++] = cc;
+		}
+
+		value[i] = '\0';
+		return *pos == '"';
+	}
+
+	return false;
+}
+
+static int
+token_parse_params(const char *json, token_params_t *params)
+{
+	char *value;
+	int rv = -EINVAL;
+
+	memset(params, 0, sizeof(*params));
+	value = malloc(TOKEN_MAX_VALUE);
+
+	if (!token_json_get_string(json, "utoken-secret", value, TOKEN_MAX_VALUE)
+	 || !(params->secret_len = parse_base64(value, params->secret, sizeof(params->secret)))) {
+		debug("utoken: token has no valid utoken-secret\n");
+		goto out;
+	}
+
+	if (!token_json_get_string(json, "utoken-type", params->type, sizeof(params->type)))
+		strcpy(params->type, TOKEN_DEFAULT_TYPE);
+
+	if (!token_json_get_string(json, "utoken-key-slot", params->key_slot, sizeof(params->key_slot)))
+		snprintf(params->key_slot, sizeof(params->key_slot), "%02x", YKPIV_DEFAULT_KEY_SLOT);
+
+	params->use_pcsc = token_json_get_string(json, "utoken-pcsc", params->pcsc, sizeof(params->pcsc));
+	rv = 0;
+
+out:
+	free(value);
+	return rv;
+}
+
+static int
+token_get_params(struct crypt_device *cd, int token, token_params_t *params)
+{
+	const char *json;
+
+	if (crypt_token_json_get(cd, token, &json) < 0)
+		return -EINVAL;
+	return token_parse_params(json, params);
+}
+
+static void
+token_release(void)
+{
+	if (token_cached) {
+		utoken_close(token_cached);
+		token_cached = NULL;
+	}
+}
+
+/* Runs when cryptsetup unloads the plugin, or exits */
+static void __attribute__((destructor))
+token_cleanup(void)
+{
+	pthread_mutex_lock(&token_lock);
+	token_release();
+	pthread_mutex_unlock(&token_lock);
+}
+
+/*
+ * Return the token for these parameters, reusing the one we opened for
+ * an earlier volume if possible.
+ */
+static utoken_t *
+token_get(const token_params_t *params, uint64_t deadline)
+{
+	uusb_type_t type;
+	char id[sizeof(token_cached_id)];
+
+	if (params->use_pcsc)
+		snprintf(id, sizeof(id), "pcsc:%s", params->pcsc);
+	else
+		snprintf(id, sizeof(id), "usb:%s", params->type);
+
+	if (token_cached && !strcmp(id, token_cached_id)) {
+		utoken_set_deadline(token_cached, deadline);
+		return token_cached;
+	}
+
+	token_release();
+
+	if (params->use_pcsc) {
+		token_cached = utoken_open_pcsc(params->pcsc[0]? params->pcsc : NULL, deadline);
+	} else {
+		if (!usb_parse_type(params->type, &type))
+			return NULL;
+		token_cached = utoken_open(&type, TOKEN_LOCK_DIR, deadline);
+	}
+
+	if (token_cached)
+		strcpy(token_cached_id, id);
+	return token_cached;
+}
+
+static int
+token_open(struct crypt_device *cd, int token, const char *pin, size_t pin_size,
+		char **buffer, size_t *buffer_len)
+{
+	char pinbuf[TOKEN_MAX_PIN], option[32];
+	token_params_t *params;
+	buffer_t ciphertext, *cleartext = NULL;
+	unsigned int retries_left = 0;
+	utoken_t *tok;
+	int rv;
+
+	if (getenv("UTOKEN_DEBUG"))
+		opt_debug = strtoul(getenv("UTOKEN_DEBUG"), NULL, 10);
+
+	params = malloc(sizeof(*params));
+	if ((rv = token_get_params(cd, token, params)) < 0)
+		goto out;
+
+	pthread_mutex_lock(&token_lock);
+	if (!(tok = token_get(params, monotonic_time_ms() + TOKEN_TIMEOUT))) {
+		rv = -EAGAIN;
+		goto out_unlock;
+	}
+
+	if (pin != NULL) {
+		if (pin_size >= sizeof(pinbuf)) {
+			rv = -ENOANO;
+			goto out_unlock;
+		}
+
+		memcpy(pinbuf, pin, pin_size);
+		pinbuf[pin_size] = '\0';
+		if (!utoken_verify_pin(tok, pinbuf, &retries_left)) {
+			debug("utoken: wrong PIN, %u attempts left\n", retries_left);
+			rv = retries_left? -ENOANO : -EPERM;
+			goto out_unlock;
+		}
+	}
+
+	/* The token may have been used with another key slot before */
+	snprintf(option, sizeof(option), "key-slot=%s", params->key_slot);
+	if (!utoken_set_card_option(tok, option)) {
+		rv = -EINVAL;
+		goto out_unlock;
+	}
+
+	buffer_init_read(&ciphertext, params->secret, params->secret_len);
+	if (!(cleartext = utoken_decrypt(tok, &ciphertext))) {
+		/* Most likely, the key wants a PIN and we did not get one */
+		rv = utoken_pin_verified(tok)? -EPERM : -ENOANO;
+		goto out_unlock;
+	}
+
+	*buffer_len = buffer_available(cleartext);
+	*buffer = malloc(*buffer_len);
+	memcpy(*buffer, buffer_read_pointer(cleartext), *buffer_len);
+	buffer_free_secret(cleartext);
+	rv = 0;
+
+out_unlock:
+	pthread_mutex_unlock(&token_lock);
+	explicit_bzero(pinbuf, sizeof(pinbuf));
+
+out:
+	explicit_bzero(params, sizeof(*params));
+	free(params);
+	return rv;
+}
+
+/*
+ * The plugin interface
+ */
+const char *
+cryptsetup_token_version(void)
+{
+	return TOKEN_VERSION;
+}
+
+int
+cryptsetup_token_open(struct crypt_device *cd, int token, char **buffer, size_t *buffer_len, void *usrptr)
+{
+	return token_open(cd, token, NULL, 0, buffer, buffer_len);
+}
+
+int
+cryptsetup_token_open_pin(struct crypt_device *cd, int token, const char *pin, size_t pin_size,
+		char **buffer, size_t *buffer_len, void *usrptr)
+{
+	return token_open(cd, token, pin, pin_size, buffer, buffer_len);
+}
+
+void
+cryptsetup_token_buffer_free(void *buffer, size_t buffer_len)
+{
+	explicit_bzero(buffer, buffer_len);
+	free(buffer);
+}
+
+int
+cryptsetup_token_validate(struct crypt_device *cd, const char *json)
+{
+	token_params_t *params;
+	uusb_type_t type;
+	int rv;
+
+	params = malloc(sizeof(*params));
+	if ((rv = token_parse_params(json, params)) == 0
+	 && !params->use_pcsc && !usb_parse_type(params->type, &type))
+		rv = -EINVAL;
+
+	free(params);
+	return rv;
+}
+
+void
+cryptsetup_token_dump(struct crypt_device *cd, const char *json)
+{
+	token_params_t *params;
+	char line[256];
+
+	params = malloc(sizeof(*params));
+	if (token_parse_params(json, params) == 0) {
+		if (params->use_pcsc)
+			snprintf(line, sizeof(line), "\tutoken pcsc:   %s\n", params->pcsc[0]? params->pcsc : "<any>");
+		else
+			snprintf(line, sizeof(line), "\tutoken type:   %s\n", params->type);
+		crypt_log(cd, CRYPT_LOG_NORMAL, line);
+
+		snprintf(line, sizeof(line), "\tutoken key:    %s\n", params->key_slot);
+		crypt_log(cd, CRYPT_LOG_NORMAL, line);
+
+		snprintf(line, sizeof(line), "\tutoken secret: %u bytes\n", params->secret_len);
+		crypt_log(cd, CRYPT_LOG_NORMAL, line);
+	}
+	free(params);
+}
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "uusb_impl.h"
 #include "uusb_const.h"
@@ -39,11 +40,12 @@ static uusb_intf_type_t	uusb_intf_type_list[] = {
 	{ NULL }
 };
 
+/*
+ * Returns a constant string, so this is safe to call from any thread
+ */
 const char *
 uusb_dt_type_string(unsigned int dt_type)
 {
-	static char name[16];
-
 	switch (dt_type) {
 	case USB_DT_DEVICE:
 		return "device";
@@ -61,8 +63,7 @@ uusb_dt_type_string(unsigned int dt_type)
 		break;
 	}
 
-	snprintf(name, sizeof(name), "t%02x", dt_type);
-	return name;
+	return "other";
 }
 
 static inline bool
@@ -174,104 +175,187 @@ uusb_interface_process_descriptor(uusb_interface_t *interface, const unsigned ch
 	return interface->type->handle_descriptor(interface, data, len);
 }
 
-bool
-uusb_parse_descriptors(uusb_dev_t *dev, const unsigned char *data, size_t len)
+/*
+ * Walk the descriptors once to validate them and count configs and interfaces
+ */
+static bool
+uusb_count_descriptors(const unsigned char *data, size_t len,
+		unsigned int *num_configs, unsigned int *num_interfaces)
 {
 	unsigned int pos;
-	uusb_config_t *config = NULL;
-	uusb_interface_t *interface = NULL;
-	uusb_endpoint_t *endpoint = NULL;
 
+	*num_configs = *num_interfaces = 0;
 	for (pos = 0; pos + 2 < len; pos += data[pos]) {
-		const unsigned char *dt_bytes = data + pos;
 		unsigned char dt_len = data[pos];
 		unsigned char dt_type = data[pos + 1];
-		uusb_dt_parser_t dt;
+
+		if (dt_len < 2) {
+			error("Bad descriptors (dt at pos %u has length %u)\n", pos, dt_len);
+			return false;
+		}
 
 		if (pos + dt_len > len) {
 			error("Bad descriptors (dt at pos %u is too long)\n", pos);
 			return false;
 		}
 
-		usb_debug("%-8s %3u\n", uusb_dt_type_string(dt_type), dt_len);
-
-		uusb_dt_parser_init(&dt, data + pos, dt_len);
 		if (pos == 0) {
 			if (dt_type != USB_DT_DEVICE) {
-				error("Bad descriptors (first descriptor is type %s)\n", uusb_dt_type_string(dt_type));
+				error("Bad descriptors (first descriptor is type 0x%02x)\n", dt_type);
+				return false;
+			}
+		} else if (dt_type == USB_DT_DEVICE) {
+			error("Bad descriptors (duplicate device descriptor)\n");
+			return false;
+		} else if (dt_type == USB_DT_CONFIG) {
+			*num_configs += 1;
+		} else if (dt_type == USB_DT_INTERFACE) {
+			if (*num_configs == 0) {
+				error("Interface descriptor precedes first config descriptor\n");
 				return false;
 			}
+			*num_interfaces += 1;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Parse the descriptors in two passes. The first pass counts configs and
+ * interfaces, so that we can allocate exactly what we need in one go.
+ * The second pass fills in the configs and interfaces.
+ *
+ * Endpoint descriptors are not parsed here; we just remember where each
+ * interface's descriptors are, and look at the endpoints when someone
+ * actually wants to use the interface. Likewise, class specific
+ * descriptors are only processed for interface types we care about.
+ */
+bool
+uusb_parse_descriptors(uusb_dev_t *dev, const unsigned char *data, size_t len)
+{
+	unsigned int num_configs, num_interfaces;
+	uusb_interface_t *next_interface;
+	uusb_config_t *config = NULL;
+	uusb_interface_t *interface = NULL;
+	unsigned char *raw;
+	unsigned int pos;
+
+	if (!uusb_count_descriptors(data, len, &num_configs, &num_interfaces))
+		return false;
+
+	if (num_configs == 0) {
+		error("Device does not have any configurations\n");
+		return false;
+	}
+
+	uusb_free_descriptors(dev);
+	dev->descriptor_arena = calloc(1, num_configs * sizeof(uusb_config_t)
+				+ num_interfaces * sizeof(uusb_interface_t)
+				+ len);
+	dev->config = dev->descriptor_arena;
+	next_interface = (uusb_interface_t *) (dev->config + num_configs);
+
+	/* Keep a copy of the raw descriptors for lazy parsing */
+	raw = (unsigned char *) (next_interface + num_interfaces);
+	memcpy(raw, data, len);
+	data = raw;
+
+	for (pos = 0; pos + 2 < len; pos += data[pos]) {
+		const unsigned char *dt_bytes = data + pos;
+		unsigned char dt_len = data[pos];
+		unsigned char dt_type = data[pos + 1];
+		uusb_dt_parser_t dt;
+
+		usb_debug("%-8s %3u\n", uusb_dt_type_string(dt_type), dt_len);
+
+		uusb_dt_parser_init(&dt, data + pos, dt_len);
+		if (pos == 0) {
 			if (!__uusb_parse_device_descriptor(&dt, &dev->descriptor))
 				return false;
+			continue;
+		}
 
-			if (dev->descriptor.bNumConfigurations == 0 || dev->descriptor.bNumConfigurations > UUSB_MAX_CONFIGS) {
-				error("Cannot handle device with %u configurations\n", dev->descriptor.bNumConfigurations);
+		switch (dt_type) {
+		case USB_DT_CONFIG:
+			config = &dev->config[dev->num_configs++];
+			if (!__uusb_parse_config_descriptor(&dt, &config->descriptor))
 				return false;
-			}
-		} else {
-			switch (dt_type) {
-			case USB_DT_DEVICE:
-				error("Bad descriptors (duplicate device descriptor)\n");
+			config->interface = next_interface;
+			interface = NULL;
+			break;
+
+		case USB_DT_INTERFACE:
+			interface = next_interface++;
+			config->num_interfaces++;
+			if (!__uusb_parse_interface_descriptor(&dt, &interface->descriptor))
 				return false;
-			case USB_DT_CONFIG:
-				if (dev->num_configs > dev->descriptor.bNumConfigurations) {
-					error("Too many config descriptors\n");
-					return false;
-				}
-
-				config = &dev->config[dev->num_configs++];
-				if (!__uusb_parse_config_descriptor(&dt, &config->descriptor))
-					return false;
-				interface = NULL;
-				break;
-			case USB_DT_INTERFACE:
-				if (config == NULL) {
-					error("Interface descriptor precedes first config descriptor\n");
-					return false;
-				}
-
-				if (config->num_interfaces > config->descriptor.bNumInterfaces) {
-					error("Too many interface descriptors\n");
-					return false;
-				}
-
-				interface = &config->interface[config->num_interfaces++];
-				if (!__uusb_parse_interface_descriptor(&dt, &interface->descriptor))
-					return false;
-
-				interface->type = uusb_find_interface_type(&interface->descriptor.bInterface);
-				if (interface->type == NULL)
-					usb_debug("Interface for unknown class %u/subclass %u/protocol %u\n",
-							interface->descriptor.bInterface.class,
-							interface->descriptor.bInterface.subclass,
-							interface->descriptor.bInterface.protocol);
+
+			interface->extra = dt_bytes + dt_len;
+			interface->type = uusb_find_interface_type(&interface->descriptor.bInterface);
+			if (interface->type == NULL)
+				usb_debug("Interface for unknown class %u/subclass %u/protocol %u\n",
+						interface->descriptor.bInterface.class,
+						interface->descriptor.bInterface.subclass,
+						interface->descriptor.bInterface.protocol);
+			break;
+
+		default:
+			if (interface == NULL)
 				break;
 
-			case USB_DT_ENDPOINT:
-				if (interface == NULL) {
-					error("Endpoint descriptor precedes first interface descriptor\n");
-					return false;
-				}
+			interface->extra_len += dt_len;
+			if (dt_type != USB_DT_ENDPOINT
+			 && !uusb_interface_process_descriptor(interface, dt_bytes, dt_len))
+				return false;
+			break;
+		}
+	}
+
+	return true;
+}
 
-				if (interface->num_endpoints > interface->descriptor.bNumEndpoints) {
-					error("Too many endpoint descriptors\n");
-					return false;
-				}
+void
+uusb_free_descriptors(uusb_dev_t *dev)
+{
+	unsigned int i, j;
 
-				endpoint = &interface->endpoint[interface->num_endpoints++];
-				if (!__uusb_parse_endpoint_descriptor(&dt, &endpoint->descriptor))
-					return false;
+	for (i = 0; i < dev->num_configs; ++i) {
+		uusb_config_t *config = &dev->config[i];
 
-				break;
+		for (j = 0; j < config->num_interfaces; ++j) {
+			uusb_interface_t *interface = &config->interface[j];
 
-			default:
-				/* FIXME: should probably also take a dt_parser */
-				if (interface && !uusb_interface_process_descriptor(interface, dt_bytes, dt_len))
-					return false;
-				break;
-			}
+			if (interface->ccid)
+				free(interface->ccid);
 		}
 	}
 
-	return true;
+	free(dev->descriptor_arena);
+	dev->descriptor_arena = NULL;
+	dev->config = NULL;
+	dev->num_configs = 0;
+}
+
+/*
+ * Parse the endpoint descriptors of an interface
+ */
+unsigned int
+uusb_interface_get_endpoints(const uusb_interface_t *interface, uusb_endpoint_descriptor_t *ep, unsigned int max)
+{
+	const unsigned char *data = interface->extra;
+	unsigned int pos, count = 0;
+
+	for (pos = 0; pos + 2 <= interface->extra_len && count < max; pos += data[pos]) {
+		uusb_dt_parser_t dt;
+
+		if (data[pos + 1] != USB_DT_ENDPOINT)
+			continue;
+
+		uusb_dt_parser_init(&dt, data + pos, data[pos]);
+		if (__uusb_parse_endpoint_descriptor(&dt, &ep[count]))
+			count++;
+	}
+
+	return count;
 }
@@ -0,0 +1,183 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Hand the recovered secret to its consumer without writing it to a file.
+ * The secret goes into a sealed memfd, which is either inherited by a
+ * command that we exec, or passed to a listener on a Unix socket.
+ */
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "handoff.h"
+#include "util.h"
+
+/*
+ * Copy the secret into a memfd and seal it, so that the receiver knows
+ * the contents cannot change underneath it.
+ */
+int
+handoff_create_memfd(buffer_t *secret)
+{
+	const unsigned char *data = buffer_read_pointer(secret);
+	unsigned int len = buffer_available(secret);
+	int fd, n;
+
+	fd = memfd_create("utoken-secret", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		error("memfd_create: %m\n");
+		return -1;
+	}
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			error("Unable to write secret to memfd: %m\n");
+			goto failed;
+		}
+		data += n;
+		len -= n;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		error("Unable to seal memfd: %m\n");
+		goto failed;
+	}
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		error("lseek: %m\n");
+		goto failed;
+	}
+
+	debug("Placed %u bytes of cleartext in memfd %d\n", buffer_available(secret), fd);
+	return fd;
+
+failed:
+	close(fd);
+	return -1;
+}
+
+/*
+ * Replace ourselves with the given shell command. The secret is
+ * available to it on fd 3, and the environment tells it so.
+ * Only returns on error.
+ */
+bool
+handoff_exec(int fd, const char *command)
+{
+	char fdbuf[16];
+
+	if (fd != HANDOFF_SECRET_FD) {
+		if (dup2(fd, HANDOFF_SECRET_FD) < 0) {
+			error("dup2: %m\n");
+			return false;
+		}
+		close(fd);
+	} else if (fcntl(fd, F_SETFD, 0) < 0) {
+		error("fcntl: %m\n");
+		return false;
+	}
+
+	snprintf(fdbuf, sizeof(fdbuf), "%d", HANDOFF_SECRET_FD);
+	setenv(HANDOFF_SECRET_FD_ENV, fdbuf, 1);
+
+	debug("Executing \"%s\"\n", command);
+	fflush(stdout);
+	fflush(stderr);
+
+	execl("/bin/sh", "sh", "-c", command, (char *) NULL);
+	error("Unable to execute /bin/sh: %m\n");
+	return false;
+}
+
+/*
+ * Connect to a Unix stream socket and pass the fd as SCM_RIGHTS
+ * ancillary data, along with a single byte of payload.
+ */
+bool
+handoff_send_fd(int fd, const char *socket_path)
+{
+	struct sockaddr_un sun;
+	union {
+		struct cmsghdr	align;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char dummy = 'S';
+	int sock;
+	bool okay = false;
+
+	if (strlen(socket_path) >= sizeof(sun.sun_path)) {
+		error("Socket path \"%s\" too long\n", socket_path);
+		return false;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, socket_path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		error("socket: %m\n");
+		return false;
+	}
+
+	if (connect(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		error("Unable to connect to %s: %m\n", socket_path);
+		goto out;
+	}
+
+	iov.iov_base = &dummy;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&control, 0, sizeof(control));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+		error("Unable to pass secret to %s: %m\n", socket_path);
+		goto out;
+	}
+
+	debug("Passed secret to %s\n", socket_path);
+	okay = true;
+
+out:
+	close(sock);
+	return okay;
+}
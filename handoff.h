@@ -0,0 +1,35 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "bufparser.h"
+
+/* The fd number under which an exec'ed command finds the secret */
+#define HANDOFF_SECRET_FD	3
+#define HANDOFF_SECRET_FD_ENV	"UTOKEN_SECRET_FD"
+
+extern int		handoff_create_memfd(buffer_t *secret);
+extern bool		handoff_exec(int fd, const char *command);
+extern bool		handoff_send_fd(int fd, const char *socket_path);
+
+#endif /* HANDOFF_H */
@@ -0,0 +1,137 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Cache recovered secrets in the kernel keyring, so that unlocking
+ * several things with the same wrapped secret does not have to go to
+ * the token every time. Entries are "user" keys in the user keyring,
+ * named after the SHA-256 of the ciphertext, and expire after a
+ * timeout. Only processes with our uid can read them.
+ *
+ * We use the raw system calls rather than libkeyutils.
+ */
+
+#include <sys/syscall.h>
+#include <linux/keyctl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "keyring.h"
+#include "sha256.h"
+#include "util.h"
+
+#define KEYRING_KEY_TYPE	"user"
+#define KEYRING_KEY_PREFIX	"utoken-decrypt:"
+
+/* From keyutils; the uapi headers do not have the permission bits */
+#define KEY_POS_ALL		0x3f000000
+#define KEY_USR_VIEW		0x00010000
+#define KEY_USR_READ		0x00020000
+#define KEY_USR_SEARCH		0x00080000
+
+typedef int32_t			key_serial_t;
+
+static long
+keyctl(int cmd, unsigned long arg2, unsigned long arg3, unsigned long arg4, unsigned long arg5)
+{
+	return syscall(SYS_keyctl, cmd, arg2, arg3, arg4, arg5);
+}
+
+static void
+keyring_description(buffer_t *ciphertext, char *desc, size_t size)
+{
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	unsigned int i, len;
+
+	sha256_digest(buffer_read_pointer(ciphertext), buffer_available(ciphertext), digest);
+
+	len = snprintf(desc, size, "%s", KEYRING_KEY_PREFIX);
+	for (i = 0; i < SHA256_DIGEST_SIZE && len + 2 < size; ++i)
+		len += snprintf(desc + len, size - len, "%02x", digest[i]);
+}
+
+/*
+ * Returns the cached cleartext for this ciphertext, or NULL.
+ */
+buffer_t *
+keyring_cache_lookup(buffer_t *ciphertext)
+{
+	char desc[128];
+	key_serial_t key;
+	buffer_t *bp;
+	long len;
+
+	keyring_description(ciphertext, desc, sizeof(desc));
+
+	key = keyctl(KEYCTL_SEARCH, KEY_SPEC_USER_KEYRING,
+			(unsigned long) KEYRING_KEY_TYPE, (unsigned long) desc, 0);
+	if (key < 0) {
+		if (errno == ENOKEY || errno == EKEYEXPIRED || errno == EKEYREVOKED)
+			debug("No cached secret for %s\n", desc);
+		else
+			debug("Cannot search keyring: %m\n");
+		return NULL;
+	}
+
+	if ((len = keyctl(KEYCTL_READ, key, 0, 0, 0)) <= 0) {
+		debug("Cannot read key %d: %m\n", key);
+		return NULL;
+	}
+
+	bp = buffer_alloc_secret(len);
+	if (keyctl(KEYCTL_READ, key, (unsigned long) buffer_write_pointer(bp), len, 0) != len) {
+		debug("Cannot read key %d: %m\n", key);
+		buffer_free_secret(bp);
+		return NULL;
+	}
+	bp->wpos += len;
+
+	debug("Found cached secret %s\n", desc);
+	return bp;
+}
+
+bool
+keyring_cache_store(buffer_t *ciphertext, buffer_t *cleartext, unsigned int timeout)
+{
+	char desc[128];
+	key_serial_t key;
+
+	keyring_description(ciphertext, desc, sizeof(desc));
+
+	key = syscall(SYS_add_key, KEYRING_KEY_TYPE, desc,
+			buffer_read_pointer(cleartext), (size_t) buffer_available(cleartext),
+			KEY_SPEC_USER_KEYRING);
+	if (key < 0) {
+		error("Cannot add secret to keyring: %m\n");
+		return false;
+	}
+
+	/* Later invocations may not possess the user keyring */
+	if (keyctl(KEYCTL_SETPERM, key, KEY_POS_ALL | KEY_USR_VIEW | KEY_USR_READ | KEY_USR_SEARCH, 0, 0) < 0
+	 || keyctl(KEYCTL_SET_TIMEOUT, key, timeout, 0, 0) < 0) {
+		error("Cannot set up key %d: %m\n", key);
+		keyctl(KEYCTL_INVALIDATE, key, 0, 0, 0);
+		return false;
+	}
+
+	debug("Cached secret as %s for %u seconds\n", desc, timeout);
+	return true;
+}
@@ -0,0 +1,33 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef KEYRING_H
+#define KEYRING_H
+
+#include "bufparser.h"
+
+/* How long recovered secrets stay in the keyring, unless told otherwise */
+#define KEYRING_TIMEOUT_DEFAULT	300
+
+extern buffer_t *	keyring_cache_lookup(buffer_t *ciphertext);
+extern bool		keyring_cache_store(buffer_t *ciphertext, buffer_t *cleartext, unsigned int timeout);
+
+#endif /* KEYRING_H */
@@ -0,0 +1,219 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "latency.h"
+#include "util.h"
+
+#define LATENCY_FILE_MAGIC	"# utoken-decrypt latency v1"
+
+void
+ccid_latency_init(ccid_latency_t *lat)
+{
+	memset(lat, 0, sizeof(*lat));
+}
+
+ccid_latency_stat_t *
+ccid_latency_get_stat(ccid_latency_t *lat, uint8_t cmd, int ins)
+{
+	if (ins >= 0 && ins < 256)
+		return &lat->ins[ins];
+
+	if (cmd < 0x60 || cmd - 0x60 >= CCID_LATENCY_NUM_CMDS)
+		return NULL;
+
+	return &lat->cmd[cmd - 0x60];
+}
+
+/*
+ * Running mean and variance (Welford). Once we have seen CCID_LATENCY_MAX_SAMPLES,
+ * the count stays put, which makes older samples decay exponentially.
+ */
+void
+ccid_latency_record(ccid_latency_t *lat, ccid_latency_stat_t *st, unsigned long ms)
+{
+	double delta;
+
+	if (st == NULL)
+		return;
+
+	if (st->count < CCID_LATENCY_MAX_SAMPLES)
+		st->count++;
+	else
+		st->m2 -= st->m2 / st->count;
+
+	delta = ms - st->mean;
+	st->mean += delta / st->count;
+	st->m2 += delta * (ms - st->mean);
+
+	if (ms > st->max_ms)
+		st->max_ms = ms;
+
+	lat->dirty = true;
+}
+
+bool
+ccid_latency_trusted(const ccid_latency_stat_t *st)
+{
+	return st != NULL && st->count >= CCID_LATENCY_MIN_SAMPLES;
+}
+
+/*
+ * Derive a timeout from what we've seen so far. We want to detect a dead
+ * reader quickly, but we never want to cut off a card that is just slow.
+ * Hence we allow for generous headroom above both the mean and the
+ * slowest response we have ever observed.
+ */
+long
+ccid_latency_timeout(const ccid_latency_stat_t *st)
+{
+	double stddev, timeout;
+
+	if (!ccid_latency_trusted(st))
+		return CCID_TIMEOUT_DEFAULT;
+
+	stddev = sqrt(st->m2 / (st->count - 1));
+	timeout = st->mean + 4 * stddev;
+	if (timeout < 2 * st->max_ms)
+		timeout = 2 * st->max_ms;
+
+	if (timeout < CCID_TIMEOUT_MIN)
+		return CCID_TIMEOUT_MIN;
+	if (timeout > CCID_TIMEOUT_MAX)
+		return CCID_TIMEOUT_MAX;
+	return timeout;
+}
+
+static bool
+__ccid_latency_parse_line(ccid_latency_t *lat, const char *line)
+{
+	ccid_latency_stat_t *st, tmp;
+	char kind[8];
+	unsigned int code;
+
+	if (sscanf(line, "%7s %x %u %lf %lf %lu", kind, &code,
+				&tmp.count, &tmp.mean, &tmp.m2, &tmp.max_ms) != 6)
+		return false;
+
+	if (tmp.count > CCID_LATENCY_MAX_SAMPLES || tmp.mean < 0 || tmp.m2 < 0)
+		return false;
+
+	if (!strcmp(kind, "cmd"))
+		st = ccid_latency_get_stat(lat, code, -1);
+	else if (!strcmp(kind, "ins") && code < 256)
+		st = ccid_latency_get_stat(lat, 0, code);
+	else
+		return false;
+
+	if (st == NULL)
+		return false;
+
+	*st = tmp;
+	return true;
+}
+
+bool
+ccid_latency_load(ccid_latency_t *lat, const char *path)
+{
+	char linebuf[256];
+	unsigned int lineno = 0;
+	bool valid = false;
+	FILE *fp;
+
+	ccid_latency_init(lat);
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		debug("No latency data in %s: %m\n", path);
+		return false;
+	}
+
+	while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+		lineno++;
+		if (lineno == 1) {
+			if (strncmp(linebuf, LATENCY_FILE_MAGIC, strlen(LATENCY_FILE_MAGIC)))
+				break;
+			valid = true;
+			continue;
+		}
+
+		if (!__ccid_latency_parse_line(lat, linebuf)) {
+			debug("%s:%u: ignoring bad latency record\n", path, lineno);
+			continue;
+		}
+	}
+
+	fclose(fp);
+
+	if (!valid) {
+		debug("%s: bad latency file, ignored\n", path);
+		ccid_latency_init(lat);
+		return false;
+	}
+
+	debug("Loaded latency data from %s\n", path);
+	return true;
+}
+
+static void
+__ccid_latency_write_stat(FILE *fp, const char *kind, unsigned int code, const ccid_latency_stat_t *st)
+{
+	if (st->count == 0)
+		return;
+
+	fprintf(fp, "%s %02x %u %.3f %.3f %lu\n", kind, code,
+			st->count, st->mean, st->m2, st->max_ms);
+}
+
+bool
+ccid_latency_save(ccid_latency_t *lat, const char *path)
+{
+	char tmppath[PATH_MAX];
+	unsigned int i;
+	FILE *fp;
+
+	if (!lat->dirty)
+		return true;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+	if ((fp = fopen(tmppath, "w")) == NULL) {
+		debug("Cannot write latency data to %s: %m\n", tmppath);
+		return false;
+	}
+
+	fprintf(fp, "%s\n", LATENCY_FILE_MAGIC);
+	for (i = 0; i < CCID_LATENCY_NUM_CMDS; ++i)
+		__ccid_latency_write_stat(fp, "cmd", 0x60 + i, &lat->cmd[i]);
+	for (i = 0; i < 256; ++i)
+		__ccid_latency_write_stat(fp, "ins", i, &lat->ins[i]);
+
+	if (fclose(fp) != 0 || rename(tmppath, path) < 0) {
+		debug("Cannot update latency data in %s: %m\n", path);
+		remove(tmppath);
+		return false;
+	}
+
+	debug("Saved latency data to %s\n", path);
+	lat->dirty = false;
+	return true;
+}
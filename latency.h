@@ -0,0 +1,67 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Timeout used as long as we haven't seen enough samples */
+#define CCID_TIMEOUT_DEFAULT		10000
+#define CCID_TIMEOUT_MIN		250
+#define CCID_TIMEOUT_MAX		30000
+
+/* Number of samples we need before we trust the statistics */
+#define CCID_LATENCY_MIN_SAMPLES	4
+/* Cap the sample count so that old observations fade out gradually */
+#define CCID_LATENCY_MAX_SAMPLES	64
+
+/* CCID command bytes range from 0x60 to 0x7f */
+#define CCID_LATENCY_NUM_CMDS		32
+
+typedef struct ccid_latency_stat {
+	unsigned int		count;
+	double			mean;
+	double			m2;
+	unsigned long		max_ms;
+} ccid_latency_stat_t;
+
+/*
+ * Latency statistics for one token model. Plain CCID messages are
+ * tracked by message type, XfrBlock messages by the INS byte of the
+ * APDU they carry.
+ */
+typedef struct ccid_latency {
+	bool			dirty;
+	ccid_latency_stat_t	cmd[CCID_LATENCY_NUM_CMDS];
+	ccid_latency_stat_t	ins[256];
+} ccid_latency_t;
+
+extern void			ccid_latency_init(ccid_latency_t *);
+extern bool			ccid_latency_load(ccid_latency_t *, const char *path);
+extern bool			ccid_latency_save(ccid_latency_t *, const char *path);
+extern ccid_latency_stat_t *	ccid_latency_get_stat(ccid_latency_t *, uint8_t cmd, int ins);
+extern void			ccid_latency_record(ccid_latency_t *, ccid_latency_stat_t *, unsigned long ms);
+extern bool			ccid_latency_trusted(const ccid_latency_stat_t *);
+extern long			ccid_latency_timeout(const ccid_latency_stat_t *);
+
+#endif /* LATENCY_H */
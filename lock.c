@@ -0,0 +1,266 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Take turns with other instances of utoken-decrypt that want to talk to
+ * the same token. Without this, whoever comes second fails to claim the
+ * interface and has to retry at random.
+ *
+ * Each device has a queue of tickets below the lock directory. A ticket is
+ * a file named after the device and a sequence number, and it stays valid
+ * for as long as its owner holds an flock on it. We may use the device once
+ * all tickets with lower numbers are gone. If a process dies while it is
+ * queued or holding the device, the kernel drops its flock, and the next
+ * process that looks at the queue removes the stale ticket.
+ */
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "uusb_impl.h"
+#include "util.h"
+
+/* How often we check whether it's our turn */
+#define LOCK_POLL_INTERVAL	20
+
+/* How long we wait for our turn if the caller did not give a deadline */
+#define LOCK_WAIT_DEFAULT	60000
+
+static void
+uusb_lock_key(const uusb_dev_t *dev, char *key, size_t size)
+{
+	snprintf(key, size, "%u-%u", major(dev->devnum), minor(dev->devnum));
+}
+
+/*
+ * Draw the next ticket. The sequence file is locked while we do this, so
+ * any ticket with a lower number exists (and is locked) by the time we
+ * have ours.
+ */
+static int
+uusb_lock_take_ticket(const char *dirname, const char *key, unsigned long *ticket_ret)
+{
+	char path[PATH_MAX], buffer[32];
+	unsigned long ticket = 0;
+	int seq_fd, fd = -1;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/%s.seq", dirname, key);
+	if ((seq_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		debug("Cannot open %s: %m\n", path);
+		return -1;
+	}
+
+	if (flock(seq_fd, LOCK_EX) < 0) {
+		debug("Cannot lock %s: %m\n", path);
+		goto out;
+	}
+
+	if ((n = pread(seq_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+		buffer[n] = '\0';
+		ticket = strtoul(buffer, NULL, 10);
+	}
+
+	n = snprintf(buffer, sizeof(buffer), "%lu\n", ticket + 1);
+	if (pwrite(seq_fd, buffer, n, 0) != n || ftruncate(seq_fd, n) < 0) {
+		debug("Cannot update %s: %m\n", path);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.%lu", dirname, key, ticket);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		debug("Cannot create %s: %m\n", path);
+		goto out;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		debug("Cannot lock %s: %m\n", path);
+		close(fd);
+		fd = -1;
+		goto out;
+	}
+
+	*ticket_ret = ticket;
+
+out:
+	close(seq_fd);
+	return fd;
+}
+
+/*
+ * Count the live tickets ahead of ours, and clean out the ones whose
+ * owner has gone away.
+ */
+static int
+uusb_lock_queue_ahead(const char *dirname, const char *key, unsigned long ticket)
+{
+	size_t keylen = strlen(key);
+	struct dirent *d;
+	int ahead = 0;
+	DIR *dir;
+
+	if (!(dir = opendir(dirname))) {
+		debug("Cannot open %s: %m\n", dirname);
+		return -1;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		char path[PATH_MAX], *end;
+		unsigned long other;
+		int fd;
+
+		if (strncmp(d->d_name, key, keylen) || d->d_name[keylen] != '.'
+		 || !isdigit(d->d_name[keylen + 1]))
+			continue;
+
+		other = strtoul(d->d_name + keylen + 1, &end, 10);
+		if (*end || other >= ticket)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dirname, d->d_name);
+		if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+			continue;
+
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+			debug("Removing stale lock ticket %s\n", path);
+			unlink(path);
+		} else {
+			ahead++;
+		}
+		close(fd);
+	}
+
+	closedir(dir);
+	return ahead;
+}
+
+static void
+uusb_lock_drop_ticket(int fd, const char *path)
+{
+	/* Unlink before dropping the flock, so nobody mistakes it for stale */
+	unlink(path);
+	close(fd);
+}
+
+/*
+ * Wait until it's our turn to use the device, or until the deadline has
+ * passed. Locking is cooperative; if we cannot set up the queue (for
+ * instance because we're not allowed to write to dirname), we go ahead
+ * without it.
+ */
+bool
+uusb_dev_lock(uusb_dev_t *dev, const char *dirname, uint64_t deadline)
+{
+	char key[32], path[PATH_MAX];
+	unsigned long ticket;
+	bool announced = false;
+	int fd, ahead;
+
+	if (dev->lock_fd >= 0)
+		return true;
+
+	if (mkdir(dirname, 0700) < 0 && errno != EEXIST) {
+		debug("Cannot create %s: %m; not locking the device\n", dirname);
+		return true;
+	}
+
+	uusb_lock_key(dev, key, sizeof(key));
+	if ((fd = uusb_lock_take_ticket(dirname, key, &ticket)) < 0) {
+		debug("Not locking the device\n");
+		return true;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.%lu", dirname, key, ticket);
+	if (deadline == 0)
+		deadline = monotonic_time_ms() + LOCK_WAIT_DEFAULT;
+
+	while ((ahead = uusb_lock_queue_ahead(dirname, key, ticket)) > 0) {
+		long wait = deadline_cap_timeout(deadline, LOCK_POLL_INTERVAL);
+
+		if (wait == 0) {
+			error("Timed out waiting for %s to become available\n", dev->dev_path);
+			uusb_lock_drop_ticket(fd, path);
+			return false;
+		}
+
+		if (!announced) {
+			infomsg("%s is in use, waiting for %d other process(es)\n", dev->dev_path, ahead);
+			announced = true;
+		}
+
+		usleep(wait * 1000);
+	}
+
+	debug("Holding lock ticket %s\n", path);
+	dev->lock_fd = fd;
+	dev->lock_path = strdup(path);
+	return true;
+}
+
+void
+uusb_dev_unlock(uusb_dev_t *dev)
+{
+	if (dev->lock_fd < 0)
+		return;
+
+	debug("Releasing lock ticket %s\n", dev->lock_path);
+	uusb_lock_drop_ticket(dev->lock_fd, dev->lock_path);
+	dev->lock_fd = -1;
+	drop_string(&dev->lock_path);
+}
+
+static int
+uusb_lock_compare(const void *a, const void *b)
+{
+	dev_t da = (*(uusb_dev_t * const *) a)->devnum;
+	dev_t db = (*(uusb_dev_t * const *) b)->devnum;
+
+	return (da > db) - (da < db);
+}
+
+/*
+ * Lock several devices. We always lock them in the same order, so that
+ * two processes that want the same set of tokens cannot end up waiting
+ * for each other. Devices we could not lock are closed, and the rest
+ * is moved up in the array.
+ */
+unsigned int
+uusb_dev_lock_all(uusb_dev_t **devs, unsigned int ndevs, const char *dirname, uint64_t deadline)
+{
+	unsigned int i, count = 0;
+
+	qsort(devs, ndevs, sizeof(devs[0]), uusb_lock_compare);
+	for (i = 0; i < ndevs; ++i) {
+		if (!uusb_dev_lock(devs[i], dirname, deadline)) {
+			usb_close(devs[i]);
+			continue;
+		}
+		devs[count++] = devs[i];
+	}
+
+	return count;
+}
@@ -22,28 +22,182 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <getopt.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "uusb.h"
 #include "scard.h"
 #include "bufparser.h"
+#include "handoff.h"
+#include "pool.h"
+#include "pin.h"
+#include "keyring.h"
 #include "util.h"
 
+#define DEFAULT_LATENCY_CACHE	"/var/cache/utoken-decrypt"
+#define DEFAULT_SESSION_CACHE	"/run/utoken-decrypt"
+#define DEFAULT_LOCK_DIR	"/run/lock/utoken-decrypt"
+
 static struct option	options[] = {
 	{ "device",	required_argument,	NULL,	'D' },
 	{ "type",	required_argument,	NULL,	'T' },
 	{ "pin",	required_argument,	NULL,	'p' },
 	{ "output",	required_argument,	NULL,	'o' },
 	{ "card-option",required_argument,	NULL,	'C' },
+	{ "latency-cache",required_argument,	NULL,	'L' },
+	{ "deadline",	required_argument,	NULL,	't' },
+	{ "session-cache",optional_argument,	NULL,	'S' },
+	{ "exec",	required_argument,	NULL,	'X' },
+	{ "socket",	required_argument,	NULL,	'U' },
+	{ "repeat",	required_argument,	NULL,	'R' },
+	{ "all-devices",no_argument,		NULL,	'A' },
+	{ "output-dir",	required_argument,	NULL,	'O' },
+	{ "race",	no_argument,		NULL,	'r' },
+	{ "ask-pin",	optional_argument,	NULL,	'P' },
+	{ "lock-dir",	required_argument,	NULL,	'K' },
+	{ "pcsc",	optional_argument,	NULL,	'Q' },
+	{ "keyring-cache",optional_argument,	NULL,	'k' },
+	{ "keep-awake",	no_argument,		NULL,	'W' },
 	{ "debug",	no_argument,		NULL,	'd' },
 	{ "help",	no_argument,		NULL,	'h' },
 	{ NULL }
 };
 
-unsigned int	opt_debug = 0;
+__thread unsigned int	opt_debug = 0;
+static const char *	opt_latency_cache = DEFAULT_LATENCY_CACHE;
+static uint64_t		opt_deadline = 0;
+static const char *	opt_session_cache = NULL;
+static const char *	opt_lock_dir = DEFAULT_LOCK_DIR;
+static unsigned int	opt_repeat = 1;
+static bool		opt_all_devices = false;
+static const char *	opt_output_dir = NULL;
+static bool		opt_race = false;
+static bool		opt_pcsc = false;
+static const char *	opt_pcsc_reader = NULL;
+static bool		opt_keyring_cache = false;
+static unsigned int	opt_keyring_timeout = KEYRING_TIMEOUT_DEFAULT;
+static pin_prompt_t	pin_prompt;
 
-static buffer_t *	doit(uusb_dev_t *dev, const char *pin, buffer_t *secret, unsigned int ncardopts, char **cardopts);
+/*
+ * Reading the input does not depend on the device, so we do it on a
+ * separate thread while we look for the token and bring it up.
+ */
+typedef struct input_reader {
+	const char *		path;
+	pthread_t		thread;
+	bool			joined;
+	unsigned int		debug;
+	buffer_t *		data;
+} input_reader_t;
+
+static buffer_t *	doit(uusb_dev_t *dev, pin_prompt_t *pin, input_reader_t *input, unsigned int ncardopts, char **cardopts);
+static int		decrypt_with_all_devices(const uusb_type_t *, pin_prompt_t *pin,
+				char **inputs, unsigned int ninputs, const char *output,
+				unsigned int ncardopts, char **cardopts);
+static buffer_t *	decrypt_race(const uusb_type_t *, pin_prompt_t *pin, input_reader_t *input,
+				unsigned int ncardopts, char **cardopts);
+
+static unsigned int	lock_devices(uusb_dev_t **devs, unsigned int ndevs);
 
 #define MAX_CARDOPTS	16
+#define MAX_DEVICES	16
+
+/* With --repeat, iterations it takes for pools and caches to fill up.
+ * Heap usage after that must not grow any more. */
+#define REPEAT_WARMUP	3
+
+/*
+ * Parse a time interval such as "3s", "500ms" or "1m". A plain number
+ * is taken to be seconds.
+ */
+static bool
+parse_interval_ms(const char *string, uint64_t *ms_ret)
+{
+	unsigned long value;
+	char *end;
+
+	value = strtoul(string, &end, 10);
+	if (end == string)
+		return false;
+
+	if (*end == '\0' || !strcmp(end, "s"))
+		*ms_ret = value * 1000;
+	else if (!strcmp(end, "ms"))
+		*ms_ret = value;
+	else if (!strcmp(end, "m"))
+		*ms_ret = value * 60000;
+	else
+		return false;
+
+	return *ms_ret != 0;
+}
+
+static void *
+input_reader_thread(void *arg)
+{
+	input_reader_t *input = arg;
+
+	opt_debug = input->debug;
+	input->data = buffer_read_file(input->path, BUFFER_READ_NOFATAL);
+	return NULL;
+}
+
+static bool
+input_reader_start(input_reader_t *input, const char *path)
+{
+	memset(input, 0, sizeof(*input));
+	input->path = path;
+	input->debug = opt_debug;
+
+	if (pthread_create(&input->thread, NULL, input_reader_thread, input) != 0) {
+		error("Unable to start input thread\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Wait for the input to be read. Returns NULL if reading failed.
+ */
+static buffer_t *
+input_reader_wait(input_reader_t *input)
+{
+	if (!input->joined) {
+		pthread_join(input->thread, NULL);
+		input->joined = true;
+
+		if (input->data == NULL)
+			error("Unable to read input from \"%s\"\n", input->path);
+	}
+
+	return input->data;
+}
+
+static bool
+start_pin_prompt(const char *mode_string)
+{
+	int mode = pin_prompt_parse_mode(mode_string);
+
+	if (mode == PIN_PROMPT_NONE) {
+		error("Unknown PIN prompt \"%s\"\n", mode_string);
+		return false;
+	}
+
+	return pin_prompt_start(&pin_prompt, mode, "Please enter the PIN for your security token", opt_deadline);
+}
+
+/*
+ * If we exit while the user is still typing, make sure the prompt
+ * restores the terminal.
+ */
+static void
+pin_prompt_cleanup(void)
+{
+	pin_prompt_destroy(&pin_prompt);
+}
 
 int
 main(int argc, char **argv)
@@ -51,16 +205,25 @@ main(int argc, char **argv)
 	char *opt_device = NULL;
 	char *opt_type = NULL;
 	char *opt_pin = NULL;
+	char *opt_ask_pin = NULL;
+	bool ask_pin = false;
 	char *opt_input = NULL;
 	char *opt_output = NULL;
+	char *opt_exec = NULL;
+	char *opt_socket = NULL;
 	char *cardopts[MAX_CARDOPTS];
 	unsigned int ncardopts = 0;
-	buffer_t *secret;
-	uusb_dev_t *dev;
+	input_reader_t input;
+	uusb_type_t type;
+	uusb_dev_t *dev = NULL;
+	buffer_t *ciphertext;
 	buffer_t *cleartext;
+	unsigned int iteration;
+	size_t heap_baseline = 0, heap_used = 0;
+	uint64_t interval;
 	int c;
 
-	while ((c = getopt_long(argc, argv, "dhC:D:T:p:o:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhC:D:L:T:p:o:t:", options, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			printf("Sorry, no help message. Please refer to the README.\n");
@@ -95,12 +258,136 @@ main(int argc, char **argv)
 			opt_output = optarg;
 			break;
 
+		case 't':
+			if (!parse_interval_ms(optarg, &interval)) {
+				error("Cannot parse deadline \"%s\"\n", optarg);
+				return 1;
+			}
+			opt_deadline = monotonic_time_ms() + interval;
+			break;
+
+		case 'X':
+			opt_exec = optarg;
+			break;
+
+		case 'U':
+			opt_socket = optarg;
+			break;
+
+		case 'R':
+			opt_repeat = strtoul(optarg, NULL, 0);
+			if (opt_repeat == 0) {
+				error("Invalid repeat count \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'A':
+			opt_all_devices = true;
+			break;
+
+		case 'O':
+			opt_output_dir = optarg;
+			break;
+
+		case 'r':
+			opt_race = true;
+			break;
+
+		case 'P':
+			ask_pin = true;
+			opt_ask_pin = optarg;
+			break;
+
+		case 'S':
+			opt_session_cache = optarg?: DEFAULT_SESSION_CACHE;
+			break;
+
+		case 'L':
+			if (!strcmp(optarg, "none"))
+				opt_latency_cache = NULL;
+			else
+				opt_latency_cache = optarg;
+			break;
+
+		case 'Q':
+			opt_pcsc = true;
+			opt_pcsc_reader = optarg;
+			break;
+
+		case 'k':
+			opt_keyring_cache = true;
+			if (optarg) {
+				if (!parse_interval_ms(optarg, &interval)) {
+					error("Cannot parse keyring timeout \"%s\"\n", optarg);
+					return 1;
+				}
+				opt_keyring_timeout = (interval + 999) / 1000;
+			}
+			break;
+
+		case 'W':
+			usb_set_keep_awake(true);
+			break;
+
+		case 'K':
+			if (!strcmp(optarg, "none"))
+				opt_lock_dir = NULL;
+			else
+				opt_lock_dir = optarg;
+			break;
+
 		default:
 			error("Unknown option %c\n", c);
 			return 1;
 		}
 	}
 
+	if (opt_race && (opt_all_devices || opt_repeat > 1)) {
+		error("--race cannot be combined with --all-devices or --repeat\n");
+		return 1;
+	}
+
+	if (opt_pcsc && (opt_race || opt_all_devices || opt_session_cache)) {
+		error("--pcsc cannot be combined with --race, --all-devices or --session-cache\n");
+		return 1;
+	}
+
+	if (ask_pin && opt_pin) {
+		error("Options --pin and --ask-pin are mutually exclusive\n");
+		return 1;
+	}
+
+	/* Keep a copy in locked memory, and scrub the PIN from our
+	 * command line so that it does not linger in ps output. */
+	pin_prompt_init(&pin_prompt, opt_pin);
+	atexit(pin_prompt_cleanup);
+	if (opt_pin)
+		explicit_bzero(opt_pin, strlen(opt_pin));
+
+	if (opt_all_devices) {
+		if (opt_exec || opt_socket || opt_keyring_cache) {
+			error("--all-devices cannot be combined with --exec, --socket or --keyring-cache\n");
+			return 1;
+		}
+
+		if (ask_pin && !start_pin_prompt(opt_ask_pin))
+			return 1;
+
+		if (!opt_type || !usb_parse_type(opt_type, &type))
+			return 1;
+
+		if (optind == argc) {
+			static char *stdin_input[] = { "-" };
+
+			return decrypt_with_all_devices(&type, &pin_prompt, stdin_input, 1,
+					opt_output, ncardopts, cardopts);
+		}
+
+		return decrypt_with_all_devices(&type, &pin_prompt, argv + optind, argc - optind,
+				opt_output, ncardopts, cardopts);
+	}
+
 	if (optind == argc) {
 		opt_input = "-";
 		infomsg("Reading data from standard input\n");
@@ -114,83 +401,386 @@ main(int argc, char **argv)
 		return 1;
 	}
 
-	secret = buffer_read_file(opt_input, 0);
-
-	(void) opt_device;
+	if (!!opt_output + !!opt_exec + !!opt_socket > 1) {
+		error("Options --output, --exec and --socket are mutually exclusive\n");
+		return 1;
+	}
 
-	if (opt_type) {
-		uusb_type_t type;
+	if (!input_reader_start(&input, opt_input))
+		return 1;
 
-		if (!usb_parse_type(opt_type, &type))
+	/* If we have unwrapped this secret recently, we need not bother
+	 * the token (or the user) at all. */
+	if (opt_keyring_cache) {
+		if (!(ciphertext = input_reader_wait(&input)))
 			return 1;
 
-		dev = usb_open_type(&type);
+		if ((cleartext = keyring_cache_lookup(ciphertext)) != NULL) {
+			infomsg("Using cached secret from kernel keyring\n");
+			goto have_cleartext;
+		}
 	}
 
-	if (dev == NULL) {
-		error("Did not find USB device\n");
+	if (ask_pin && !start_pin_prompt(opt_ask_pin))
 		return 1;
+
+	(void) opt_device;
+
+	if (opt_race) {
+		if (!opt_type || !usb_parse_type(opt_type, &type))
+			return 1;
+
+		if (!(cleartext = decrypt_race(&type, &pin_prompt, &input, ncardopts, cardopts)))
+			return 1;
+	} else if (opt_pcsc) {
+		/* pcscd owns the device; all we need is the reader name */
+		if (!(cleartext = doit(NULL, &pin_prompt, &input, ncardopts, cardopts)))
+			return 1;
+	} else {
+		if (opt_type) {
+			if (!usb_parse_type(opt_type, &type))
+				return 1;
+
+			dev = usb_open_type(&type, opt_deadline);
+		}
+
+		if (dev == NULL) {
+			error("Did not find USB device\n");
+			return 1;
+		}
+
+		if (!lock_devices(&dev, 1))
+			return 1;
+
+		/* With --repeat, run the complete open/decrypt/close cycle several
+		 * times, and fail if heap usage keeps growing after the warm-up. */
+		for (iteration = 1; true; ++iteration) {
+			cleartext = doit(dev, &pin_prompt, &input, ncardopts, cardopts);
+			usb_close(dev);
+
+			if (cleartext == NULL)
+				return 1;
+
+			if (opt_repeat > 1) {
+				heap_used = mallinfo2().uordblks;
+				debug("Iteration %u: %zu bytes of heap in use\n", iteration, heap_used);
+				if (iteration == REPEAT_WARMUP)
+					heap_baseline = heap_used;
+			}
+
+			if (iteration >= opt_repeat)
+				break;
+
+			buffer_free_secret(cleartext);
+			if (!(dev = usb_open_type(&type, opt_deadline))) {
+				error("Lost USB device after %u iterations\n", iteration);
+				return 1;
+			}
+
+			if (!lock_devices(&dev, 1))
+				return 1;
+		}
+
+		if (opt_repeat > REPEAT_WARMUP) {
+			if (heap_used > heap_baseline) {
+				error("Heap usage grew by %zu bytes over %u iterations, something is leaking\n",
+						heap_used - heap_baseline, opt_repeat - REPEAT_WARMUP);
+				return 1;
+			}
+			infomsg("Heap usage stayed flat over %u iterations\n", opt_repeat - REPEAT_WARMUP);
+		}
 	}
 
-	yubikey_init();
+	if (opt_keyring_cache)
+		keyring_cache_store(input.data, cleartext, opt_keyring_timeout);
 
-	if (!(cleartext = doit(dev, opt_pin, secret, ncardopts, cardopts)))
-		return 1;
+have_cleartext:
+	buffer_free(input.data);
+
+	if (opt_exec || opt_socket) {
+		int fd;
+
+		fd = handoff_create_memfd(cleartext);
+		buffer_free_secret(cleartext);
+		if (fd < 0)
+			return 1;
+
+		if (opt_exec) {
+			handoff_exec(fd, opt_exec);
+			return 1;
+		}
+
+		if (!handoff_send_fd(fd, opt_socket))
+			return 1;
+
+		close(fd);
+		return 0;
+	}
 
 	infomsg("Writing data to \"%s\"\n", opt_output?: "<stdout>");
 	if (!buffer_write_file(opt_output, cleartext))
 		return 1;
 
-	buffer_free(cleartext);
+	buffer_free_secret(cleartext);
 	return 0;
 }
 
+/*
+ * Wait for our turn on the devices, so that we don't collide with
+ * another instance of utoken-decrypt. Devices we could not get hold of
+ * are closed.
+ */
+static unsigned int
+lock_devices(uusb_dev_t **devs, unsigned int ndevs)
+{
+	if (opt_lock_dir == NULL)
+		return ndevs;
+	return uusb_dev_lock_all(devs, ndevs, opt_lock_dir, opt_deadline);
+}
+
+/*
+ * Spread the inputs across all tokens of the given type. With more than
+ * one input, each cleartext goes to a file of the same base name below
+ * the --output-dir directory.
+ */
+static int
+decrypt_with_all_devices(const uusb_type_t *type, pin_prompt_t *pin_prompt,
+		char **inputs, unsigned int ninputs, const char *output,
+		unsigned int ncardopts, char **cardopts)
+{
+	uusb_dev_t *devs[MAX_DEVICES];
+	utoken_config_t config;
+	utoken_job_t *jobs;
+	unsigned int i, ndevs;
+	int rv = 0;
+
+	if (ninputs > 1 && opt_output_dir == NULL) {
+		error("Decrypting several inputs requires --output-dir\n");
+		return 1;
+	}
+
+	jobs = calloc(ninputs, sizeof(*jobs));
+	for (i = 0; i < ninputs; ++i) {
+		jobs[i].name = inputs[i];
+		if (!(jobs[i].ciphertext = buffer_read_file(inputs[i], 0))) {
+			rv = 1;
+			goto out;
+		}
+	}
+
+	ndevs = usb_open_all_type(type, opt_deadline, devs, MAX_DEVICES);
+	if (ndevs == 0) {
+		error("Did not find USB device\n");
+		rv = 1;
+		goto out;
+	}
+
+	if (!(ndevs = lock_devices(devs, ndevs))) {
+		rv = 1;
+		goto out;
+	}
+
+	infomsg("Decrypting %u input(s) using %u device(s)\n", ninputs, ndevs);
+
+	memset(&config, 0, sizeof(config));
+	if (!pin_prompt_wait(pin_prompt, &config.pin)) {
+		rv = 1;
+		goto out_close;
+	}
+	config.ncardopts = ncardopts;
+	config.cardopts = cardopts;
+	config.latency_cache = opt_latency_cache;
+	config.deadline = opt_deadline;
+
+	if (!utoken_pool_decrypt(devs, ndevs, &config, jobs, ninputs))
+		rv = 1;
+
+out_close:
+	for (i = 0; i < ndevs; ++i)
+		usb_close(devs[i]);
+
+	for (i = 0; i < ninputs; ++i) {
+		utoken_job_t *job = &jobs[i];
+		char path[PATH_MAX];
+		const char *name;
+
+		if (job->cleartext == NULL) {
+			error("Unable to decrypt %s\n", job->name);
+			continue;
+		}
+
+		if (opt_output_dir) {
+			if ((name = strrchr(job->name, '/')) != NULL)
+				name++;
+			else
+				name = job->name;
+
+			snprintf(path, sizeof(path), "%s/%s", opt_output_dir, name);
+			output = path;
+		}
+
+		infomsg("Writing data to \"%s\"\n", output?: "<stdout>");
+		if (!buffer_write_file(output, job->cleartext))
+			rv = 1;
+	}
+
+out:
+	for (i = 0; i < ninputs; ++i) {
+		if (jobs[i].ciphertext)
+			buffer_free(jobs[i].ciphertext);
+		if (jobs[i].cleartext)
+			buffer_free_secret(jobs[i].cleartext);
+	}
+	free(jobs);
+	return rv;
+}
+
+/*
+ * Start decrypting on all tokens of the given type at once, and go with
+ * the first one that answers.
+ */
+static buffer_t *
+decrypt_race(const uusb_type_t *type, pin_prompt_t *pin_prompt, input_reader_t *input,
+		unsigned int ncardopts, char **cardopts)
+{
+	uusb_dev_t *devs[MAX_DEVICES];
+	utoken_config_t config;
+	buffer_t *secret, *cleartext = NULL;
+	unsigned int i, ndevs;
+
+	ndevs = usb_open_all_type(type, opt_deadline, devs, MAX_DEVICES);
+	if (ndevs == 0) {
+		error("Did not find USB device\n");
+		return NULL;
+	}
+
+	if (!(ndevs = lock_devices(devs, ndevs)))
+		return NULL;
+
+	if (!(secret = input_reader_wait(input)))
+		goto out;
+
+	/* The race picks up the PIN once the user has entered it */
+	memset(&config, 0, sizeof(config));
+	config.pin_prompt = pin_prompt;
+	config.ncardopts = ncardopts;
+	config.cardopts = cardopts;
+	config.latency_cache = opt_latency_cache;
+	config.deadline = opt_deadline;
+
+	cleartext = utoken_race_decrypt(devs, ndevs, &config, secret);
+
+out:
+	for (i = 0; i < ndevs; ++i)
+		usb_close(devs[i]);
+	return cleartext;
+}
+
+static bool
+setup_card(ifd_card_t *card, unsigned int ncardopts, char **cardopts)
+{
+	unsigned int i;
+
+	for (i = 0; i < ncardopts; ++i) {
+		if (!ifd_card_set_option(card, cardopts[i]))
+			return false;
+	}
+
+	return ifd_card_connect(card);
+}
+
+/*
+ * Ownership: the card refers to the reader, and the reader refers to the
+ * USB device. They have to be freed in reverse order. The caller owns
+ * the device, and the returned cleartext.
+ * With a NULL device, we talk to the card through pcscd.
+ */
 buffer_t *
-doit(uusb_dev_t *dev, const char *pin, buffer_t *ciphertext, unsigned int ncardopts, char **cardopts)
+doit(uusb_dev_t *dev, pin_prompt_t *pin_prompt, input_reader_t *input, unsigned int ncardopts, char **cardopts)
 {
+	buffer_t *ciphertext;
+	const char *pin;
 	ccid_reader_t *reader;
-	ifd_card_t *card;
-	buffer_t *cleartext;
+	ifd_card_t *card = NULL;
+	buffer_t *cleartext = NULL;
+	bool pin_verified = false;
 
-	if (!(reader = ccid_reader_create(dev))) {
+	if (dev == NULL) {
+		if (!(reader = ccid_reader_create_pcsc(opt_pcsc_reader, opt_deadline)))
+			return NULL;
+	} else if (!(reader = ccid_reader_create(dev, opt_latency_cache, opt_deadline))) {
 		error("Unable to create reader for USB device\n");
 		return NULL;
 	}
 
 	if (!ccid_reader_select_slot(reader, 0))
-		return NULL;
+		goto out;
 
-	card = ccid_reader_identify_card(reader, 0);
-	if (card == NULL)
-		return NULL;
+	if (opt_session_cache)
+		card = ifd_session_restore(opt_session_cache, dev, reader, 0);
 
-	if (ncardopts) {
-		unsigned int i;
-		for (i = 0; i < ncardopts; ++i) {
-			if (!ifd_card_set_option(card, cardopts[i]))
-				return NULL;
-		}
+	if (card != NULL && !setup_card(card, ncardopts, cardopts)) {
+		infomsg("Unable to resume card session, starting over\n");
+		ifd_session_forget(opt_session_cache, dev);
+		ifd_card_free(card);
+		card = NULL;
+
+		/* Drop whatever security status the card may still have */
+		ccid_reader_poweroff(reader, 0);
 	}
 
-	if (!ifd_card_connect(card))
-		return NULL;
+	if (card == NULL) {
+		card = ccid_reader_identify_card(reader, 0);
+		if (card == NULL)
+			goto out;
+
+		if (!setup_card(card, ncardopts, cardopts))
+			goto out;
+
+		if (opt_session_cache)
+			ifd_session_save(opt_session_cache, dev, card);
+	}
+
+	/* Everything up to here overlaps with the user typing the PIN */
+	if (!pin_prompt_wait(pin_prompt, &pin))
+		goto out;
 
 	if (pin != NULL) {
 		unsigned int retries_left;
 
 		if (!ifd_card_verify(card, pin, strlen(pin), &retries_left)) {
 			error("Wrong PIN, %u attempts left\n", retries_left);
-			return NULL;
+			goto out;
 		}
 
 		infomsg("Successfully verified PIN.\n");
+		pin_verified = true;
 	}
 
+	/* By now, the input should be there */
+	if (!(ciphertext = input_reader_wait(input)))
+		goto out;
+
 	cleartext = ifd_card_decipher(card, ciphertext);
+	ccid_reader_save_latency(reader);
+
 	if (cleartext == NULL) {
 		error("Card failed to decrypt secret\n");
-		return NULL;
+		if (opt_session_cache)
+			ifd_session_forget(opt_session_cache, dev);
+	}
+
+out:
+	/* Do not leave the PIN verified for the next one to open the device.
+	 * This ends the cached session, too. */
+	if (dev != NULL && pin_verified) {
+		ccid_reader_poweroff(reader, 0);
+		if (opt_session_cache)
+			ifd_session_forget(opt_session_cache, dev);
 	}
 
+	if (card)
+		ifd_card_free(card);
+	ccid_reader_free(reader);
 	return cleartext;
 }
@@ -0,0 +1,539 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Client side of pcscd's local socket protocol. Every request consists of
+ * a header (message size and command code), followed by a fixed size
+ * struct; pcscd answers with the same struct, with the output fields and
+ * the return code filled in. Everything is in host byte order.
+ *
+ * The message layouts below follow winscard_msg.h in pcsc-lite. We only
+ * implement what we need to exchange APDUs with a card: establishing a
+ * context, finding a reader, connecting to the card and transmitting.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "pcsc.h"
+#include "util.h"
+
+#define PCSC_PROTOCOL_MAJOR		4
+#define PCSC_PROTOCOL_MINOR		4
+
+#define PCSC_MAX_READERNAME		128
+#define PCSC_MAX_ATR_SIZE		33
+#define PCSC_MAX_READERS		16
+#define PCSC_MAX_BUFFER_SIZE_EXTENDED	(4 + 3 + (1 << 16) + 3 + 2)
+
+/* How long we wait for pcscd if the caller did not give a deadline */
+#define PCSC_TIMEOUT_DEFAULT		30000
+
+enum {
+	SCARD_ESTABLISH_CONTEXT		= 0x01,
+	SCARD_RELEASE_CONTEXT		= 0x02,
+	SCARD_CONNECT			= 0x04,
+	SCARD_DISCONNECT		= 0x06,
+	SCARD_BEGIN_TRANSACTION		= 0x07,
+	SCARD_END_TRANSACTION		= 0x08,
+	SCARD_TRANSMIT			= 0x09,
+	CMD_VERSION			= 0x11,
+	CMD_GET_READERS_STATE		= 0x12,
+};
+
+#define SCARD_S_SUCCESS			0x00000000
+#define SCARD_SCOPE_SYSTEM		2
+#define SCARD_SHARE_SHARED		2
+#define SCARD_PROTOCOL_T0		1
+#define SCARD_PROTOCOL_T1		2
+#define SCARD_LEAVE_CARD		0
+#define SCARD_RESET_CARD		1
+
+/* Bits in reader_state.state */
+#define SCARD_PRESENT			0x0004
+
+struct pcsc_header {
+	uint32_t		size;
+	uint32_t		command;
+};
+
+struct pcsc_version {
+	int32_t			major;
+	int32_t			minor;
+	uint32_t		rv;
+};
+
+struct pcsc_establish {
+	uint32_t		scope;
+	uint32_t		context;
+	uint32_t		rv;
+};
+
+struct pcsc_release {
+	uint32_t		context;
+	uint32_t		rv;
+};
+
+struct pcsc_connect {
+	uint32_t		context;
+	char			reader[PCSC_MAX_READERNAME];
+	uint32_t		share_mode;
+	uint32_t		preferred_protocols;
+	int32_t			card;
+	uint32_t		active_protocol;
+	uint32_t		rv;
+};
+
+/* Used for SCARD_DISCONNECT and SCARD_END_TRANSACTION */
+struct pcsc_disposition {
+	int32_t			card;
+	uint32_t		disposition;
+	uint32_t		rv;
+};
+
+struct pcsc_begin {
+	int32_t			card;
+	uint32_t		rv;
+};
+
+struct pcsc_transmit {
+	int32_t			card;
+	uint32_t		send_pci_protocol;
+	uint32_t		send_pci_length;
+	uint32_t		send_length;
+	uint32_t		recv_pci_protocol;
+	uint32_t		recv_pci_length;
+	uint32_t		recv_length;
+	uint32_t		rv;
+};
+
+struct pcsc_reader_state {
+	char			name[PCSC_MAX_READERNAME];
+	uint32_t		event_counter;
+	uint32_t		state;
+	int32_t			sharing;
+	unsigned char		atr[PCSC_MAX_ATR_SIZE];
+	uint32_t		atr_len;
+	uint32_t		protocol;
+};
+
+struct pcsc_conn {
+	int			fd;
+	uint64_t		deadline;
+
+	uint32_t		context;
+	bool			have_context;
+	int32_t			card;
+	bool			have_card;
+	bool			in_transaction;
+	uint32_t		protocol;
+
+	char			reader[PCSC_MAX_READERNAME];
+	unsigned int		atr_len;
+	unsigned char		atr[PCSC_MAX_ATR_SIZE];
+};
+
+static long
+pcsc_timeout(const pcsc_conn_t *conn)
+{
+	return deadline_cap_timeout(conn->deadline, PCSC_TIMEOUT_DEFAULT);
+}
+
+static bool
+pcsc_wait(pcsc_conn_t *conn, short events)
+{
+	struct pollfd pfd = { .fd = conn->fd, .events = events };
+	long timeout = pcsc_timeout(conn);
+	int n;
+
+	do {
+		n = poll(&pfd, 1, timeout);
+	} while (n < 0 && errno == EINTR);
+
+	if (n < 0) {
+		error("pcscd: poll: %m\n");
+		return false;
+	}
+	if (n == 0) {
+		error("pcscd: timed out\n");
+		return false;
+	}
+	return true;
+}
+
+static bool
+pcsc_send(pcsc_conn_t *conn, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len) {
+		ssize_t n;
+
+		if (!pcsc_wait(conn, POLLOUT))
+			return false;
+
+		n = send(conn->fd, p, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			error("pcscd: send: %m\n");
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+pcsc_recv(pcsc_conn_t *conn, void *data, size_t len)
+{
+	unsigned char *p = data;
+
+	while (len) {
+		ssize_t n;
+
+		if (!pcsc_wait(conn, POLLIN))
+			return false;
+
+		n = recv(conn->fd, p, len, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			error("pcscd: recv: %m\n");
+			return false;
+		}
+		if (n == 0) {
+			error("pcscd closed the connection\n");
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+pcsc_send_request(pcsc_conn_t *conn, uint32_t command, const void *data, size_t len)
+{
+	struct pcsc_header hdr = { .size = len, .command = command };
+
+	return pcsc_send(conn, &hdr, sizeof(hdr))
+	    && (len == 0 || pcsc_send(conn, data, len));
+}
+
+/*
+ * Simple request/response exchange; the struct is updated in place.
+ * The caller has to check the return code.
+ */
+static bool
+pcsc_call(pcsc_conn_t *conn, uint32_t command, void *data, size_t len)
+{
+	return pcsc_send_request(conn, command, data, len)
+	    && pcsc_recv(conn, data, len);
+}
+
+static bool
+pcsc_check(const char *what, uint32_t rv)
+{
+	if (rv != SCARD_S_SUCCESS) {
+		error("pcscd: %s failed with error 0x%08x\n", what, rv);
+		return false;
+	}
+	return true;
+}
+
+static bool
+pcsc_open_socket(pcsc_conn_t *conn)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	const char *path;
+
+	if (!(path = getenv("PCSCLITE_CSOCK_NAME")))
+		path = PCSC_SOCKET_PATH;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		error("pcscd socket path %s too long\n", path);
+		return false;
+	}
+	strcpy(sun.sun_path, path);
+
+	if ((conn->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		error("Cannot create socket: %m\n");
+		return false;
+	}
+
+	if (connect(conn->fd, (struct sockaddr *) &sun, sizeof(sun)) < 0) {
+		error("Cannot connect to pcscd at %s: %m\n", path);
+		return false;
+	}
+
+	debug("Connected to pcscd at %s\n", path);
+	return true;
+}
+
+static bool
+pcsc_negotiate_version(pcsc_conn_t *conn)
+{
+	struct pcsc_version msg = {
+		.major = PCSC_PROTOCOL_MAJOR,
+		.minor = PCSC_PROTOCOL_MINOR,
+	};
+
+	if (!pcsc_call(conn, CMD_VERSION, &msg, sizeof(msg)))
+		return false;
+
+	if (msg.rv != SCARD_S_SUCCESS) {
+		error("pcscd does not speak protocol version %d.%d (it has %d.%d)\n",
+				PCSC_PROTOCOL_MAJOR, PCSC_PROTOCOL_MINOR,
+				msg.major, msg.minor);
+		return false;
+	}
+
+	return true;
+}
+
+static bool
+pcsc_establish_context(pcsc_conn_t *conn)
+{
+	struct pcsc_establish msg = { .scope = SCARD_SCOPE_SYSTEM };
+
+	if (!pcsc_call(conn, SCARD_ESTABLISH_CONTEXT, &msg, sizeof(msg))
+	 || !pcsc_check("SCardEstablishContext", msg.rv))
+		return false;
+
+	conn->context = msg.context;
+	conn->have_context = true;
+	return true;
+}
+
+/*
+ * pcscd has no request for listing readers; clients get the complete
+ * reader state table and pick it apart themselves.
+ */
+static bool
+pcsc_find_reader(pcsc_conn_t *conn, const char *name)
+{
+	struct pcsc_reader_state states[PCSC_MAX_READERS];
+	unsigned int i;
+
+	if (!pcsc_send_request(conn, CMD_GET_READERS_STATE, NULL, 0)
+	 || !pcsc_recv(conn, states, sizeof(states)))
+		return false;
+
+	for (i = 0; i < PCSC_MAX_READERS; ++i) {
+		struct pcsc_reader_state *rs = &states[i];
+
+		rs->name[PCSC_MAX_READERNAME - 1] = '\0';
+		if (rs->name[0] == '\0')
+			continue;
+
+		debug("pcscd reader \"%s\", state 0x%x\n", rs->name, rs->state);
+		if (name && !strstr(rs->name, name))
+			continue;
+
+		if (!(rs->state & SCARD_PRESENT)) {
+			if (name)
+				error("No card in reader \"%s\"\n", rs->name);
+			continue;
+		}
+
+		if (rs->atr_len > PCSC_MAX_ATR_SIZE)
+			continue;
+
+		strcpy(conn->reader, rs->name);
+		memcpy(conn->atr, rs->atr, rs->atr_len);
+		conn->atr_len = rs->atr_len;
+		return true;
+	}
+
+	if (name)
+		error("pcscd does not know of a reader named \"%s\" with a card\n", name);
+	else
+		error("pcscd does not have a reader with a card in it\n");
+	return false;
+}
+
+static bool
+pcsc_connect_card(pcsc_conn_t *conn)
+{
+	struct pcsc_connect msg;
+	struct pcsc_begin begin;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.context = conn->context;
+	strcpy(msg.reader, conn->reader);
+	msg.share_mode = SCARD_SHARE_SHARED;
+	msg.preferred_protocols = SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1;
+
+	if (!pcsc_call(conn, SCARD_CONNECT, &msg, sizeof(msg))
+	 || !pcsc_check("SCardConnect", msg.rv))
+		return false;
+
+	conn->card = msg.card;
+	conn->have_card = true;
+	conn->protocol = msg.active_protocol;
+
+	/* Keep other clients away from the card until we're done, so that
+	 * nobody gets to use the PIN we verify. */
+	begin.card = conn->card;
+	begin.rv = 0;
+	if (!pcsc_call(conn, SCARD_BEGIN_TRANSACTION, &begin, sizeof(begin))
+	 || !pcsc_check("SCardBeginTransaction", begin.rv))
+		return false;
+
+	conn->in_transaction = true;
+	return true;
+}
+
+pcsc_conn_t *
+pcsc_connect(const char *reader_name, uint64_t deadline)
+{
+	pcsc_conn_t *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	conn->fd = -1;
+	conn->deadline = deadline;
+
+	if (!pcsc_open_socket(conn)
+	 || !pcsc_negotiate_version(conn)
+	 || !pcsc_establish_context(conn)
+	 || !pcsc_find_reader(conn, reader_name)
+	 || !pcsc_connect_card(conn)) {
+		pcsc_disconnect(conn);
+		return NULL;
+	}
+
+	infomsg("Using reader \"%s\" through pcscd (T=%u)\n", conn->reader,
+			conn->protocol == SCARD_PROTOCOL_T1);
+	return conn;
+}
+
+/*
+ * When we're done, reset the card so that the PIN we verified does not
+ * stay valid for the next pcscd client.
+ */
+void
+pcsc_disconnect(pcsc_conn_t *conn)
+{
+	if (conn->in_transaction) {
+		struct pcsc_disposition msg = { .card = conn->card, .disposition = SCARD_RESET_CARD };
+
+		if (pcsc_call(conn, SCARD_END_TRANSACTION, &msg, sizeof(msg)))
+			pcsc_check("SCardEndTransaction", msg.rv);
+	}
+
+	if (conn->have_card) {
+		struct pcsc_disposition msg = { .card = conn->card, .disposition = SCARD_LEAVE_CARD };
+
+		if (pcsc_call(conn, SCARD_DISCONNECT, &msg, sizeof(msg)))
+			pcsc_check("SCardDisconnect", msg.rv);
+	}
+
+	if (conn->have_context) {
+		struct pcsc_release msg = { .context = conn->context };
+
+		if (pcsc_call(conn, SCARD_RELEASE_CONTEXT, &msg, sizeof(msg)))
+			pcsc_check("SCardReleaseContext", msg.rv);
+	}
+
+	if (conn->fd >= 0)
+		close(conn->fd);
+	free(conn);
+}
+
+const char *
+pcsc_get_reader_name(const pcsc_conn_t *conn)
+{
+	return conn->reader;
+}
+
+unsigned int
+pcsc_get_atr(const pcsc_conn_t *conn, unsigned char *atr, unsigned int size)
+{
+	if (conn->atr_len > size)
+		return 0;
+
+	memcpy(atr, conn->atr, conn->atr_len);
+	return conn->atr_len;
+}
+
+/*
+ * Send the APDU and append the response to rapdu. The APDU is sent as
+ * a separate message after the transmit request, and pcscd returns the
+ * response the same way, provided the transmit succeeded.
+ */
+bool
+pcsc_transmit(pcsc_conn_t *conn, buffer_t *apdu, buffer_t *rapdu)
+{
+	struct pcsc_transmit msg;
+	unsigned int send_len = buffer_available(apdu);
+	unsigned int room = buffer_tailroom(rapdu);
+
+	if (send_len > PCSC_MAX_BUFFER_SIZE_EXTENDED) {
+		error("APDU too large for pcscd\n");
+		return false;
+	}
+	if (room > PCSC_MAX_BUFFER_SIZE_EXTENDED)
+		room = PCSC_MAX_BUFFER_SIZE_EXTENDED;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.card = conn->card;
+	msg.send_pci_protocol = conn->protocol;
+	msg.send_pci_length = 2 * sizeof(unsigned long);
+	msg.send_length = send_len;
+	msg.recv_pci_protocol = conn->protocol;
+	msg.recv_pci_length = 2 * sizeof(unsigned long);
+	msg.recv_length = room;
+
+	if (opt_debug > 1) {
+		debug2("pcscd: sending APDU\n");
+		hexdump(buffer_read_pointer(apdu), send_len, debug2, 4);
+	}
+
+	if (!pcsc_send_request(conn, SCARD_TRANSMIT, &msg, sizeof(msg))
+	 || !pcsc_send(conn, buffer_read_pointer(apdu), send_len)
+	 || !pcsc_recv(conn, &msg, sizeof(msg)))
+		return false;
+
+	if (!pcsc_check("SCardTransmit", msg.rv))
+		return false;
+
+	if (msg.recv_length > room) {
+		error("pcscd: response too large (%u bytes)\n", msg.recv_length);
+		return false;
+	}
+
+	if (!pcsc_recv(conn, buffer_write_pointer(rapdu), msg.recv_length))
+		return false;
+	rapdu->wpos += msg.recv_length;
+
+	if (opt_debug > 1) {
+		debug2("pcscd: received response\n");
+		hexdump(buffer_read_pointer(rapdu), buffer_available(rapdu), debug2, 4);
+	}
+
+	return true;
+}
@@ -0,0 +1,45 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef PCSC_H
+#define PCSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "bufparser.h"
+
+typedef struct pcsc_conn	pcsc_conn_t;
+
+/* Where pcscd listens, unless overridden by $PCSCLITE_CSOCK_NAME */
+#define PCSC_SOCKET_PATH	"/run/pcscd/pcscd.comm"
+
+/*
+ * Talk to a card through pcscd, without going through libpcsclite.
+ * If reader_name is NULL, we use the first reader that has a card in it;
+ * otherwise the first one whose name contains the given string.
+ */
+extern pcsc_conn_t *	pcsc_connect(const char *reader_name, uint64_t deadline);
+extern void		pcsc_disconnect(pcsc_conn_t *);
+extern const char *	pcsc_get_reader_name(const pcsc_conn_t *);
+extern unsigned int	pcsc_get_atr(const pcsc_conn_t *, unsigned char *atr, unsigned int size);
+extern bool		pcsc_transmit(pcsc_conn_t *, buffer_t *apdu, buffer_t *rapdu);
+
+#endif /* PCSC_H */
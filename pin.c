@@ -0,0 +1,459 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Ask the user for the PIN, either on the terminal, or through the
+ * password agent protocol used by systemd (which is what plymouth and
+ * systemd-tty-ask-password-agent listen to in the initrd).
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+
+#include "pin.h"
+#include "util.h"
+
+#define ASK_PASSWORD_DIR	"/run/systemd/ask-password"
+
+int
+pin_prompt_parse_mode(const char *name)
+{
+	if (name == NULL)
+		return isatty(0)? PIN_PROMPT_TTY : PIN_PROMPT_AGENT;
+	if (!strcmp(name, "tty"))
+		return PIN_PROMPT_TTY;
+	if (!strcmp(name, "agent"))
+		return PIN_PROMPT_AGENT;
+	return PIN_PROMPT_NONE;
+}
+
+static bool
+pin_prompt_set(pin_prompt_t *prompt, const char *pin, size_t len)
+{
+	buffer_t *bp = prompt->pin;
+
+	if (len > PIN_MAX_LEN) {
+		error("PIN too long\n");
+		return false;
+	}
+
+	memcpy(bp->data, pin, len);
+	bp->data[len] = '\0';
+	bp->wpos = len;
+	return true;
+}
+
+void
+pin_prompt_init(pin_prompt_t *prompt, const char *fixed_pin)
+{
+	memset(prompt, 0, sizeof(*prompt));
+	prompt->pin = buffer_alloc_secret(PIN_MAX_LEN + 1);
+	prompt->notify_fd = -1;
+
+	if (fixed_pin) {
+		prompt->mode = PIN_PROMPT_FIXED;
+		prompt->okay = pin_prompt_set(prompt, fixed_pin, strlen(fixed_pin));
+	}
+}
+
+struct pin_tty {
+	int			fd;
+	struct termios		saved;
+};
+
+/*
+ * This is also run if the prompt is cancelled, so that we do not
+ * leave the terminal with echo turned off.
+ */
+static void
+pin_tty_restore(void *arg)
+{
+	struct pin_tty *tty = arg;
+
+	tcsetattr(tty->fd, TCSAFLUSH, &tty->saved);
+	if (write(tty->fd, "\n", 1) < 0)
+		;
+}
+
+static bool
+pin_read_tty(pin_prompt_t *prompt)
+{
+	unsigned char *data = prompt->pin->data;
+	unsigned int len = 0;
+	struct termios noecho;
+	struct pin_tty tty;
+	bool okay = false;
+
+	if ((tty.fd = open("/dev/tty", O_RDWR | O_CLOEXEC)) < 0) {
+		error("Cannot open /dev/tty: %m\n");
+		return false;
+	}
+
+	if (tcgetattr(tty.fd, &tty.saved) < 0) {
+		error("Cannot get terminal attributes: %m\n");
+		close(tty.fd);
+		return false;
+	}
+
+	noecho = tty.saved;
+	noecho.c_lflag &= ~ECHO;
+	if (tcsetattr(tty.fd, TCSAFLUSH, &noecho) < 0) {
+		error("Cannot disable echo: %m\n");
+		close(tty.fd);
+		return false;
+	}
+
+	pthread_cleanup_push(pin_tty_restore, &tty);
+
+	if (write(tty.fd, prompt->message, strlen(prompt->message)) >= 0
+	 && write(tty.fd, ": ", 2) >= 0) {
+		while (true) {
+			struct pollfd pfd = { .fd = tty.fd, .events = POLLIN };
+			long timeout = deadline_cap_timeout(prompt->deadline, -1);
+			unsigned char c;
+			int n;
+
+			if (prompt->deadline && timeout == 0) {
+				error("Deadline expired while waiting for PIN\n");
+				break;
+			}
+
+			if ((n = poll(&pfd, 1, timeout)) < 0 && errno != EINTR) {
+				error("poll: %m\n");
+				break;
+			}
+			if (n <= 0)
+				continue;
+
+			n = read(tty.fd, &c, 1);
+			if (n < 0 && errno == EINTR)
+				continue;
+
+			/* A hangup or ^D must not send a truncated PIN to the card */
+			if (n < 0) {
+				error("Cannot read PIN: %m\n");
+				break;
+			}
+			if (n == 0) {
+				error("No PIN entered\n");
+				break;
+			}
+
+			if (c == '\n' || c == '\r') {
+				okay = true;
+				break;
+			}
+
+			if (len >= PIN_MAX_LEN) {
+				error("PIN too long\n");
+				break;
+			}
+			data[len++] = c;
+		}
+	}
+
+	pthread_cleanup_pop(1);
+	close(tty.fd);
+
+	data[len] = '\0';
+	prompt->pin->wpos = len;
+	return okay;
+}
+
+/*
+ * Receive the agent's answer. Only root may answer; anything else is ignored.
+ * A reply starting with "+" carries the password, "-" means the user
+ * cancelled.
+ */
+static int
+pin_agent_recv(pin_prompt_t *prompt, int sock)
+{
+	union {
+		struct cmsghdr	align;
+		char		buf[CMSG_SPACE(sizeof(struct ucred))];
+	} control;
+	buffer_t *reply;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct ucred *cred = NULL;
+	int n, rv = 0;
+
+	reply = buffer_alloc_secret(PIN_MAX_LEN + 2);
+
+	iov.iov_base = reply->data;
+	iov.iov_len = reply->size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control;
+	msg.msg_controllen = sizeof(control);
+
+	if ((n = recvmsg(sock, &msg, MSG_DONTWAIT | MSG_TRUNC)) < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			error("Cannot receive password reply: %m\n");
+			rv = -1;
+		}
+		goto out;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS)
+			cred = (struct ucred *) CMSG_DATA(cmsg);
+	}
+
+	if (cred == NULL || cred->uid != 0) {
+		debug("Ignoring password reply from unprivileged sender\n");
+		goto out;
+	}
+
+	if (n > reply->size) {
+		error("PIN too long\n");
+		rv = -1;
+	} else if (n >= 1 && reply->data[0] == '+') {
+		rv = pin_prompt_set(prompt, (char *) reply->data + 1, n - 1)? 1 : -1;
+	} else if (n >= 1 && reply->data[0] == '-') {
+		error("PIN entry was cancelled\n");
+		rv = -1;
+	}
+
+out:
+	buffer_free_secret(reply);
+	return rv;
+}
+
+/*
+ * Withdraw the question, also when the prompt is cancelled.
+ */
+static void
+pin_agent_cleanup(void *ask_path)
+{
+	unlink(ask_path);
+}
+
+static bool
+pin_ask_agent(pin_prompt_t *prompt)
+{
+	char sock_path[PATH_MAX], ask_path[PATH_MAX], tmp_path[PATH_MAX];
+	struct sockaddr_un sun;
+	bool okay = false;
+	int sock, one = 1, rv = 0;
+	FILE *fp;
+
+	snprintf(sock_path, sizeof(sock_path), "%s/sck.utoken-%d", ASK_PASSWORD_DIR, (int) getpid());
+	snprintf(ask_path, sizeof(ask_path), "%s/ask.utoken-%d", ASK_PASSWORD_DIR, (int) getpid());
+	snprintf(tmp_path, sizeof(tmp_path), "%s/.tmp.utoken-%d", ASK_PASSWORD_DIR, (int) getpid());
+
+	if (mkdir(ASK_PASSWORD_DIR, 0755) < 0 && errno != EEXIST) {
+		error("Cannot create %s: %m\n", ASK_PASSWORD_DIR);
+		return false;
+	}
+
+	if ((sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		error("Cannot create socket: %m\n");
+		return false;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(sock_path) >= sizeof(sun.sun_path)) {
+		error("Socket path %s too long\n", sock_path);
+		goto out_close;
+	}
+	strcpy(sun.sun_path, sock_path);
+
+	unlink(sock_path);
+	if (bind(sock, (struct sockaddr *) &sun, sizeof(sun)) < 0
+	 || setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) < 0) {
+		error("Cannot set up socket %s: %m\n", sock_path);
+		goto out_close;
+	}
+
+	/* Agents watch the directory for ask.* files, so create it atomically */
+	if ((fp = fopen(tmp_path, "w")) == NULL) {
+		error("Cannot create %s: %m\n", tmp_path);
+		goto out_unlink_sock;
+	}
+
+	fprintf(fp, "[Ask]\n");
+	fprintf(fp, "PID=%d\n", (int) getpid());
+	fprintf(fp, "Socket=%s\n", sock_path);
+	fprintf(fp, "AcceptCached=0\n");
+	fprintf(fp, "Echo=0\n");
+	/* NotAfter is in microseconds on the monotonic clock */
+	fprintf(fp, "NotAfter=%llu\n", (unsigned long long) prompt->deadline * 1000);
+	fprintf(fp, "Message=%s\n", prompt->message);
+	fprintf(fp, "Id=utoken-decrypt\n");
+
+	if (fclose(fp) != 0 || rename(tmp_path, ask_path) < 0) {
+		error("Cannot create %s: %m\n", ask_path);
+		unlink(tmp_path);
+		goto out_unlink_sock;
+	}
+
+	debug("Waiting for password agent to answer %s\n", ask_path);
+	pthread_cleanup_push(pin_agent_cleanup, ask_path);
+	while (rv == 0) {
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		long timeout = deadline_cap_timeout(prompt->deadline, -1);
+
+		if (prompt->deadline && timeout == 0) {
+			error("Deadline expired while waiting for PIN\n");
+			break;
+		}
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			error("poll: %m\n");
+			break;
+		}
+
+		rv = pin_agent_recv(prompt, sock);
+	}
+
+	pthread_cleanup_pop(1);
+	okay = (rv > 0);
+
+out_unlink_sock:
+	unlink(sock_path);
+out_close:
+	close(sock);
+	return okay;
+}
+
+static void *
+pin_prompt_thread(void *arg)
+{
+	pin_prompt_t *prompt = arg;
+
+	opt_debug = prompt->debug;
+	if (prompt->mode == PIN_PROMPT_TTY)
+		prompt->okay = pin_read_tty(prompt);
+	else
+		prompt->okay = pin_ask_agent(prompt);
+
+	if (eventfd_write(prompt->notify_fd, 1) < 0)
+		error("Cannot signal end of PIN prompt: %m\n");
+	return NULL;
+}
+
+/*
+ * Start asking for the PIN in the background.
+ */
+bool
+pin_prompt_start(pin_prompt_t *prompt, int mode, const char *message, uint64_t deadline)
+{
+	prompt->mode = mode;
+	prompt->message = message;
+	prompt->deadline = deadline;
+	prompt->debug = opt_debug;
+
+	if (prompt->notify_fd < 0
+	 && (prompt->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+		error("Unable to create eventfd: %m\n");
+		return false;
+	}
+
+	if (pthread_create(&prompt->thread, NULL, pin_prompt_thread, prompt) != 0) {
+		error("Unable to start PIN prompt\n");
+		return false;
+	}
+
+	prompt->running = true;
+	return true;
+}
+
+/*
+ * Wait for the user to enter the PIN. If no PIN was asked for, *pin_ret
+ * is set to NULL. Returns false if we asked, but did not get one.
+ */
+bool
+pin_prompt_wait(pin_prompt_t *prompt, const char **pin_ret)
+{
+	*pin_ret = NULL;
+
+	if (prompt->running) {
+		pthread_join(prompt->thread, NULL);
+		prompt->running = false;
+	}
+
+	if (prompt->mode == PIN_PROMPT_NONE)
+		return true;
+
+	if (!prompt->okay)
+		return false;
+
+	*pin_ret = (const char *) prompt->pin->data;
+	return true;
+}
+
+/*
+ * Check whether pin_prompt_wait() would return without blocking.
+ */
+bool
+pin_prompt_ready(const pin_prompt_t *prompt)
+{
+	struct pollfd pfd = { .fd = prompt->notify_fd, .events = POLLIN };
+
+	if (!prompt->running)
+		return true;
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * For callers that want to wait for the PIN along with other things.
+ * Returns -1 if there is nothing to wait for.
+ */
+int
+pin_prompt_get_fd(const pin_prompt_t *prompt)
+{
+	if (!prompt->running)
+		return -1;
+	return prompt->notify_fd;
+}
+
+void
+pin_prompt_destroy(pin_prompt_t *prompt)
+{
+	if (prompt->running) {
+		pthread_cancel(prompt->thread);
+		pthread_join(prompt->thread, NULL);
+		prompt->running = false;
+	}
+
+	if (prompt->notify_fd >= 0) {
+		close(prompt->notify_fd);
+		prompt->notify_fd = -1;
+	}
+
+	if (prompt->pin) {
+		buffer_free_secret(prompt->pin);
+		prompt->pin = NULL;
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef PIN_H
+#define PIN_H
+
+#include <pthread.h>
+#include "bufparser.h"
+
+enum {
+	PIN_PROMPT_NONE,
+	PIN_PROMPT_FIXED,	/* given on the command line */
+	PIN_PROMPT_TTY,
+	PIN_PROMPT_AGENT,	/* systemd password agent */
+};
+
+/* PIV PINs are at most 8 characters; leave room for user error */
+#define PIN_MAX_LEN		64
+
+/*
+ * The prompt runs on a thread of its own, so that we can bring up the
+ * token while the user is typing.
+ */
+typedef struct pin_prompt {
+	int			mode;
+	const char *		message;
+	uint64_t		deadline;
+	unsigned int		debug;
+
+	pthread_t		thread;
+	bool			running;
+	bool			okay;
+
+	/* Becomes readable once the prompt thread is done */
+	int			notify_fd;
+
+	/* NUL terminated, in locked memory */
+	buffer_t *		pin;
+} pin_prompt_t;
+
+extern int		pin_prompt_parse_mode(const char *);
+extern void		pin_prompt_init(pin_prompt_t *, const char *fixed_pin);
+extern bool		pin_prompt_start(pin_prompt_t *, int mode, const char *message, uint64_t deadline);
+extern bool		pin_prompt_wait(pin_prompt_t *, const char **pin_ret);
+extern bool		pin_prompt_ready(const pin_prompt_t *);
+extern int		pin_prompt_get_fd(const pin_prompt_t *);
+extern void		pin_prompt_destroy(pin_prompt_t *);
+
+#endif /* PIN_H */
@@ -0,0 +1,1467 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * A minimal PKCS#11 module for PIV tokens, built directly on our CCID
+ * stack. Every token of the configured USB type shows up as a slot.
+ *
+ * The objects we offer are derived from the certificates on the card:
+ * for each PIV key slot that has a certificate with an RSA key, we
+ * expose the certificate, the public key, and a private key that can be
+ * used with CKM_RSA_PKCS for signing and decryption.
+ *
+ * Set $UTOKEN_PKCS11_TYPE to a vendor[:product] id to look for tokens
+ * other than Yubikeys, and $UTOKEN_DEBUG to a number to get debug output.
+ *
+ * We only claim the device while an operation is talking to it: reading
+ * the certificates when the first session is opened, C_Login, and each
+ * signature or decryption. That way, a long-lived consumer such as
+ * ssh-agent does not keep the command line tool from unlocking a volume.
+ * Since another process may use the card in between, we remember the
+ * PIN after C_Login, verify it again right before each operation that
+ * needs it, and power the card off afterwards so that the verified PIN
+ * does not outlive the operation.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <p11-kit/pkcs11.h>
+
+#include "uusb.h"
+#include "scard.h"
+#include "bufparser.h"
+#include "tlv.h"
+#include "util.h"
+#include "pin.h"
+
+#define P11_DEFAULT_TYPE	"1050"
+/* Share the queue with the command line tool, see lock.c */
+#define P11_LOCK_DIR		"/run/lock/utoken-decrypt"
+
+#define P11_MAX_SLOTS		16
+#define P11_MAX_SESSIONS	64
+#define P11_MAX_ATTRS		16
+#define P11_MAX_FIND_ATTRS	16
+
+#define P11_MIN_KEY_BITS	1024
+#define P11_MAX_KEY_BITS	2048
+
+__thread unsigned int	opt_debug = 0;
+
+/* Certificate, public key and private key for each PIV key slot */
+static const struct {
+	uint8_t		key_ref;
+	uint8_t		id;
+	const char *	label;
+	/* The PIN has to be presented right before every use of the key */
+	bool		always_authenticate;
+	bool		pin_required;
+} p11_piv_keys[] = {
+	{ 0x9a,	1,	"PIV AUTH key",		false,	true },
+	{ 0x9c,	2,	"SIGN key",		true,	true },
+	{ 0x9d,	3,	"KEY MAN key",		false,	true },
+	{ 0x9e,	4,	"CARD AUTH key",	false,	false },
+};
+
+#define P11_NUM_KEYS		(sizeof(p11_piv_keys) / sizeof(p11_piv_keys[0]))
+#define P11_MAX_OBJECTS		(3 * P11_NUM_KEYS)
+
+typedef struct p11_object {
+	unsigned int		nattrs;
+	CK_ATTRIBUTE		attrs[P11_MAX_ATTRS];
+
+	/* Only used for private keys */
+	unsigned int		key;
+	unsigned int		key_len;
+} p11_object_t;
+
+typedef struct p11_slot {
+	dev_t			devnum;
+	char *			serial;
+
+	const char *		model;
+
+	/* Only while there are open sessions */
+	unsigned int		nsessions;
+	bool			attached;
+	bool			logged_in;
+	/* NUL terminated, in locked memory */
+	buffer_t *		pin;
+
+	/* Only while an operation holds the io_lock, see p11_slot_acquire */
+	pthread_mutex_t		io_lock;
+	uusb_dev_t *		dev;
+	ccid_reader_t *		reader;
+	ifd_card_t *		card;
+	bool			pin_verified;
+
+	unsigned int		nobjects;
+	p11_object_t		objects[P11_MAX_OBJECTS];
+} p11_slot_t;
+
+enum {
+	P11_OP_NONE,
+	P11_OP_SIGN,
+	P11_OP_DECRYPT,
+};
+
+typedef struct p11_session {
+	bool			in_use;
+	CK_SLOT_ID		slot_id;
+	CK_FLAGS		flags;
+
+	bool			finding;
+	unsigned int		find_pos;
+	unsigned int		find_count;
+	CK_ATTRIBUTE		find_template[P11_MAX_FIND_ATTRS];
+
+	int			op;
+	p11_object_t *		key;
+} p11_session_t;
+
+static pthread_mutex_t		p11_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool			p11_initialized = false;
+static unsigned int		p11_debug;
+static uusb_type_t		p11_type;
+
+static unsigned int		p11_nslots;
+static p11_slot_t		p11_slots[P11_MAX_SLOTS];
+static p11_session_t		p11_sessions[P11_MAX_SESSIONS];
+
+static CK_FUNCTION_LIST		p11_function_list;
+
+/*
+ * All entry points are serialized. Each calling thread gets the debug
+ * level we were initialized with.
+ */
+static CK_RV
+p11_enter(void)
+{
+	pthread_mutex_lock(&p11_lock);
+	if (!p11_initialized) {
+		pthread_mutex_unlock(&p11_lock);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+
+	opt_debug = p11_debug;
+	return CKR_OK;
+}
+
+static CK_RV
+p11_leave(CK_RV rv)
+{
+	pthread_mutex_unlock(&p11_lock);
+	return rv;
+}
+
+static void
+p11_pad_string(CK_UTF8CHAR *dest, size_t size, const char *src)
+{
+	size_t len = strlen(src);
+
+	memset(dest, ' ', size);
+	memcpy(dest, src, len < size? len : size);
+}
+
+/*
+ * Objects
+ */
+static void
+p11_object_add(p11_object_t *obj, CK_ATTRIBUTE_TYPE type, const void *value, size_t len)
+{
+	CK_ATTRIBUTE *attr;
+
+	if (obj->nattrs >= P11_MAX_ATTRS)
+		return;
+
+	attr = &obj->attrs[obj->nattrs++];
+	attr->type = type;
+	attr->pValue = malloc(len? len : 1);
+	attr->ulValueLen = len;
+	memcpy(attr->pValue, value, len);
+}
+
+static void
+p11_object_add_ulong(p11_object_t *obj, CK_ATTRIBUTE_TYPE type, CK_ULONG value)
+{
+	p11_object_add(obj, type, &value, sizeof(value));
+}
+
+static void
+p11_object_add_bool(p11_object_t *obj, CK_ATTRIBUTE_TYPE type, bool value)
+{
+	CK_BBOOL b = value? CK_TRUE : CK_FALSE;
+
+	p11_object_add(obj, type, &b, sizeof(b));
+}
+
+static CK_ATTRIBUTE *
+p11_object_get(p11_object_t *obj, CK_ATTRIBUTE_TYPE type)
+{
+	unsigned int i;
+
+	for (i = 0; i < obj->nattrs; ++i) {
+		if (obj->attrs[i].type == type)
+			return &obj->attrs[i];
+	}
+	return NULL;
+}
+
+static void
+p11_object_destroy(p11_object_t *obj)
+{
+	unsigned int i;
+
+	for (i = 0; i < obj->nattrs; ++i)
+		free(obj->attrs[i].pValue);
+	memset(obj, 0, sizeof(*obj));
+}
+
+static bool
+p11_object_match(p11_object_t *obj, const CK_ATTRIBUTE *templ, unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		CK_ATTRIBUTE *attr = p11_object_get(obj, templ[i].type);
+
+		if (attr == NULL
+		 || attr->ulValueLen != templ[i].ulValueLen
+		 || memcmp(attr->pValue, templ[i].pValue, attr->ulValueLen))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Pull an unsigned big endian integer out of a DER INTEGER, without
+ * the leading zero byte.
+ */
+static bool
+p11_der_get_integer(tlv_cursor_t *cursor, unsigned char **value_ret, size_t *len_ret)
+{
+	unsigned char *value;
+	size_t skip = 0;
+	tlv_t item;
+
+	if (!tlv_next(cursor, &item) || item.tag != 0x02 || item.len == 0)
+		return false;
+
+	value = malloc(item.len);
+	if (!tlv_get_value(&item, value, item.len)) {
+		free(value);
+		return false;
+	}
+
+	while (skip < item.len - 1 && value[skip] == 0)
+		skip++;
+	memmove(value, value + skip, item.len - skip);
+
+	*value_ret = value;
+	*len_ret = item.len - skip;
+	return true;
+}
+
+/*
+ * Find the RSA public key in a DER certificate. We only have to walk
+ * down to the SubjectPublicKeyInfo, which is the 5th SEQUENCE in the
+ * TBSCertificate (after the signature algorithm, issuer, validity and
+ * subject). The key is wrapped in a BIT STRING.
+ */
+static bool
+p11_cert_get_rsa_key(buffer_t *cert, unsigned char **modulus, size_t *modulus_len,
+		unsigned char **exponent, size_t *exponent_len)
+{
+	static const unsigned char rsa_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01 };
+	unsigned char oid[sizeof(rsa_oid)], *bits = NULL;
+	tlv_cursor_t cursor;
+	tlv_t certificate, tbs, item, alg;
+	unsigned int nseq = 0;
+	buffer_t keybuf;
+	tlv_t key;
+	bool okay = false;
+
+	tlv_cursor_init(&cursor, cert);
+	if (!tlv_find(&cursor, 0x30, &certificate)
+	 || !tlv_find(&certificate.value, 0x30, &tbs))
+		return false;
+
+	while (nseq < 5) {
+		if (!tlv_next(&tbs.value, &item))
+			return false;
+		if (item.tag == 0x30)
+			nseq++;
+	}
+
+	/* item is the SubjectPublicKeyInfo */
+	if (!tlv_find(&item.value, 0x30, &alg)
+	 || !tlv_find(&alg.value, 0x06, &key)
+	 || key.len != sizeof(rsa_oid)
+	 || !tlv_get_value(&key, oid, sizeof(oid))
+	 || memcmp(oid, rsa_oid, sizeof(oid))) {
+		debug("Certificate does not contain an RSA key\n");
+		return false;
+	}
+
+	if (!tlv_find(&item.value, 0x03, &key) || key.len < 2)
+		return false;
+
+	bits = malloc(key.len);
+	if (!tlv_get_value(&key, bits, key.len))
+		goto out;
+
+	/* Skip the count of unused bits */
+	buffer_init_read(&keybuf, bits + 1, key.len - 1);
+	tlv_cursor_init(&cursor, &keybuf);
+	if (!tlv_find(&cursor, 0x30, &key))
+		goto out;
+
+	if (!p11_der_get_integer(&key.value, modulus, modulus_len))
+		goto out;
+	if (!p11_der_get_integer(&key.value, exponent, exponent_len)) {
+		free(*modulus);
+		goto out;
+	}
+
+	okay = true;
+
+out:
+	free(bits);
+	return okay;
+}
+
+static void
+p11_slot_add_key(p11_slot_t *slot, unsigned int k, buffer_t *cert)
+{
+	static const CK_KEY_TYPE key_type = CKK_RSA;
+	unsigned char *modulus, *exponent;
+	size_t modulus_len, exponent_len;
+	CK_BYTE id = p11_piv_keys[k].id;
+	const char *label = p11_piv_keys[k].label;
+	p11_object_t *obj;
+
+	if (!p11_cert_get_rsa_key(cert, &modulus, &modulus_len, &exponent, &exponent_len))
+		return;
+
+	if (8 * modulus_len < P11_MIN_KEY_BITS || 8 * modulus_len > P11_MAX_KEY_BITS) {
+		debug("Ignoring %zu bit RSA key in slot %02x\n", 8 * modulus_len, p11_piv_keys[k].key_ref);
+		goto out;
+	}
+
+	obj = &slot->objects[slot->nobjects++];
+	p11_object_add_ulong(obj, CKA_CLASS, CKO_CERTIFICATE);
+	p11_object_add_ulong(obj, CKA_CERTIFICATE_TYPE, CKC_X_509);
+	p11_object_add_bool(obj, CKA_TOKEN, true);
+	p11_object_add_bool(obj, CKA_PRIVATE, false);
+	p11_object_add(obj, CKA_ID, &id, 1);
+	p11_object_add(obj, CKA_LABEL, label, strlen(label));
+	p11_object_add(obj, CKA_VALUE, buffer_read_pointer(cert), buffer_available(cert));
+
+	obj = &slot->objects[slot->nobjects++];
+	p11_object_add_ulong(obj, CKA_CLASS, CKO_PUBLIC_KEY);
+	p11_object_add(obj, CKA_KEY_TYPE, &key_type, sizeof(key_type));
+	p11_object_add_bool(obj, CKA_TOKEN, true);
+	p11_object_add_bool(obj, CKA_PRIVATE, false);
+	p11_object_add(obj, CKA_ID, &id, 1);
+	p11_object_add(obj, CKA_LABEL, label, strlen(label));
+	p11_object_add_bool(obj, CKA_VERIFY, true);
+	p11_object_add_bool(obj, CKA_ENCRYPT, true);
+	p11_object_add(obj, CKA_MODULUS, modulus, modulus_len);
+	p11_object_add_ulong(obj, CKA_MODULUS_BITS, 8 * modulus_len);
+	p11_object_add(obj, CKA_PUBLIC_EXPONENT, exponent, exponent_len);
+
+	obj = &slot->objects[slot->nobjects++];
+	p11_object_add_ulong(obj, CKA_CLASS, CKO_PRIVATE_KEY);
+	p11_object_add(obj, CKA_KEY_TYPE, &key_type, sizeof(key_type));
+	p11_object_add_bool(obj, CKA_TOKEN, true);
+	p11_object_add_bool(obj, CKA_PRIVATE, false);
+	p11_object_add(obj, CKA_ID, &id, 1);
+	p11_object_add(obj, CKA_LABEL, label, strlen(label));
+	p11_object_add_bool(obj, CKA_SIGN, true);
+	p11_object_add_bool(obj, CKA_DECRYPT, true);
+	p11_object_add_bool(obj, CKA_SENSITIVE, true);
+	p11_object_add_bool(obj, CKA_EXTRACTABLE, false);
+	p11_object_add_bool(obj, CKA_ALWAYS_AUTHENTICATE, p11_piv_keys[k].always_authenticate);
+	p11_object_add(obj, CKA_MODULUS, modulus, modulus_len);
+	p11_object_add_ulong(obj, CKA_MODULUS_BITS, 8 * modulus_len);
+	p11_object_add(obj, CKA_PUBLIC_EXPONENT, exponent, exponent_len);
+	obj->key = k;
+	obj->key_len = modulus_len;
+
+	debug("Found %zu bit RSA key in slot %02x\n", 8 * modulus_len, p11_piv_keys[k].key_ref);
+
+out:
+	free(modulus);
+	free(exponent);
+}
+
+/*
+ * Slots
+ */
+static bool
+p11_match_devnum(uusb_dev_t **devs, unsigned int ndevs, dev_t devnum, uusb_dev_t **dev_ret)
+{
+	unsigned int i;
+
+	*dev_ret = NULL;
+	for (i = 0; i < ndevs; ++i) {
+		if (*dev_ret == NULL && uusb_dev_get_devnum(devs[i]) == devnum)
+			*dev_ret = devs[i];
+		else
+			usb_close(devs[i]);
+	}
+
+	return *dev_ret != NULL;
+}
+
+static void
+p11_slot_forget_pin(p11_slot_t *slot)
+{
+	if (slot->pin) {
+		buffer_free_secret(slot->pin);
+		slot->pin = NULL;
+	}
+	slot->logged_in = false;
+}
+
+static void
+p11_slot_detach(p11_slot_t *slot)
+{
+	unsigned int i;
+
+	for (i = 0; i < slot->nobjects; ++i)
+		p11_object_destroy(&slot->objects[i]);
+	slot->nobjects = 0;
+
+	p11_slot_forget_pin(slot);
+	slot->attached = false;
+}
+
+/*
+ * Let go of the device, and with it, our place in the queue. If we
+ * verified the PIN, power off the card so that it does not stay valid
+ * for whoever gets the device next.
+ */
+static void
+p11_slot_release(p11_slot_t *slot)
+{
+	if (slot->pin_verified)
+		ccid_reader_poweroff(slot->reader, 0);
+
+	if (slot->card)
+		ifd_card_free(slot->card);
+	if (slot->reader)
+		ccid_reader_free(slot->reader);
+	if (slot->dev)
+		usb_close(slot->dev);
+
+	slot->card = NULL;
+	slot->reader = NULL;
+	slot->dev = NULL;
+	slot->pin_verified = false;
+
+	pthread_mutex_unlock(&slot->io_lock);
+}
+
+/*
+ * Wait for our turn on the device, claim it, and connect to the card.
+ * This is called with p11_lock held, and returns with p11_lock held. On
+ * success, the caller has to call p11_slot_release() when done.
+ *
+ * Waiting for our turn can take a long time, so we drop p11_lock while
+ * doing so. Callers have to check their session again afterwards.
+ */
+static CK_RV
+p11_slot_acquire(p11_slot_t *slot)
+{
+	uusb_dev_t *devs[P11_MAX_SLOTS];
+	unsigned int ndevs;
+	uusb_dev_t *dev;
+	bool locked = false;
+
+	pthread_mutex_unlock(&p11_lock);
+	pthread_mutex_lock(&slot->io_lock);
+
+	ndevs = usb_open_all_type(&p11_type, 0, devs, P11_MAX_SLOTS);
+	if (p11_match_devnum(devs, ndevs, slot->devnum, &dev))
+		locked = uusb_dev_lock(dev, P11_LOCK_DIR, 0);
+
+	pthread_mutex_lock(&p11_lock);
+	slot->dev = dev;
+
+	if (dev == NULL) {
+		p11_slot_release(slot);
+		return CKR_DEVICE_REMOVED;
+	}
+
+	if (!p11_initialized) {
+		p11_slot_release(slot);
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+	}
+
+	if (!locked
+	 || !(slot->reader = ccid_reader_create(dev, NULL, 0))
+	 || !ccid_reader_select_slot(slot->reader, 0)
+	 || !(slot->card = ccid_reader_identify_card(slot->reader, 0))
+	 || !ifd_card_connect(slot->card)) {
+		p11_slot_release(slot);
+		return CKR_DEVICE_ERROR;
+	}
+
+	slot->model = slot->card->name;
+	return CKR_OK;
+}
+
+/*
+ * Present the PIN we remember from C_Login. If the card rejects it,
+ * forget it, so that we do not use up the remaining retries.
+ */
+static CK_RV
+p11_slot_verify(p11_slot_t *slot)
+{
+	unsigned int tries_left = 0;
+
+	if (slot->pin == NULL)
+		return CKR_USER_NOT_LOGGED_IN;
+
+	if (!ifd_card_verify(slot->card, (const char *) slot->pin->data,
+				buffer_available(slot->pin), &tries_left)) {
+		p11_slot_forget_pin(slot);
+		return tries_left? CKR_PIN_INCORRECT : CKR_PIN_LOCKED;
+	}
+
+	slot->pin_verified = true;
+	return CKR_OK;
+}
+
+/*
+ * Find out what keys the card has. This happens once, when the first
+ * session is opened.
+ */
+static CK_RV
+p11_slot_attach(p11_slot_t *slot)
+{
+	unsigned int k;
+	CK_RV rv;
+
+	if (slot->attached)
+		return CKR_OK;
+
+	if ((rv = p11_slot_acquire(slot)) != CKR_OK)
+		return rv;
+
+	/* Someone else may have done this while we were waiting */
+	if (!slot->attached) {
+		for (k = 0; k < P11_NUM_KEYS; ++k) {
+			buffer_t *cert;
+
+			if ((cert = ifd_card_read_certificate(slot->card, p11_piv_keys[k].key_ref)) != NULL) {
+				p11_slot_add_key(slot, k, cert);
+				buffer_free(cert);
+			}
+		}
+		slot->attached = true;
+	}
+
+	p11_slot_release(slot);
+	return CKR_OK;
+}
+
+static p11_slot_t *
+p11_get_slot(CK_SLOT_ID slot_id)
+{
+	if (slot_id >= p11_nslots)
+		return NULL;
+	return &p11_slots[slot_id];
+}
+
+/*
+ * Sessions
+ */
+static void
+p11_session_end_find(p11_session_t *sess)
+{
+	unsigned int i;
+
+	for (i = 0; i < sess->find_count; ++i)
+		free(sess->find_template[i].pValue);
+	sess->find_count = 0;
+	sess->finding = false;
+}
+
+static p11_session_t *
+p11_get_session(CK_SESSION_HANDLE handle)
+{
+	p11_session_t *sess;
+
+	if (handle == 0 || handle > P11_MAX_SESSIONS)
+		return NULL;
+
+	sess = &p11_sessions[handle - 1];
+	return sess->in_use? sess : NULL;
+}
+
+static p11_object_t *
+p11_get_object(p11_session_t *sess, CK_OBJECT_HANDLE handle)
+{
+	p11_slot_t *slot = &p11_slots[sess->slot_id];
+
+	if (handle == 0 || handle > slot->nobjects)
+		return NULL;
+	return &slot->objects[handle - 1];
+}
+
+static void
+p11_session_close(p11_session_t *sess)
+{
+	p11_slot_t *slot = &p11_slots[sess->slot_id];
+
+	p11_session_end_find(sess);
+	memset(sess, 0, sizeof(*sess));
+
+	if (--(slot->nsessions) == 0)
+		p11_slot_detach(slot);
+}
+
+/*
+ * General purpose functions
+ */
+CK_RV
+C_Initialize(CK_VOID_PTR init_args)
+{
+	uusb_dev_t *devs[P11_MAX_SLOTS];
+	const char *type, *value;
+	unsigned int i;
+
+	pthread_mutex_lock(&p11_lock);
+	if (p11_initialized)
+		return p11_leave(CKR_CRYPTOKI_ALREADY_INITIALIZED);
+
+	if ((value = getenv("UTOKEN_DEBUG")) != NULL)
+		p11_debug = strtoul(value, NULL, 10);
+	opt_debug = p11_debug;
+
+	if (!(type = getenv("UTOKEN_PKCS11_TYPE")))
+		type = P11_DEFAULT_TYPE;
+	if (!usb_parse_type(type, &p11_type))
+		return p11_leave(CKR_GENERAL_ERROR);
+
+	/* Remember the tokens, but do not hold on to them */
+	p11_nslots = usb_open_all_type(&p11_type, 0, devs, P11_MAX_SLOTS);
+	for (i = 0; i < p11_nslots; ++i) {
+		p11_slot_t *slot = &p11_slots[i];
+
+		memset(slot, 0, sizeof(*slot));
+		pthread_mutex_init(&slot->io_lock, NULL);
+		slot->devnum = uusb_dev_get_devnum(devs[i]);
+		assign_string(&slot->serial, uusb_dev_get_serial(devs[i]));
+		usb_close(devs[i]);
+	}
+
+	debug("PKCS#11 module found %u token(s)\n", p11_nslots);
+	p11_initialized = true;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_Finalize(CK_VOID_PTR reserved)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if (reserved != NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+
+	for (i = 0; i < P11_MAX_SESSIONS; ++i) {
+		if (p11_sessions[i].in_use)
+			p11_session_close(&p11_sessions[i]);
+	}
+
+	for (i = 0; i < p11_nslots; ++i)
+		drop_string(&p11_slots[i].serial);
+	p11_nslots = 0;
+
+	p11_initialized = false;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetInfo(CK_INFO_PTR info)
+{
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (info == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+
+	memset(info, 0, sizeof(*info));
+	info->cryptokiVersion.major = 2;
+	info->cryptokiVersion.minor = 40;
+	p11_pad_string(info->manufacturerID, sizeof(info->manufacturerID), "utoken-decrypt");
+	p11_pad_string(info->libraryDescription, sizeof(info->libraryDescription), "utoken PIV module");
+	info->libraryVersion.major = 0;
+	info->libraryVersion.minor = 1;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR list)
+{
+	if (list == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	*list = &p11_function_list;
+	return CKR_OK;
+}
+
+/*
+ * Slot and token management
+ */
+CK_RV
+C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list, CK_ULONG_PTR count)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (count == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+
+	if (slot_list != NULL) {
+		if (*count < p11_nslots) {
+			*count = p11_nslots;
+			return p11_leave(CKR_BUFFER_TOO_SMALL);
+		}
+		for (i = 0; i < p11_nslots; ++i)
+			slot_list[i] = i;
+	}
+
+	*count = p11_nslots;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR info)
+{
+	p11_slot_t *slot;
+	char desc[64];
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (info == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(slot = p11_get_slot(slot_id)))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+
+	snprintf(desc, sizeof(desc), "USB token %04x:%04x", p11_type.idVendor, p11_type.idProduct);
+
+	memset(info, 0, sizeof(*info));
+	p11_pad_string(info->slotDescription, sizeof(info->slotDescription), desc);
+	p11_pad_string(info->manufacturerID, sizeof(info->manufacturerID), "utoken-decrypt");
+	info->flags = CKF_TOKEN_PRESENT | CKF_REMOVABLE_DEVICE | CKF_HW_SLOT;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR info)
+{
+	p11_slot_t *slot;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (info == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(slot = p11_get_slot(slot_id)))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+
+	memset(info, 0, sizeof(*info));
+	p11_pad_string(info->label, sizeof(info->label), "PIV");
+	p11_pad_string(info->manufacturerID, sizeof(info->manufacturerID), "utoken-decrypt");
+	p11_pad_string(info->model, sizeof(info->model), slot->model?: "PIV token");
+	p11_pad_string(info->serialNumber, sizeof(info->serialNumber), slot->serial?: "");
+	info->flags = CKF_TOKEN_INITIALIZED | CKF_USER_PIN_INITIALIZED |
+			CKF_LOGIN_REQUIRED | CKF_WRITE_PROTECTED;
+	info->ulMaxSessionCount = CK_EFFECTIVELY_INFINITE;
+	info->ulSessionCount = slot->nsessions;
+	info->ulMaxRwSessionCount = 0;
+	info->ulRwSessionCount = 0;
+	info->ulMaxPinLen = 8;
+	info->ulMinPinLen = 6;
+	info->ulTotalPublicMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulFreePublicMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulTotalPrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	info->ulFreePrivateMemory = CK_UNAVAILABLE_INFORMATION;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetMechanismList(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE_PTR list, CK_ULONG_PTR count)
+{
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (count == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!p11_get_slot(slot_id))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+
+	if (list != NULL) {
+		if (*count < 1) {
+			*count = 1;
+			return p11_leave(CKR_BUFFER_TOO_SMALL);
+		}
+		list[0] = CKM_RSA_PKCS;
+	}
+
+	*count = 1;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR info)
+{
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (info == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!p11_get_slot(slot_id))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+	if (type != CKM_RSA_PKCS)
+		return p11_leave(CKR_MECHANISM_INVALID);
+
+	info->ulMinKeySize = P11_MIN_KEY_BITS;
+	info->ulMaxKeySize = P11_MAX_KEY_BITS;
+	info->flags = CKF_HW | CKF_SIGN | CKF_DECRYPT;
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * Session management
+ */
+CK_RV
+C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags, CK_VOID_PTR application,
+		CK_NOTIFY notify, CK_SESSION_HANDLE_PTR handle)
+{
+	p11_session_t *sess = NULL;
+	p11_slot_t *slot;
+	unsigned int i;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (handle == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(flags & CKF_SERIAL_SESSION))
+		return p11_leave(CKR_SESSION_PARALLEL_NOT_SUPPORTED);
+	if (flags & CKF_RW_SESSION)
+		return p11_leave(CKR_TOKEN_WRITE_PROTECTED);
+	if (!(slot = p11_get_slot(slot_id)))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+
+	/* This may drop p11_lock while waiting for the device */
+	if ((rv = p11_slot_attach(slot)) != CKR_OK)
+		return p11_leave(rv);
+
+	for (i = 0; i < P11_MAX_SESSIONS && !sess; ++i) {
+		if (!p11_sessions[i].in_use)
+			sess = &p11_sessions[i];
+	}
+	if (sess == NULL) {
+		if (slot->nsessions == 0)
+			p11_slot_detach(slot);
+		return p11_leave(CKR_SESSION_COUNT);
+	}
+
+	memset(sess, 0, sizeof(*sess));
+	sess->in_use = true;
+	sess->slot_id = slot_id;
+	sess->flags = flags;
+	slot->nsessions++;
+
+	*handle = sess - p11_sessions + 1;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_CloseSession(CK_SESSION_HANDLE handle)
+{
+	p11_session_t *sess;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+
+	p11_session_close(sess);
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_CloseAllSessions(CK_SLOT_ID slot_id)
+{
+	unsigned int i;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (!p11_get_slot(slot_id))
+		return p11_leave(CKR_SLOT_ID_INVALID);
+
+	for (i = 0; i < P11_MAX_SESSIONS; ++i) {
+		p11_session_t *sess = &p11_sessions[i];
+
+		if (sess->in_use && sess->slot_id == slot_id)
+			p11_session_close(sess);
+	}
+
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_GetSessionInfo(CK_SESSION_HANDLE handle, CK_SESSION_INFO_PTR info)
+{
+	p11_session_t *sess;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (info == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+
+	info->slotID = sess->slot_id;
+	info->state = p11_slots[sess->slot_id].logged_in? CKS_RO_USER_FUNCTIONS : CKS_RO_PUBLIC_SESSION;
+	info->flags = sess->flags;
+	info->ulDeviceError = 0;
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * A context specific login re-verifies the PIN right before the
+ * operation that has just been started, for keys that want this.
+ */
+CK_RV
+C_Login(CK_SESSION_HANDLE handle, CK_USER_TYPE user_type, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len)
+{
+	unsigned int tries_left = 0;
+	p11_session_t *sess;
+	p11_slot_t *slot;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (pin == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+
+	slot = &p11_slots[sess->slot_id];
+	switch (user_type) {
+	case CKU_USER:
+		if (slot->logged_in)
+			return p11_leave(CKR_USER_ALREADY_LOGGED_IN);
+		break;
+
+	case CKU_CONTEXT_SPECIFIC:
+		if (sess->op == P11_OP_NONE)
+			return p11_leave(CKR_OPERATION_NOT_INITIALIZED);
+		break;
+
+	default:
+		return p11_leave(CKR_USER_TYPE_INVALID);
+	}
+
+	if (pin_len > PIN_MAX_LEN)
+		return p11_leave(CKR_PIN_LEN_RANGE);
+
+	if ((rv = p11_slot_acquire(slot)) != CKR_OK)
+		return p11_leave(rv);
+
+	/* Things may have changed while we were waiting */
+	if (p11_get_session(handle) != sess) {
+		rv = CKR_SESSION_HANDLE_INVALID;
+	} else if (user_type == CKU_USER && slot->logged_in) {
+		rv = CKR_USER_ALREADY_LOGGED_IN;
+	} else if (user_type == CKU_CONTEXT_SPECIFIC && sess->op == P11_OP_NONE) {
+		rv = CKR_OPERATION_NOT_INITIALIZED;
+	}
+	if (rv != CKR_OK) {
+		p11_slot_release(slot);
+		return p11_leave(rv);
+	}
+
+	if (!ifd_card_verify(slot->card, (const char *) pin, pin_len, &tries_left)) {
+		p11_slot_release(slot);
+		if (tries_left == 0)
+			return p11_leave(CKR_PIN_LOCKED);
+		return p11_leave(CKR_PIN_INCORRECT);
+	}
+
+	slot->pin_verified = true;
+	p11_slot_release(slot);
+
+	/* We verify it again right before each operation */
+	p11_slot_forget_pin(slot);
+	slot->pin = buffer_alloc_secret(pin_len + 1);
+	buffer_put(slot->pin, pin, pin_len);
+	slot->pin->data[pin_len] = '\0';
+
+	slot->logged_in = true;
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * The card is powered off after every operation that verified the PIN,
+ * so all we need to do is forget it.
+ */
+CK_RV
+C_Logout(CK_SESSION_HANDLE handle)
+{
+	p11_session_t *sess;
+	p11_slot_t *slot;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+
+	slot = &p11_slots[sess->slot_id];
+	if (!slot->logged_in)
+		return p11_leave(CKR_USER_NOT_LOGGED_IN);
+
+	p11_slot_forget_pin(slot);
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * Object management
+ */
+CK_RV
+C_GetAttributeValue(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE object,
+		CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	p11_session_t *sess;
+	p11_object_t *obj;
+	CK_ULONG i;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (templ == NULL && count)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (!(obj = p11_get_object(sess, object)))
+		return p11_leave(CKR_OBJECT_HANDLE_INVALID);
+
+	for (i = 0; i < count; ++i) {
+		CK_ATTRIBUTE *attr = p11_object_get(obj, templ[i].type);
+
+		if (attr == NULL) {
+			templ[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+			rv = CKR_ATTRIBUTE_TYPE_INVALID;
+		} else if (templ[i].pValue == NULL) {
+			templ[i].ulValueLen = attr->ulValueLen;
+		} else if (templ[i].ulValueLen < attr->ulValueLen) {
+			templ[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+			rv = CKR_BUFFER_TOO_SMALL;
+		} else {
+			memcpy(templ[i].pValue, attr->pValue, attr->ulValueLen);
+			templ[i].ulValueLen = attr->ulValueLen;
+		}
+	}
+
+	return p11_leave(rv);
+}
+
+CK_RV
+C_FindObjectsInit(CK_SESSION_HANDLE handle, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
+{
+	p11_session_t *sess;
+	CK_ULONG i;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (templ == NULL && count)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (sess->finding)
+		return p11_leave(CKR_OPERATION_ACTIVE);
+	if (count > P11_MAX_FIND_ATTRS)
+		return p11_leave(CKR_TEMPLATE_INCONSISTENT);
+
+	for (i = 0; i < count; ++i) {
+		CK_ATTRIBUTE *attr = &sess->find_template[i];
+
+		attr->type = templ[i].type;
+		attr->ulValueLen = templ[i].ulValueLen;
+		attr->pValue = malloc(attr->ulValueLen? attr->ulValueLen : 1);
+		memcpy(attr->pValue, templ[i].pValue, attr->ulValueLen);
+	}
+
+	sess->find_count = count;
+	sess->find_pos = 0;
+	sess->finding = true;
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_FindObjects(CK_SESSION_HANDLE handle, CK_OBJECT_HANDLE_PTR objects, CK_ULONG max, CK_ULONG_PTR count)
+{
+	p11_session_t *sess;
+	p11_slot_t *slot;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (objects == NULL || count == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (!sess->finding)
+		return p11_leave(CKR_OPERATION_NOT_INITIALIZED);
+
+	slot = &p11_slots[sess->slot_id];
+	*count = 0;
+	while (*count < max && sess->find_pos < slot->nobjects) {
+		p11_object_t *obj = &slot->objects[sess->find_pos++];
+
+		if (p11_object_match(obj, sess->find_template, sess->find_count))
+			objects[(*count)++] = sess->find_pos;
+	}
+
+	return p11_leave(CKR_OK);
+}
+
+CK_RV
+C_FindObjectsFinal(CK_SESSION_HANDLE handle)
+{
+	p11_session_t *sess;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (!sess->finding)
+		return p11_leave(CKR_OPERATION_NOT_INITIALIZED);
+
+	p11_session_end_find(sess);
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * Sign and decrypt
+ */
+static CK_RV
+p11_op_init(CK_SESSION_HANDLE handle, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key, int op)
+{
+	CK_ATTRIBUTE_TYPE usage = (op == P11_OP_SIGN)? CKA_SIGN : CKA_DECRYPT;
+	CK_ATTRIBUTE *attr;
+	p11_session_t *sess;
+	p11_object_t *obj;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (mech == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (sess->op != P11_OP_NONE)
+		return p11_leave(CKR_OPERATION_ACTIVE);
+	if (mech->mechanism != CKM_RSA_PKCS)
+		return p11_leave(CKR_MECHANISM_INVALID);
+
+	if (!(obj = p11_get_object(sess, key)))
+		return p11_leave(CKR_KEY_HANDLE_INVALID);
+
+	attr = p11_object_get(obj, usage);
+	if (attr == NULL || *(CK_BBOOL *) attr->pValue != CK_TRUE)
+		return p11_leave(CKR_KEY_FUNCTION_NOT_PERMITTED);
+
+	sess->op = op;
+	sess->key = obj;
+	return p11_leave(CKR_OK);
+}
+
+/*
+ * Run the operation that was set up by SignInit or DecryptInit. As
+ * required by the spec, a call that only asks for the output size, or
+ * that provides too small a buffer, leaves the operation active.
+ */
+static CK_RV
+p11_op_run(CK_SESSION_HANDLE handle, int op, CK_BYTE_PTR in, CK_ULONG in_len,
+		CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	p11_session_t *sess;
+	p11_slot_t *slot;
+	p11_object_t *key;
+	char option[32];
+	buffer_t input, *result;
+	CK_RV rv;
+
+	if ((rv = p11_enter()) != CKR_OK)
+		return rv;
+	if (in == NULL || out_len == NULL)
+		return p11_leave(CKR_ARGUMENTS_BAD);
+	if (!(sess = p11_get_session(handle)))
+		return p11_leave(CKR_SESSION_HANDLE_INVALID);
+	if (sess->op != op)
+		return p11_leave(CKR_OPERATION_NOT_INITIALIZED);
+
+	slot = &p11_slots[sess->slot_id];
+	key = sess->key;
+
+	if (out == NULL) {
+		*out_len = key->key_len;
+		return p11_leave(CKR_OK);
+	}
+
+	if (op == P11_OP_DECRYPT && in_len != key->key_len) {
+		rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+		goto done;
+	}
+
+	/* PKCS#1 v1.5 padding takes at least 11 bytes */
+	if (op == P11_OP_SIGN && in_len + 11 > key->key_len) {
+		rv = CKR_DATA_LEN_RANGE;
+		goto done;
+	}
+
+	if (p11_piv_keys[key->key].pin_required && !slot->logged_in) {
+		rv = CKR_USER_NOT_LOGGED_IN;
+		goto done;
+	}
+
+	rv = p11_slot_acquire(slot);
+
+	/* The session may have changed while we were waiting */
+	if (p11_get_session(handle) != sess || sess->op != op || sess->key != key) {
+		if (rv == CKR_OK)
+			p11_slot_release(slot);
+		return p11_leave(CKR_OPERATION_NOT_INITIALIZED);
+	}
+	if (rv != CKR_OK)
+		goto done;
+
+	if (p11_piv_keys[key->key].pin_required && (rv = p11_slot_verify(slot)) != CKR_OK) {
+		p11_slot_release(slot);
+		goto done;
+	}
+
+	snprintf(option, sizeof(option), "key-slot=%02x", p11_piv_keys[key->key].key_ref);
+	if (!ifd_card_set_option(slot->card, option)) {
+		p11_slot_release(slot);
+		rv = CKR_GENERAL_ERROR;
+		goto done;
+	}
+
+	buffer_init_read(&input, in, in_len);
+	if (op == P11_OP_SIGN)
+		result = ifd_card_sign(slot->card, &input, key->key_len);
+	else
+		result = ifd_card_decipher(slot->card, &input);
+	p11_slot_release(slot);
+
+	if (result == NULL) {
+		rv = CKR_DEVICE_ERROR;
+		goto done;
+	}
+
+	if (*out_len < buffer_available(result)) {
+		*out_len = buffer_available(result);
+		buffer_free_secret(result);
+		return p11_leave(CKR_BUFFER_TOO_SMALL);
+	}
+
+	*out_len = buffer_available(result);
+	memcpy(out, buffer_read_pointer(result), *out_len);
+	buffer_free_secret(result);
+
+done:
+	sess->op = P11_OP_NONE;
+	sess->key = NULL;
+	return p11_leave(rv);
+}
+
+CK_RV
+C_DecryptInit(CK_SESSION_HANDLE handle, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key)
+{
+	return p11_op_init(handle, mech, key, P11_OP_DECRYPT);
+}
+
+CK_RV
+C_Decrypt(CK_SESSION_HANDLE handle, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return p11_op_run(handle, P11_OP_DECRYPT, in, in_len, out, out_len);
+}
+
+CK_RV
+C_SignInit(CK_SESSION_HANDLE handle, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key)
+{
+	return p11_op_init(handle, mech, key, P11_OP_SIGN);
+}
+
+CK_RV
+C_Sign(CK_SESSION_HANDLE handle, CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	return p11_op_run(handle, P11_OP_SIGN, in, in_len, out, out_len);
+}
+
+/*
+ * Everything else is not supported
+ */
+CK_RV C_WaitForSlotEvent(CK_FLAGS f, CK_SLOT_ID_PTR s, CK_VOID_PTR r) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_InitToken(CK_SLOT_ID s, CK_UTF8CHAR_PTR p, CK_ULONG l, CK_UTF8CHAR_PTR label) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_InitPIN(CK_SESSION_HANDLE h, CK_UTF8CHAR_PTR p, CK_ULONG l) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SetPIN(CK_SESSION_HANDLE h, CK_UTF8CHAR_PTR o, CK_ULONG ol, CK_UTF8CHAR_PTR n, CK_ULONG nl) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GetOperationState(CK_SESSION_HANDLE h, CK_BYTE_PTR s, CK_ULONG_PTR l) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SetOperationState(CK_SESSION_HANDLE h, CK_BYTE_PTR s, CK_ULONG l, CK_OBJECT_HANDLE e, CK_OBJECT_HANDLE a) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_CreateObject(CK_SESSION_HANDLE h, CK_ATTRIBUTE_PTR t, CK_ULONG c, CK_OBJECT_HANDLE_PTR o) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_CopyObject(CK_SESSION_HANDLE h, CK_OBJECT_HANDLE o, CK_ATTRIBUTE_PTR t, CK_ULONG c, CK_OBJECT_HANDLE_PTR n) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DestroyObject(CK_SESSION_HANDLE h, CK_OBJECT_HANDLE o) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GetObjectSize(CK_SESSION_HANDLE h, CK_OBJECT_HANDLE o, CK_ULONG_PTR s) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SetAttributeValue(CK_SESSION_HANDLE h, CK_OBJECT_HANDLE o, CK_ATTRIBUTE_PTR t, CK_ULONG c) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_EncryptInit(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_Encrypt(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_EncryptUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_EncryptFinal(CK_SESSION_HANDLE h, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DecryptUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DecryptFinal(CK_SESSION_HANDLE h, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DigestInit(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_Digest(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DigestUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DigestKey(CK_SESSION_HANDLE h, CK_OBJECT_HANDLE k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DigestFinal(CK_SESSION_HANDLE h, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SignUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SignFinal(CK_SESSION_HANDLE h, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SignRecoverInit(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SignRecover(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_VerifyInit(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_Verify(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR s, CK_ULONG sl) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_VerifyUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_VerifyFinal(CK_SESSION_HANDLE h, CK_BYTE_PTR s, CK_ULONG sl) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_VerifyRecoverInit(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_VerifyRecover(CK_SESSION_HANDLE h, CK_BYTE_PTR s, CK_ULONG sl, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DigestEncryptUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DecryptDigestUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SignEncryptUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DecryptVerifyUpdate(CK_SESSION_HANDLE h, CK_BYTE_PTR i, CK_ULONG il, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GenerateKey(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_ATTRIBUTE_PTR t, CK_ULONG c, CK_OBJECT_HANDLE_PTR k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GenerateKeyPair(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_ATTRIBUTE_PTR pt, CK_ULONG pc,
+		CK_ATTRIBUTE_PTR st, CK_ULONG sc, CK_OBJECT_HANDLE_PTR pk, CK_OBJECT_HANDLE_PTR sk) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_WrapKey(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE w, CK_OBJECT_HANDLE k, CK_BYTE_PTR o, CK_ULONG_PTR ol) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_UnwrapKey(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE u, CK_BYTE_PTR w, CK_ULONG wl,
+		CK_ATTRIBUTE_PTR t, CK_ULONG c, CK_OBJECT_HANDLE_PTR k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_DeriveKey(CK_SESSION_HANDLE h, CK_MECHANISM_PTR m, CK_OBJECT_HANDLE b, CK_ATTRIBUTE_PTR t, CK_ULONG c, CK_OBJECT_HANDLE_PTR k) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_SeedRandom(CK_SESSION_HANDLE h, CK_BYTE_PTR s, CK_ULONG l) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GenerateRandom(CK_SESSION_HANDLE h, CK_BYTE_PTR r, CK_ULONG l) { return CKR_FUNCTION_NOT_SUPPORTED; }
+CK_RV C_GetFunctionStatus(CK_SESSION_HANDLE h) { return CKR_FUNCTION_NOT_PARALLEL; }
+CK_RV C_CancelFunction(CK_SESSION_HANDLE h) { return CKR_FUNCTION_NOT_PARALLEL; }
+
+static CK_FUNCTION_LIST		p11_function_list = {
+	.version = { 2, 40 },
+	.C_Initialize = C_Initialize,
+	.C_Finalize = C_Finalize,
+	.C_GetInfo = C_GetInfo,
+	.C_GetFunctionList = C_GetFunctionList,
+	.C_GetSlotList = C_GetSlotList,
+	.C_GetSlotInfo = C_GetSlotInfo,
+	.C_GetTokenInfo = C_GetTokenInfo,
+	.C_GetMechanismList = C_GetMechanismList,
+	.C_GetMechanismInfo = C_GetMechanismInfo,
+	.C_InitToken = C_InitToken,
+	.C_InitPIN = C_InitPIN,
+	.C_SetPIN = C_SetPIN,
+	.C_OpenSession = C_OpenSession,
+	.C_CloseSession = C_CloseSession,
+	.C_CloseAllSessions = C_CloseAllSessions,
+	.C_GetSessionInfo = C_GetSessionInfo,
+	.C_GetOperationState = C_GetOperationState,
+	.C_SetOperationState = C_SetOperationState,
+	.C_Login = C_Login,
+	.C_Logout = C_Logout,
+	.C_CreateObject = C_CreateObject,
+	.C_CopyObject = C_CopyObject,
+	.C_DestroyObject = C_DestroyObject,
+	.C_GetObjectSize = C_GetObjectSize,
+	.C_GetAttributeValue = C_GetAttributeValue,
+	.C_SetAttributeValue = C_SetAttributeValue,
+	.C_FindObjectsInit = C_FindObjectsInit,
+	.C_FindObjects = C_FindObjects,
+	.C_FindObjectsFinal = C_FindObjectsFinal,
+	.C_EncryptInit = C_EncryptInit,
+	.C_Encrypt = C_Encrypt,
+	.C_EncryptUpdate = C_EncryptUpdate,
+	.C_EncryptFinal = C_EncryptFinal,
+	.C_DecryptInit = C_DecryptInit,
+	.C_Decrypt = C_Decrypt,
+	.C_DecryptUpdate = C_DecryptUpdate,
+	.C_DecryptFinal = C_DecryptFinal,
+	.C_DigestInit = C_DigestInit,
+	.C_Digest = C_Digest,
+	.C_DigestUpdate = C_DigestUpdate,
+	.C_DigestKey = C_DigestKey,
+	.C_DigestFinal = C_DigestFinal,
+	.C_SignInit = C_SignInit,
+	.C_Sign = C_Sign,
+	.C_SignUpdate = C_SignUpdate,
+	.C_SignFinal = C_SignFinal,
+	.C_SignRecoverInit = C_SignRecoverInit,
+	.C_SignRecover = C_SignRecover,
+	.C_VerifyInit = C_VerifyInit,
+	.C_Verify = C_Verify,
+	.C_VerifyUpdate = C_VerifyUpdate,
+	.C_VerifyFinal = C_VerifyFinal,
+	.C_VerifyRecoverInit = C_VerifyRecoverInit,
+	.C_VerifyRecover = C_VerifyRecover,
+	.C_DigestEncryptUpdate = C_DigestEncryptUpdate,
+	.C_DecryptDigestUpdate = C_DecryptDigestUpdate,
+	.C_SignEncryptUpdate = C_SignEncryptUpdate,
+	.C_DecryptVerifyUpdate = C_DecryptVerifyUpdate,
+	.C_GenerateKey = C_GenerateKey,
+	.C_GenerateKeyPair = C_GenerateKeyPair,
+	.C_WrapKey = C_WrapKey,
+	.C_UnwrapKey = C_UnwrapKey,
+	.C_DeriveKey = C_DeriveKey,
+	.C_SeedRandom = C_SeedRandom,
+	.C_GenerateRandom = C_GenerateRandom,
+	.C_GetFunctionStatus = C_GetFunctionStatus,
+	.C_CancelFunction = C_CancelFunction,
+	.C_WaitForSlotEvent = C_WaitForSlotEvent,
+};
@@ -0,0 +1,391 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Decrypt a batch of secrets using several tokens that hold the same key.
+ * Each token gets a worker thread, which sets up the card once, and then
+ * processes jobs until there are none left.
+ *
+ * Jobs are dealt out round robin. A worker that runs out of jobs steals
+ * from the worker with the most jobs left, taking them from the far end
+ * of its queue. If a token cannot be set up at all, its worker quits
+ * right away, and the others pick up its share.
+ *
+ * All tokens get the same PIN. To keep a mistyped PIN from costing one
+ * retry on every token, only one worker verifies it at first; the others
+ * wait until it has been accepted, and give up if it was rejected.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "scard.h"
+#include "bufparser.h"
+#include "util.h"
+
+typedef struct pool_queue {
+	pthread_mutex_t		lock;
+	unsigned int		head, tail;
+	unsigned int *		job_index;
+} pool_queue_t;
+
+typedef struct pool_worker {
+	struct pool *		pool;
+	unsigned int		index;
+	uusb_dev_t *		dev;
+	pthread_t		thread;
+	bool			started;
+
+	pool_queue_t		queue;
+	unsigned int		num_done;
+	unsigned int		num_stolen;
+} pool_worker_t;
+
+typedef struct pool {
+	const utoken_config_t *	config;
+	unsigned int		debug;
+
+	utoken_job_t *		jobs;
+	unsigned int		num_jobs;
+
+	/* The latency cache is shared by all tokens of the same type */
+	pthread_mutex_t		latency_lock;
+
+	pthread_mutex_t		pin_lock;
+	pthread_cond_t		pin_cond;
+	int			pin_state;
+
+	unsigned int		num_workers;
+	pool_worker_t		workers[];
+} pool_t;
+
+enum {
+	POOL_PIN_UNTRIED,
+	POOL_PIN_TRYING,
+	POOL_PIN_GOOD,
+	POOL_PIN_BAD,
+};
+
+/* Not touched by the driver unless the card rejected the PIN */
+#define POOL_TRIES_UNKNOWN	(~0U)
+
+static utoken_job_t *
+pool_queue_pop(pool_t *pool, pool_queue_t *q, bool from_tail)
+{
+	utoken_job_t *job = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		if (from_tail)
+			job = &pool->jobs[q->job_index[--(q->tail)]];
+		else
+			job = &pool->jobs[q->job_index[(q->head)++]];
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return job;
+}
+
+static unsigned int
+pool_queue_length(pool_queue_t *q)
+{
+	unsigned int len;
+
+	pthread_mutex_lock(&q->lock);
+	len = q->tail - q->head;
+	pthread_mutex_unlock(&q->lock);
+
+	return len;
+}
+
+/*
+ * Take the next job from our own queue. If it's empty, steal one from
+ * the worker with the most jobs left.
+ */
+static utoken_job_t *
+pool_next_job(pool_worker_t *w)
+{
+	pool_t *pool = w->pool;
+	utoken_job_t *job;
+
+	if ((job = pool_queue_pop(pool, &w->queue, false)) != NULL)
+		return job;
+
+	while (true) {
+		pool_worker_t *victim = NULL;
+		unsigned int i, len, max_len = 0;
+
+		for (i = 0; i < pool->num_workers; ++i) {
+			pool_worker_t *other = &pool->workers[i];
+
+			if (other == w)
+				continue;
+
+			if ((len = pool_queue_length(&other->queue)) > max_len) {
+				max_len = len;
+				victim = other;
+			}
+		}
+
+		if (victim == NULL)
+			return NULL;
+
+		/* Someone else may have beaten us to it; if so, look again */
+		if ((job = pool_queue_pop(pool, &victim->queue, true)) != NULL) {
+			debug("Worker %u stole a job from worker %u\n", w->index, victim->index);
+			w->num_stolen++;
+			return job;
+		}
+	}
+}
+
+/*
+ * Wait until the PIN is known to be good, or until it's our turn to try
+ * it. Returns false if another worker found that the PIN is wrong.
+ */
+static bool
+pool_pin_wait(pool_t *pool)
+{
+	bool okay = true;
+
+	pthread_mutex_lock(&pool->pin_lock);
+	while (pool->pin_state == POOL_PIN_TRYING)
+		pthread_cond_wait(&pool->pin_cond, &pool->pin_lock);
+
+	if (pool->pin_state == POOL_PIN_UNTRIED)
+		pool->pin_state = POOL_PIN_TRYING;
+	else if (pool->pin_state == POOL_PIN_BAD)
+		okay = false;
+	pthread_mutex_unlock(&pool->pin_lock);
+
+	return okay;
+}
+
+/*
+ * Record the outcome of our attempt. If verification failed for some
+ * other reason than a wrong PIN, let the next worker have a go.
+ */
+static void
+pool_pin_done(pool_t *pool, bool verified, bool rejected)
+{
+	pthread_mutex_lock(&pool->pin_lock);
+	if (pool->pin_state == POOL_PIN_TRYING) {
+		if (verified)
+			pool->pin_state = POOL_PIN_GOOD;
+		else if (rejected)
+			pool->pin_state = POOL_PIN_BAD;
+		else
+			pool->pin_state = POOL_PIN_UNTRIED;
+		pthread_cond_broadcast(&pool->pin_cond);
+	}
+	pthread_mutex_unlock(&pool->pin_lock);
+}
+
+static ifd_card_t *
+pool_worker_setup_card(pool_worker_t *w, ccid_reader_t *reader)
+{
+	const utoken_config_t *config = w->pool->config;
+	ifd_card_t *card;
+	unsigned int i;
+
+	if (!ccid_reader_select_slot(reader, 0)
+	 || !(card = ccid_reader_identify_card(reader, 0)))
+		return NULL;
+
+	for (i = 0; i < config->ncardopts; ++i) {
+		if (!ifd_card_set_option(card, config->cardopts[i]))
+			goto failed;
+	}
+
+	if (!ifd_card_connect(card))
+		goto failed;
+
+	if (config->pin != NULL) {
+		unsigned int retries_left = POOL_TRIES_UNKNOWN;
+		bool verified;
+
+		if (!pool_pin_wait(w->pool)) {
+			debug("Worker %u: PIN was rejected by another token\n", w->index);
+			goto failed;
+		}
+
+		verified = ifd_card_verify(card, config->pin, strlen(config->pin), &retries_left);
+		pool_pin_done(w->pool, verified, retries_left != POOL_TRIES_UNKNOWN);
+
+		if (!verified) {
+			if (retries_left != POOL_TRIES_UNKNOWN)
+				error("Wrong PIN, %u attempts left\n", retries_left);
+			goto failed;
+		}
+	}
+
+	return card;
+
+failed:
+	ifd_card_free(card);
+	return NULL;
+}
+
+static void *
+pool_worker_main(void *arg)
+{
+	pool_worker_t *w = arg;
+	pool_t *pool = w->pool;
+	ccid_reader_t *reader;
+	ifd_card_t *card = NULL;
+	utoken_job_t *job;
+
+	opt_debug = pool->debug;
+
+	if (!(reader = ccid_reader_create(w->dev, pool->config->latency_cache, pool->config->deadline))) {
+		error("Worker %u: unable to create reader for USB device\n", w->index);
+		return NULL;
+	}
+
+	if (!(card = pool_worker_setup_card(w, reader))) {
+		error("Worker %u: token not usable, leaving its jobs to the others\n", w->index);
+		goto out;
+	}
+
+	while ((job = pool_next_job(w)) != NULL) {
+		debug("Worker %u: decrypting %s\n", w->index, job->name);
+		job->cleartext = ifd_card_decipher(card, job->ciphertext);
+		job->worker = w->index;
+		w->num_done++;
+
+		if (job->cleartext == NULL)
+			error("Worker %u: failed to decrypt %s\n", w->index, job->name);
+	}
+
+	pthread_mutex_lock(&pool->latency_lock);
+	ccid_reader_save_latency(reader);
+	pthread_mutex_unlock(&pool->latency_lock);
+
+out:
+	if (card)
+		ifd_card_free(card);
+	ccid_reader_free(reader);
+	return NULL;
+}
+
+static pool_t *
+pool_create(uusb_dev_t **devs, unsigned int ndevs, const utoken_config_t *config,
+		utoken_job_t *jobs, unsigned int njobs)
+{
+	pool_t *pool;
+	unsigned int i;
+
+	pool = calloc(1, sizeof(*pool) + ndevs * sizeof(pool_worker_t));
+	pool->config = config;
+	pool->debug = opt_debug;
+	pool->jobs = jobs;
+	pool->num_jobs = njobs;
+	pool->num_workers = ndevs;
+	pthread_mutex_init(&pool->latency_lock, NULL);
+	pthread_mutex_init(&pool->pin_lock, NULL);
+	pthread_cond_init(&pool->pin_cond, NULL);
+	pool->pin_state = POOL_PIN_UNTRIED;
+
+	for (i = 0; i < ndevs; ++i) {
+		pool_worker_t *w = &pool->workers[i];
+
+		w->pool = pool;
+		w->index = i;
+		w->dev = devs[i];
+		pthread_mutex_init(&w->queue.lock, NULL);
+		w->queue.job_index = calloc(njobs / ndevs + 1, sizeof(unsigned int));
+	}
+
+	for (i = 0; i < njobs; ++i) {
+		pool_queue_t *q = &pool->workers[i % ndevs].queue;
+
+		jobs[i].cleartext = NULL;
+		jobs[i].worker = -1;
+		q->job_index[q->tail++] = i;
+	}
+
+	return pool;
+}
+
+static void
+pool_free(pool_t *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->num_workers; ++i) {
+		pool_worker_t *w = &pool->workers[i];
+
+		pthread_mutex_destroy(&w->queue.lock);
+		free(w->queue.job_index);
+	}
+
+	pthread_mutex_destroy(&pool->latency_lock);
+	pthread_mutex_destroy(&pool->pin_lock);
+	pthread_cond_destroy(&pool->pin_cond);
+	free(pool);
+}
+
+/*
+ * Returns true if all jobs were completed successfully. The cleartext
+ * of each job belongs to the caller, and so do the devices.
+ */
+bool
+utoken_pool_decrypt(uusb_dev_t **devs, unsigned int ndevs, const utoken_config_t *config,
+		utoken_job_t *jobs, unsigned int njobs)
+{
+	pool_t *pool;
+	unsigned int i;
+	bool okay = true;
+
+	if (ndevs == 0)
+		return false;
+
+	pool = pool_create(devs, ndevs, config, jobs, njobs);
+
+	for (i = 0; i < ndevs; ++i) {
+		pool_worker_t *w = &pool->workers[i];
+
+		if (pthread_create(&w->thread, NULL, pool_worker_main, w) != 0) {
+			error("Unable to start worker %u\n", i);
+			continue;
+		}
+		w->started = true;
+	}
+
+	for (i = 0; i < ndevs; ++i) {
+		pool_worker_t *w = &pool->workers[i];
+
+		if (!w->started)
+			continue;
+
+		pthread_join(w->thread, NULL);
+		debug("Worker %u did %u jobs, %u of them stolen\n", i, w->num_done, w->num_stolen);
+	}
+
+	for (i = 0; i < njobs; ++i) {
+		if (jobs[i].cleartext == NULL)
+			okay = false;
+	}
+
+	pool_free(pool);
+	return okay;
+}
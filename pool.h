@@ -0,0 +1,60 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "uusb.h"
+
+/*
+ * How to talk to each token in the pool
+ */
+typedef struct utoken_config {
+	const char *		pin;
+
+	/* If set, the race takes the PIN from this prompt, once entered */
+	struct pin_prompt *	pin_prompt;
+
+	unsigned int		ncardopts;
+	char **			cardopts;
+	const char *		latency_cache;
+	uint64_t		deadline;
+} utoken_config_t;
+
+typedef struct utoken_job {
+	const char *		name;
+	buffer_t *		ciphertext;
+
+	/* Filled in when the job is done */
+	buffer_t *		cleartext;
+	int			worker;
+} utoken_job_t;
+
+extern bool		utoken_pool_decrypt(uusb_dev_t **devs, unsigned int ndevs,
+				const utoken_config_t *,
+				utoken_job_t *jobs, unsigned int njobs);
+
+/* Try all tokens at once, and take the first answer */
+extern buffer_t *	utoken_race_decrypt(uusb_dev_t **devs, unsigned int ndevs,
+				const utoken_config_t *,
+				buffer_t *ciphertext);
+
+#endif /* POOL_H */
@@ -0,0 +1,183 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Race several tokens that can decrypt the same secret, and go with
+ * whichever answers first. This hides tokens that are slow to wake up,
+ * or busy with something else.
+ *
+ * All tokens are driven from a single thread, using the non-blocking
+ * session API. Creating a session does not talk to the device, so all
+ * tokens start resyncing at the same time, and one that is slow to
+ * resume or has a stalled endpoint does not hold up the others. Once we
+ * have a winner, the others are cancelled without waiting for their
+ * readers to confirm the abort.
+ */
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "session.h"
+#include "pin.h"
+#include "bufparser.h"
+#include "util.h"
+
+static utoken_session_t *
+race_start_session(uusb_dev_t *dev, const utoken_config_t *config, buffer_t *ciphertext)
+{
+	utoken_session_t *sess;
+	ccid_reader_t *reader;
+	unsigned int i;
+
+	if (!(sess = utoken_session_create(dev, config->pin, ciphertext, config->deadline)))
+		return NULL;
+
+	if (config->pin_prompt)
+		utoken_session_wait_for_pin(sess);
+
+	for (i = 0; i < config->ncardopts; ++i) {
+		if (!utoken_session_set_card_option(sess, config->cardopts[i])) {
+			utoken_session_free(sess);
+			return NULL;
+		}
+	}
+
+	reader = utoken_session_get_reader(sess);
+	ccid_reader_set_latency_cache(reader, config->latency_cache);
+	return sess;
+}
+
+/*
+ * Once the user has entered the PIN, hand it to all sessions that are
+ * still in the race. Returns false if we did not get a PIN.
+ */
+static bool
+race_deliver_pin(utoken_session_t **sessions, unsigned int nsessions, pin_prompt_t *prompt)
+{
+	const char *pin;
+	unsigned int i;
+
+	if (!pin_prompt_wait(prompt, &pin))
+		return false;
+
+	for (i = 0; i < nsessions; ++i) {
+		if (sessions[i])
+			utoken_session_set_pin(sessions[i], pin);
+	}
+	return true;
+}
+
+/*
+ * Returns the first valid cleartext, or NULL if all tokens failed.
+ * The devices belong to the caller.
+ *
+ * With a PIN prompt, the tokens are brought up while the user is still
+ * typing, and wait for the PIN right before verifying it.
+ */
+buffer_t *
+utoken_race_decrypt(uusb_dev_t **devs, unsigned int ndevs, const utoken_config_t *config,
+		buffer_t *ciphertext)
+{
+	utoken_session_t *sessions[ndevs];
+	struct pollfd pfd[ndevs + 1];
+	pin_prompt_t *pin_prompt = config->pin_prompt;
+	buffer_t *cleartext = NULL;
+	unsigned int i, nactive = 0;
+
+	for (i = 0; i < ndevs; ++i) {
+		if ((sessions[i] = race_start_session(devs[i], config, ciphertext)) != NULL)
+			nactive++;
+	}
+
+	while (cleartext == NULL && nactive) {
+		unsigned int nfds = 0;
+		long timeout = -1;
+
+		if (pin_prompt && pin_prompt_ready(pin_prompt)) {
+			if (!race_deliver_pin(sessions, ndevs, pin_prompt))
+				break;
+			pin_prompt = NULL;
+		}
+
+		for (i = 0; i < ndevs; ++i) {
+			utoken_session_t *sess = sessions[i];
+			xfer_status_t status;
+			long sess_timeout;
+
+			if (sess == NULL)
+				continue;
+
+			status = utoken_session_step(sess);
+			if (status == XFER_DONE) {
+				debug("Token %u answered first\n", i);
+				cleartext = utoken_session_take_cleartext(sess);
+				break;
+			}
+
+			if (status == XFER_FAILED) {
+				debug("Token %u dropped out of the race\n", i);
+				utoken_session_free(sess);
+				sessions[i] = NULL;
+				nactive--;
+				continue;
+			}
+
+			sess_timeout = utoken_session_get_timeout(sess);
+			if (sess_timeout >= 0 && (timeout < 0 || sess_timeout < timeout))
+				timeout = sess_timeout;
+
+			pfd[nfds].fd = utoken_session_get_fd(sess);
+			pfd[nfds].events = POLLOUT;
+			nfds++;
+		}
+
+		if (cleartext == NULL && pin_prompt) {
+			if (deadline_expired(config->deadline)) {
+				error("Deadline expired while waiting for PIN\n");
+				break;
+			}
+
+			timeout = deadline_cap_timeout(config->deadline, timeout);
+			pfd[nfds].fd = pin_prompt_get_fd(pin_prompt);
+			pfd[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (cleartext == NULL && nfds)
+			poll(pfd, nfds, timeout);
+	}
+
+	for (i = 0; i < ndevs; ++i) {
+		utoken_session_t *sess = sessions[i];
+
+		if (sess == NULL)
+			continue;
+
+		utoken_session_cancel(sess);
+		ccid_reader_save_latency(utoken_session_get_reader(sess));
+		utoken_session_free(sess);
+	}
+
+	if (cleartext == NULL)
+		error("None of the tokens was able to decrypt the secret\n");
+	return cleartext;
+}
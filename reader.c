@@ -19,13 +19,19 @@
  */
 
 
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include "uusb.h"
 #include "ccid.h"
 #include "scard.h"
 #include "ccid_impl.h"
 #include "bufparser.h"
+#include "latency.h"
+#include "pcsc.h"
 
 #define CCID_CMD_FIRST		0x60
 #define CCID_CMD_ICCPOWERON	0x62
@@ -54,38 +60,110 @@
 #define CCID_HDR_OFFSET_CTL3	9
 #define CCID_HDR_SIZE		10
 
-struct ccid_reader {
-	uusb_dev_t *		dev;
-	const ccid_descriptor_t *ccid;
-	unsigned int		max_message_size;
-	unsigned int		supported_protocols;
+/* bmICCStatus values reported in slot status */
+#define CCID_ICC_ACTIVE		0
+#define CCID_ICC_INACTIVE	1
+#define CCID_ICC_ABSENT		2
 
-	bool			auto_voltage;
-	unsigned int		supported_voltages;
+/* Class specific control requests */
+#define CCID_REQ_ABORT		0x01
 
-	int			current_slot;
+/* How long we give the reader to acknowledge an ABORT */
+#define CCID_ABORT_TIMEOUT	500
 
-	unsigned int		ccid_seq;
-};
+/* When draining stale responses, we do not want to wait for anything */
+#define CCID_DRAIN_TIMEOUT	10
+#define CCID_DRAIN_MAX		16
+/* Slot status is answered by the reader itself, so it should be quick */
+#define CCID_RESYNC_TIMEOUT	1000
+
+/* APDU buffer size when going through pcscd. Our card drivers use short
+ * APDUs with chaining, so this is plenty. */
+#define CCID_PCSC_MAX_MESSAGE	4096
+
+/* Number of stale or unrelated packets we're willing to skip */
+#define CCID_MAX_RETRIES	6
+/* Number of time extensions we're willing to grant the card */
+#define CCID_MAX_TIME_EXTENSIONS 64
 
 typedef struct ccid_command ccid_command_t;
 struct ccid_command {
-	uint8_t			slot, seq;
+	uint8_t			type, slot, seq;
+	int			ins;		/* INS byte of XfrBlock APDU, or -1 */
+	long			timeout;	/* if 0, use the learned timeout */
 	buffer_t *		pkt;
+	bool			borrowed;	/* pkt belongs to the caller */
 };
 
 typedef struct ccid_response ccid_response_t;
 struct ccid_response {
 	uint8_t			type, slot, seq;
 	uint8_t			ctl[3];
-	buffer_t *		pkt;
 	buffer_t *		payload;
 };
 
+/*
+ * State of the command in flight when using the non-blocking interface
+ */
+typedef struct ccid_async {
+	bool			busy;
+	ccid_command_t		cmd;
+	uint8_t			expected;
+	uint8_t			icc_status;
+
+	uusb_urb_t *		send_urb;
+	uusb_urb_t *		recv_urb;
+	buffer_t *		rbuf;
+	buffer_t *		result;
+
+	ccid_latency_stat_t *	stat;
+	long			base_timeout;
+	long			wait;
+	uint64_t		start;
+	uint64_t		expires;
+	unsigned int		retries;
+	unsigned int		extensions;
+	bool			extended;
+} ccid_async_t;
+
+struct ccid_reader {
+	uusb_dev_t *		dev;
+	const ccid_descriptor_t *ccid;
+	unsigned int		max_message_size;
+	unsigned int		supported_protocols;
+
+	bool			auto_voltage;
+	unsigned int		supported_voltages;
+
+	int			current_slot;
+	int			icc_status;
+
+	unsigned int		ccid_seq;
+
+	/* Buffers for CCID packets and APDUs */
+	buffer_pool_t *		pool;
+
+	uint64_t		deadline;
+
+	char *			latency_dir;
+	char *			latency_path;
+	ccid_latency_t		latency;
+
+	ccid_async_t		async;
+
+	/* If set, APDUs go through pcscd rather than straight to the device */
+	pcsc_conn_t *		pcsc;
+};
+
 static bool	ccid_reader_set_features(ccid_reader_t *, const ccid_descriptor_t *);
+static bool	ccid_reader_resync(ccid_reader_t *);
+static void	ccid_async_reset(ccid_reader_t *);
 
-ccid_reader_t *
-ccid_reader_create(uusb_dev_t *dev)
+/*
+ * Set up the reader, without talking to it yet.
+ */
+static ccid_reader_t *
+ccid_reader_alloc(uusb_dev_t *dev, const char *latency_cache, uint64_t deadline)
 {
 	const ccid_descriptor_t *ccid;
 	ccid_reader_t *reader;
@@ -106,16 +184,21 @@ ccid_reader_create(uusb_dev_t *dev)
 	reader = calloc(1, sizeof(*reader));
 	reader->dev = dev;
 	reader->ccid = ccid;
+	/* Set these right away, so that they apply to the resync, too */
+	reader->deadline = deadline;
+	ccid_reader_set_latency_cache(reader, latency_cache);
 
 	reader->current_slot = -1;
 
 	if (!ccid_reader_set_features(reader, ccid)) {
-		/* ccid_reader_free(reader); */
+		ccid_reader_free(reader);
 		return NULL;
 	}
 
 	reader->max_message_size = ccid->dwMaxCCIDMessageLength;
 	reader->supported_protocols = ccid->dwProtocols;
+	/* APDUs carry PINs and plaintext, so all of them go into locked memory */
+	reader->pool = buffer_pool_create_secure(reader->max_message_size);
 	reader->supported_voltages = ccid->bVoltageSupport & 0x7;
 
 	if (reader->supported_voltages == 0 && !reader->auto_voltage) {
@@ -125,38 +208,236 @@ ccid_reader_create(uusb_dev_t *dev)
 	return reader;
 }
 
-static ccid_command_t *
-ccid_command_create(uint8_t seqno, uint8_t slot, buffer_t *pkt)
+ccid_reader_t *
+ccid_reader_create(uusb_dev_t *dev, const char *latency_cache, uint64_t deadline)
+{
+	ccid_reader_t *reader;
+
+	if (!(reader = ccid_reader_alloc(dev, latency_cache, deadline)))
+		return NULL;
+
+	if (!ccid_reader_resync(reader)) {
+		error("Unable to establish communication with CCID reader\n");
+		ccid_reader_free(reader);
+		return NULL;
+	}
+
+	return reader;
+}
+
+/*
+ * For the non-blocking interface. This does not talk to the reader at
+ * all; use ccid_reader_submit_resync() before the first real command.
+ */
+ccid_reader_t *
+ccid_reader_create_nonblocking(uusb_dev_t *dev, const char *latency_cache, uint64_t deadline)
+{
+	return ccid_reader_alloc(dev, latency_cache, deadline);
+}
+
+/*
+ * Create a reader that passes APDUs to pcscd, for when the daemon owns
+ * the device. The card has already been powered up by pcscd, and we
+ * only ever see a single slot.
+ */
+ccid_reader_t *
+ccid_reader_create_pcsc(const char *reader_name, uint64_t deadline)
+{
+	ccid_reader_t *reader;
+	pcsc_conn_t *pcsc;
+
+	if (!(pcsc = pcsc_connect(reader_name, deadline)))
+		return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	reader->pcsc = pcsc;
+	reader->deadline = deadline;
+	reader->max_message_size = CCID_PCSC_MAX_MESSAGE;
+	reader->pool = buffer_pool_create_secure(reader->max_message_size);
+	reader->current_slot = 0;
+	reader->icc_status = CCID_ICC_ACTIVE;
+	ccid_latency_init(&reader->latency);
+
+	return reader;
+}
+
+/*
+ * The reader does not own the USB device; the caller has to close that
+ * separately, after freeing the reader. Buffers handed out by the reader
+ * remain valid after it has been freed.
+ */
+void
+ccid_reader_free(ccid_reader_t *reader)
+{
+	ccid_async_reset(reader);
+	if (reader->async.send_urb)
+		uusb_urb_free(reader->async.send_urb);
+	if (reader->async.recv_urb)
+		uusb_urb_free(reader->async.recv_urb);
+
+	if (reader->pcsc)
+		pcsc_disconnect(reader->pcsc);
+
+	buffer_pool_free(reader->pool);
+	drop_string(&reader->latency_dir);
+	drop_string(&reader->latency_path);
+	free(reader);
+}
+
+void
+ccid_reader_set_latency_cache(ccid_reader_t *reader, const char *dirname)
+{
+	const uusb_type_t *type;
+	char path[PATH_MAX];
+
+	drop_string(&reader->latency_dir);
+	drop_string(&reader->latency_path);
+	ccid_latency_init(&reader->latency);
+
+	/* pcscd does its own timing */
+	if (dirname == NULL || reader->pcsc)
+		return;
+
+	type = uusb_dev_get_type(reader->dev);
+
+	snprintf(path, sizeof(path), "%s/%04x-%04x", dirname, type->idVendor, type->idProduct);
+	assign_string(&reader->latency_dir, dirname);
+	assign_string(&reader->latency_path, path);
+
+	ccid_latency_load(&reader->latency, path);
+}
+
+bool
+ccid_reader_save_latency(ccid_reader_t *reader)
+{
+	if (reader->latency_path == NULL || !reader->latency.dirty)
+		return true;
+
+	if (mkdir(reader->latency_dir, 0755) < 0 && errno != EEXIST) {
+		debug("Cannot create %s: %m\n", reader->latency_dir);
+		return false;
+	}
+
+	return ccid_latency_save(&reader->latency, reader->latency_path);
+}
+
+void
+ccid_reader_set_deadline(ccid_reader_t *reader, uint64_t deadline)
+{
+	reader->deadline = deadline;
+}
+
+bool
+ccid_reader_deadline_expired(const ccid_reader_t *reader)
+{
+	return deadline_expired(reader->deadline);
+}
+
+static bool
+ccid_put_header(buffer_t *bp, uint8_t type, uint32_t payload_len, uint8_t slot, uint8_t seq,
+			const unsigned char *ctl_data)
+{
+	static const unsigned char ctl_zero[3] = { 0, 0, 0 };
+
+	if (ctl_data == NULL)
+		ctl_data = ctl_zero;
+
+	return buffer_put_u8(bp, &type)
+	    && buffer_put_u32le(bp, payload_len)
+	    && buffer_put_u8(bp, &slot)
+	    && buffer_put_u8(bp, &seq)
+	    && buffer_put(bp, ctl_data, 3);
+}
+
+static void
+ccid_command_init(ccid_command_t *cmd, buffer_t *pkt, uint8_t slot, uint8_t type, uint8_t seq)
 {
-	ccid_command_t *cmd;
+	memset(cmd, 0, sizeof(*cmd));
 
-	cmd = calloc(1, sizeof(*cmd));
+	/* Increase the seqno once we've actually sent the packet */
 	cmd->pkt = pkt;
-	cmd->seq = seqno;
+	cmd->type = type;
+	cmd->ins = -1;
+	cmd->seq = seq;
 	cmd->slot = slot;
-	return cmd;
+}
+
+static bool
+ccid_build_command(ccid_reader_t *reader, ccid_command_t *cmd, uint8_t slot, uint8_t type,
+			const unsigned char *ctl_data,
+			const void *payload, unsigned int payload_len)
+{
+	uint8_t seq = reader->ccid_seq;
+	buffer_t *bp;
+
+	bp = buffer_pool_acquire(reader->pool, CCID_HDR_SIZE + payload_len);
+	if (!ccid_put_header(bp, type, payload_len, slot, seq, ctl_data))
+		goto failed;
+
+	if (payload_len && !buffer_put(bp, payload, payload_len))
+		goto failed;
+
+	ccid_command_init(cmd, bp, slot, type, seq);
+	return true;
+
+failed:
+	buffer_free(bp);
+	return false;
+}
+
+/*
+ * Wrap the CCID header around a payload that was built with enough
+ * headroom. The command borrows the caller's buffer; destroying the
+ * command strips the header again.
+ */
+static bool
+ccid_build_command_inplace(ccid_reader_t *reader, ccid_command_t *cmd, uint8_t slot, uint8_t type,
+			const unsigned char *ctl_data,
+			buffer_t *payload)
+{
+	unsigned int payload_len = buffer_available(payload);
+	uint8_t seq = reader->ccid_seq;
+	buffer_t hdr;
+	void *p;
+
+	if (!(p = buffer_push_header(payload, CCID_HDR_SIZE)))
+		return false;
+
+	buffer_init_write(&hdr, p, CCID_HDR_SIZE);
+	if (!ccid_put_header(&hdr, type, payload_len, slot, seq, ctl_data)) {
+		buffer_pull_header(payload, CCID_HDR_SIZE);
+		return false;
+	}
+
+	ccid_command_init(cmd, payload, slot, type, seq);
+	cmd->borrowed = true;
+	return true;
 }
 
 static void
-ccid_command_free(ccid_command_t *cmd)
+ccid_command_destroy(ccid_command_t *cmd)
 {
-	if (cmd->pkt)
+	if (cmd->pkt == NULL)
+		return;
+
+	if (cmd->borrowed)
+		buffer_pull_header(cmd->pkt, CCID_HDR_SIZE);
+	else
 		buffer_free(cmd->pkt);
-	free(cmd);
+	cmd->pkt = NULL;
 }
 
-static ccid_response_t *
-ccid_response_create(buffer_t *pkt)
+static bool
+ccid_response_parse(ccid_response_t *resp, buffer_t *pkt)
 {
-	ccid_response_t *resp;
 	uint32_t payload_len;
 
-	if (buffer_available(pkt) < 10) {
+	memset(resp, 0, sizeof(*resp));
+	if (buffer_available(pkt) < CCID_HDR_SIZE) {
 		debug("short ccid response packet\n");
-		return NULL;
+		return false;
 	}
 
-	resp = calloc(1, sizeof(*resp));
 	if (!buffer_get_u8(pkt, &resp->type)
 	 || !buffer_get_u32le(pkt, &payload_len)
 	 || !buffer_get_u8(pkt, &resp->slot)
@@ -165,53 +446,38 @@ ccid_response_create(buffer_t *pkt)
 	 || !buffer_truncate(pkt, payload_len)
 	 ) {
 		debug2("short ccid response packet\n");
-		free(resp);
-		return NULL;
+		return false;
 	}
 
 	resp->payload = pkt;
-	return resp;
+	return true;
 }
 
 static void
-ccid_response_free(ccid_response_t *resp)
+ccid_response_destroy(ccid_response_t *resp)
 {
-	if (resp->pkt)
-		buffer_free(resp->pkt);
 	if (resp->payload)
 		buffer_free(resp->payload);
-	free(resp);
+	resp->payload = NULL;
 }
 
-static ccid_command_t *
-ccid_build_command(ccid_reader_t *reader, uint8_t slot, uint8_t cmd,
-			const unsigned char *ctl_data,
-			const void *payload, unsigned int payload_len)
+static buffer_t *
+ccid_recv(ccid_reader_t *reader, long timeout)
 {
-	static const unsigned char ctl_zero[3] = { 0, 0, 0 };
-	uint8_t seq = reader->ccid_seq;
-	buffer_t *bp;
-
-	if (ctl_data == NULL)
-		ctl_data = ctl_zero;
+	buffer_t *pkt;
 
-	bp = buffer_alloc_write(16 + payload_len);
-	if (!buffer_put_u8(bp, &cmd)
-	 || !buffer_put_u32le(bp, payload_len)
-	 || !buffer_put_u8(bp, &slot)
-	 || !buffer_put_u8(bp, &seq)
-	 || !buffer_put(bp, ctl_data, 3))
-		goto failed;
-
-	if (payload_len && !buffer_put(bp, payload, payload_len))
-		goto failed;
+	/* Get a response packet large enough to hold the max response size */
+	pkt = buffer_pool_acquire(reader->pool, reader->max_message_size);
+	if (!uusb_recv(reader->dev, pkt, timeout)) {
+		int saved_errno = errno;
 
-	/* Increase the seqno once we've actually sent the packet */
-	return ccid_command_create(seq, slot, bp);
+		/* The caller wants to know whether this was a timeout */
+		buffer_free(pkt);
+		errno = saved_errno;
+		return NULL;
+	}
 
-failed:
-	buffer_free(bp);
-	return NULL;
+	return pkt;
 }
 
 static void
@@ -230,6 +496,7 @@ ccid_dump_response(buffer_t *pkt)
 
 	if (buffer_available(pkt) < 10 + payload_len) {
 		debug("Received CCID response, data truncated\n");
+		payload_len = buffer_available(pkt) - 10;
 	} else {
 		debug("Received CCID response\n");
 	}
@@ -237,143 +504,410 @@ ccid_dump_response(buffer_t *pkt)
 	hexdump(hdr, 10 + payload_len, debug2, 4);
 }
 
-static ccid_command_t *
-ccid_build_simple_packet(ccid_reader_t *reader, unsigned int slot, unsigned int cmd)
+static bool
+ccid_build_simple_packet(ccid_reader_t *reader, ccid_command_t *cmd, unsigned int slot, unsigned int type)
 {
-	return ccid_build_command(reader, slot, cmd, NULL, NULL, 0);
+	return ccid_build_command(reader, cmd, slot, type, NULL, NULL, 0);
 }
 
-static ccid_response_t *
-ccid_xfer(ccid_reader_t *reader, ccid_command_t *cmd, uint8_t expected_resp_type)
+/*
+ * Cancel the command currently outstanding on the given slot. This uses
+ * the ABORT control request, followed by a PC_to_RDR_Abort message carrying
+ * the same sequence number. This is done outside the regular ccid_xfer
+ * path, because we usually get here after the deadline has expired.
+ */
+static bool
+ccid_abort_start(ccid_reader_t *reader, uint8_t slot, ccid_command_t *cmd)
 {
-	ccid_response_t *resp = NULL;
-	unsigned int retries = 6;
-	bool rv;
+	if (!ccid_build_simple_packet(reader, cmd, slot, CCID_CMD_ABORT))
+		return false;
 
-	debug("Sending CCID packet (slot=%u seq=%u)\n", cmd->slot, cmd->seq);
-	if (opt_debug > 1) {
-	       buffer_t *pkt = cmd->pkt;
+	debug("Aborting outstanding command on slot %u (seq=%u)\n", slot, cmd->seq);
+	if (!uusb_interface_request(reader->dev, CCID_REQ_ABORT, slot | (cmd->seq << 8), CCID_ABORT_TIMEOUT)
+	 || !uusb_send(reader->dev, cmd->pkt, CCID_ABORT_TIMEOUT)) {
+		error("Unable to abort outstanding CCID command\n");
+		ccid_command_destroy(cmd);
+		return false;
+	}
 
-               hexdump(buffer_read_pointer(pkt), buffer_available(pkt), debug2, 4);
-        }
+	reader->ccid_seq = cmd->seq + 1;
+	return true;
+}
 
-	rv = uusb_send(reader->dev, cmd->pkt);
-	if (!rv)
-		return NULL;
+static bool
+ccid_abort(ccid_reader_t *reader, uint8_t slot)
+{
+	ccid_command_t cmd;
+	unsigned int retries = CCID_MAX_RETRIES;
+	bool okay = false;
 
-	reader->ccid_seq = cmd->seq + 1;
+	if (!ccid_abort_start(reader, slot, &cmd))
+		return false;
 
-	while (true) {
+	/* Skip over the response to the aborted command, if any */
+	while (retries--) {
+		ccid_response_t resp;
 		buffer_t *rbuf;
 
-		if (retries-- == 0) {
-			error("%s: too many retries\n", __func__);
+		if (!(rbuf = ccid_recv(reader, CCID_ABORT_TIMEOUT)))
 			break;
+
+		if (!ccid_response_parse(&resp, rbuf)) {
+			buffer_free(rbuf);
+			continue;
 		}
 
-		rbuf = uusb_recv(reader->dev, reader->max_message_size, 10000);
-		if (rbuf == NULL)
+		if (resp.type == CCID_RESP_SLOTSTAT && resp.slot == slot && resp.seq == cmd.seq)
+			okay = true;
+		ccid_response_destroy(&resp);
+
+		if (okay)
 			break;
+	}
 
-		if (opt_debug > 1)
-			ccid_dump_response(rbuf);
+	if (!okay)
+		error("Unable to abort outstanding CCID command\n");
+	ccid_command_destroy(&cmd);
+	return okay;
+}
 
-		resp = ccid_response_create(rbuf);
-		if (resp == NULL) {
-			/* truncated packet */
-			buffer_free(rbuf);
-		} else {
-			if (resp->slot == cmd->slot && resp->seq == cmd->seq) {
-				uint8_t ctl = resp->ctl[0];
-
-				if (resp->type != expected_resp_type) {
-					error("CCID response type %02x, expected %02x\n",
-							resp->type, expected_resp_type);
-					goto failed;
-				}
-
-				if ((ctl & 0xc0) == 0)
-					return resp;
-
-				if ((ctl & 0xc0) == 0x80) {
-					debug("Card needs more time\n");
-				} else {
-					error("CCID error %u\n", resp->ctl[1]);
-					goto failed;
-				}
-			}
-		}
+enum {
+	CCID_CHECK_SKIP,
+	CCID_CHECK_COMPLETE,
+	CCID_CHECK_MORE_TIME,
+	CCID_CHECK_ERROR,
+};
+
+/*
+ * Parse a packet received from the reader, and decide what to make of it.
+ * Packets that do not belong to the command are skipped. On return, the
+ * packet is owned by the response.
+ */
+static int
+ccid_response_check(const ccid_command_t *cmd, uint8_t expected_resp_type,
+			ccid_response_t *resp, buffer_t *rbuf)
+{
+	uint8_t ctl;
 
-		/* wrong packet, or timeout extension */
-		ccid_response_free(resp);
-		resp = NULL;
+	if (!ccid_response_parse(resp, rbuf)) {
+		/* truncated packet */
+		buffer_free(rbuf);
+		return CCID_CHECK_SKIP;
 	}
 
-	return resp;
+	if (resp->slot != cmd->slot || resp->seq != cmd->seq)
+		return CCID_CHECK_SKIP;
 
-failed:
-	if (resp)
-		ccid_response_free(resp);
-	return NULL;
+	if (resp->type != expected_resp_type) {
+		error("CCID response type %02x, expected %02x\n",
+				resp->type, expected_resp_type);
+		return CCID_CHECK_ERROR;
+	}
+
+	ctl = resp->ctl[0];
+	if ((ctl & 0xc0) == 0)
+		return CCID_CHECK_COMPLETE;
+
+	if ((ctl & 0xc0) != 0x80) {
+		error("CCID error %u\n", resp->ctl[1]);
+		return CCID_CHECK_ERROR;
+	}
+
+	return CCID_CHECK_MORE_TIME;
 }
 
+/*
+ * Time extension. bError carries the BWT multiplier (bmWI) requested by
+ * the card. This does not count as a retry.
+ */
 static bool
-ccid_get_slot_status(ccid_reader_t *reader, unsigned int slot, int *status_ret)
+ccid_grant_time_extension(const ccid_response_t *resp, long base_timeout,
+			unsigned int *extensions, long *wait)
 {
-	ccid_command_t *cmd = NULL;
-	ccid_response_t *resp = NULL;
+	if (++(*extensions) > CCID_MAX_TIME_EXTENSIONS) {
+		error("Card keeps asking for more time, giving up\n");
+		return false;
+	}
 
-	cmd = ccid_build_simple_packet(reader, slot, CCID_CMD_GETSLOTSTAT);
-	if (cmd == NULL)
-		goto failed;
+	*wait = base_timeout * (resp->ctl[1]? resp->ctl[1] : 1);
+	if (*wait > CCID_TIMEOUT_MAX)
+		*wait = CCID_TIMEOUT_MAX;
+	debug("Card needs more time (bmWI=%u), waiting up to %ld ms\n",
+			resp->ctl[1], *wait);
+	return true;
+}
 
-	if (!(resp = ccid_xfer(reader, cmd, CCID_RESP_SLOTSTAT)))
-		goto failed;
+static long
+ccid_command_timeout(ccid_reader_t *reader, const ccid_command_t *cmd, ccid_latency_stat_t *stat)
+{
+	if (cmd->timeout)
+		return cmd->timeout;
+	return ccid_latency_timeout(stat);
+}
 
-	if ((resp->ctl[0] & 0x3) == 2)
-		*status_ret = 0;
-	else
-		*status_ret = 1;
+/*
+ * The learned timeouts only grow with successful responses. When a card
+ * turns out to be slower than anything we've seen (a bigger key, a card
+ * that was cold), record how long we have waited so far, so that the
+ * timeout widens for next time, and give it one more chance. The extra
+ * time is derived from the updated statistics, so that it is at least
+ * twice what we've waited so far, but a dead reader is still noticed
+ * long before the default timeout.
+ *
+ * Without learned statistics, we have already waited for the default
+ * timeout, and that is all we're willing to give.
+ */
+static bool
+ccid_extend_learned_timeout(ccid_reader_t *reader, const ccid_command_t *cmd, ccid_latency_stat_t *stat,
+			uint64_t start, bool *extended, long *wait)
+{
+	if (cmd->timeout || *extended || !ccid_latency_trusted(stat))
+		return false;
 
-	ccid_command_free(cmd);
-	ccid_response_free(resp);
+	ccid_latency_record(&reader->latency, stat, monotonic_time_ms() - start);
+	*extended = true;
+	*wait = ccid_latency_timeout(stat);
+	debug("No response within the learned timeout, waiting up to %ld ms more\n", *wait);
 	return true;
-
-failed:
-	if (cmd)
-		ccid_command_free(cmd);
-	if (resp)
-		ccid_response_free(resp);
-	return false;
 }
 
 static bool
-ccid_card_poweron(ccid_reader_t *reader, unsigned int slot, uint8_t voltage, ifd_atrbuf_t *atr)
+ccid_xfer(ccid_reader_t *reader, ccid_command_t *cmd, uint8_t expected_resp_type, ccid_response_t *resp)
 {
-	unsigned char ctl[3] = { 0, 0, 0 };
-	ccid_command_t *cmd = NULL;
-	ccid_response_t *resp = NULL;
-	buffer_t *atrbuf;
-	bool rv = false;
+	unsigned int retries = CCID_MAX_RETRIES;
+	unsigned int extensions = 0;
+	bool extended = false;
+	ccid_latency_stat_t *stat;
+	long base_timeout, wait, timeout;
+	uint64_t start;
+	bool rv;
 
-	ctl[0] = voltage;
+	memset(resp, 0, sizeof(*resp));
 
-	cmd = ccid_build_command(reader, slot, CCID_CMD_ICCPOWERON, ctl, NULL, 0);
-	if (cmd == NULL)
-		goto done;
+	stat = ccid_latency_get_stat(&reader->latency, cmd->type, cmd->ins);
+	base_timeout = wait = ccid_command_timeout(reader, cmd, stat);
 
-	if (!(resp = ccid_xfer(reader, cmd, CCID_RESP_DATA)))
-		goto done;
+	/* A zero timeout would make the kernel wait forever */
+	timeout = deadline_cap_timeout(reader->deadline, wait);
+	if (timeout == 0) {
+		error("Deadline expired, not sending CCID command\n");
+		return false;
+	}
 
-	atrbuf = resp->payload;
-	ifd_atrbuf_set(atr, buffer_read_pointer(atrbuf), buffer_available(atrbuf));
-	rv = true;
+	debug("Sending CCID packet (slot=%u seq=%u timeout=%ld)\n", cmd->slot, cmd->seq, timeout);
+	if (opt_debug > 1) {
+	       buffer_t *pkt = cmd->pkt;
 
-done:
-	if (cmd)
-		ccid_command_free(cmd);
-	if (resp)
-		ccid_response_free(resp);
+               hexdump(buffer_read_pointer(pkt), buffer_available(pkt), debug2, 4);
+        }
+
+	start = monotonic_time_ms();
+
+	rv = uusb_send(reader->dev, cmd->pkt, timeout);
+	if (!rv)
+		return false;
+
+	reader->ccid_seq = cmd->seq + 1;
+
+	while (true) {
+		buffer_t *rbuf;
+
+		timeout = deadline_cap_timeout(reader->deadline, wait);
+		if (timeout == 0)
+			goto expired;
+
+		rbuf = ccid_recv(reader, timeout);
+		if (rbuf == NULL) {
+			if (ccid_reader_deadline_expired(reader))
+				goto expired;
+			if (errno == ETIMEDOUT
+			 && ccid_extend_learned_timeout(reader, cmd, stat, start, &extended, &wait))
+				continue;
+			break;
+		}
+
+		if (opt_debug > 1)
+			ccid_dump_response(rbuf);
+
+		switch (ccid_response_check(cmd, expected_resp_type, resp, rbuf)) {
+		case CCID_CHECK_COMPLETE:
+			ccid_latency_record(&reader->latency, stat,
+					monotonic_time_ms() - start);
+			return true;
+
+		case CCID_CHECK_ERROR:
+			goto failed;
+
+		case CCID_CHECK_MORE_TIME:
+			if (!ccid_grant_time_extension(resp, base_timeout, &extensions, &wait))
+				goto failed;
+			ccid_response_destroy(resp);
+			continue;
+
+		default:
+			break;
+		}
+
+		/* wrong packet */
+		ccid_response_destroy(resp);
+
+		if (retries-- == 0) {
+			error("%s: too many retries\n", __func__);
+			break;
+		}
+	}
+
+	return false;
+
+expired:
+	error("Deadline expired while waiting for CCID response\n");
+	ccid_abort(reader, cmd->slot);
+	return false;
+
+failed:
+	ccid_response_destroy(resp);
+	return false;
+}
+
+/*
+ * Discard any responses left over from a previous user of the device,
+ * and make sure our sequence numbers do not collide with theirs.
+ */
+static void
+ccid_reader_drain(ccid_reader_t *reader)
+{
+	unsigned int count;
+	buffer_t *rbuf;
+
+	for (count = 0; count < CCID_DRAIN_MAX; ++count) {
+		ccid_response_t resp;
+		long timeout;
+
+		/* A zero timeout would make the kernel wait forever */
+		if ((timeout = deadline_cap_timeout(reader->deadline, CCID_DRAIN_TIMEOUT)) == 0)
+			break;
+
+		rbuf = ccid_recv(reader, timeout);
+		if (rbuf == NULL)
+			break;
+
+		if (!ccid_response_parse(&resp, rbuf)) {
+			debug("Discarding stale CCID packet\n");
+			buffer_free(rbuf);
+			continue;
+		}
+
+		debug("Discarding stale CCID response (slot=%u seq=%u)\n", resp.slot, resp.seq);
+		reader->ccid_seq = resp.seq + 1;
+		ccid_response_destroy(&resp);
+	}
+}
+
+/*
+ * Once we know how fast this reader answers, go with the learned timeout.
+ * Returns 0 for that.
+ */
+static long
+ccid_probe_timeout(ccid_reader_t *reader)
+{
+	if (ccid_latency_trusted(ccid_latency_get_stat(&reader->latency, CCID_CMD_GETSLOTSTAT, -1)))
+		return 0;
+	return CCID_RESYNC_TIMEOUT;
+}
+
+static bool
+ccid_reader_probe(ccid_reader_t *reader)
+{
+	ccid_command_t cmd;
+	ccid_response_t resp;
+	bool okay;
+
+	if (!ccid_build_simple_packet(reader, &cmd, 0, CCID_CMD_GETSLOTSTAT))
+		return false;
+
+	cmd.timeout = ccid_probe_timeout(reader);
+	okay = ccid_xfer(reader, &cmd, CCID_RESP_SLOTSTAT, &resp);
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
+
+	return okay;
+}
+
+/*
+ * A previous process may have died in the middle of an exchange, leaving
+ * stale responses in the pipe, or an endpoint stalled. Get the reader into
+ * a known state before we send the first real command, escalating from
+ * draining the IN pipe to clearing halts to resetting the device.
+ */
+static bool
+ccid_reader_resync(ccid_reader_t *reader)
+{
+	unsigned int attempt;
+
+	for (attempt = 0; attempt < 3; ++attempt) {
+		ccid_reader_drain(reader);
+		if (ccid_reader_probe(reader))
+			return true;
+
+		if (ccid_reader_deadline_expired(reader)) {
+			error("Deadline expired while resynchronizing with CCID reader\n");
+			break;
+		}
+
+		if (attempt == 0) {
+			debug("CCID reader does not respond, clearing endpoint halt\n");
+			uusb_clear_halt(reader->dev);
+		} else if (attempt == 1) {
+			debug("CCID reader still does not respond, resetting device\n");
+			if (!uusb_reset(reader->dev))
+				break;
+			reader->ccid_seq = 0;
+		}
+	}
+
+	return false;
+}
+
+static bool
+ccid_get_slot_status(ccid_reader_t *reader, unsigned int slot, int *status_ret)
+{
+	ccid_command_t cmd;
+	ccid_response_t resp;
+	bool okay;
+
+	if (!ccid_build_simple_packet(reader, &cmd, slot, CCID_CMD_GETSLOTSTAT))
+		return false;
+
+	if ((okay = ccid_xfer(reader, &cmd, CCID_RESP_SLOTSTAT, &resp)))
+		*status_ret = resp.ctl[0] & 0x3;
+
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
+	return okay;
+}
+
+static bool
+ccid_card_poweron(ccid_reader_t *reader, unsigned int slot, uint8_t voltage, ifd_atrbuf_t *atr)
+{
+	unsigned char ctl[3] = { 0, 0, 0 };
+	ccid_command_t cmd;
+	ccid_response_t resp;
+	buffer_t *atrbuf;
+	bool rv = false;
+
+	ctl[0] = voltage;
+
+	if (!ccid_build_command(reader, &cmd, slot, CCID_CMD_ICCPOWERON, ctl, NULL, 0))
+		return false;
+
+	if (ccid_xfer(reader, &cmd, CCID_RESP_DATA, &resp)) {
+		atrbuf = resp.payload;
+		ifd_atrbuf_set(atr, buffer_read_pointer(atrbuf), buffer_available(atrbuf));
+		rv = true;
+	}
+
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
 
 	return rv;
 
@@ -400,6 +934,37 @@ ccid_reset_card(ccid_reader_t *reader, unsigned int slot, ifd_atrbuf_t *atr)
 	return false;
 }
 
+/*
+ * Powering off the card clears its security status, so that a PIN we
+ * verified does not stay valid for whoever opens the device next. pcscd
+ * takes care of this itself when we disconnect.
+ */
+bool
+ccid_reader_poweroff(ccid_reader_t *reader, unsigned int slot)
+{
+	ccid_command_t cmd;
+	ccid_response_t resp;
+	bool okay;
+
+	if (reader->pcsc)
+		return true;
+
+	if (!ccid_build_simple_packet(reader, &cmd, slot, CCID_CMD_ICCPOWEROFF))
+		return false;
+
+	okay = ccid_xfer(reader, &cmd, CCID_RESP_SLOTSTAT, &resp);
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
+
+	if (!okay) {
+		error("Unable to power off card\n");
+		return false;
+	}
+
+	reader->icc_status = CCID_ICC_INACTIVE;
+	return true;
+}
+
 bool
 ccid_reader_select_slot(ccid_reader_t *reader, unsigned int slot)
 {
@@ -408,22 +973,38 @@ ccid_reader_select_slot(ccid_reader_t *reader, unsigned int slot)
 	if (reader->current_slot == slot)
 		return true;
 
+	if (reader->pcsc) {
+		error("pcscd readers only have a single slot\n");
+		return false;
+	}
+
 	if (!ccid_get_slot_status(reader, slot, &status)) {
 		error("Cannot get slot status\n");
 		return false;
 	}
 
-	if (status == 0) {
+	if (status == CCID_ICC_ABSENT) {
 		error("No smart card present\n");
 		return false;
 	}
 
 	debug("CCID reader reports card status 0x%x for slot %u\n", status, slot);
 	reader->current_slot = slot;
+	reader->icc_status = status;
 
 	return true;
 }
 
+/*
+ * Returns true if the card in the current slot is still powered up,
+ * ie it has not been reset or removed since someone last talked to it.
+ */
+bool
+ccid_reader_card_active(const ccid_reader_t *reader, unsigned int slot)
+{
+	return reader->current_slot == slot && reader->icc_status == CCID_ICC_ACTIVE;
+}
+
 ifd_card_t *
 ccid_reader_identify_card(ccid_reader_t *reader, unsigned int slot)
 {
@@ -435,8 +1016,17 @@ ccid_reader_identify_card(ccid_reader_t *reader, unsigned int slot)
 		return NULL;
 	}
 
-	if (!ccid_reset_card(reader, slot, &atr))
+	if (reader->pcsc) {
+		atr.len = pcsc_get_atr(reader->pcsc, atr.data, sizeof(atr.data));
+		if (atr.len == 0) {
+			error("pcscd did not report an ATR\n");
+			return NULL;
+		}
+	} else if (!ccid_reset_card(reader, slot, &atr)) {
 		return NULL;
+	}
+
+	reader->icc_status = CCID_ICC_ACTIVE;
 
 	card = ifd_create_card(&atr, reader, slot);
 	if (card == NULL) {
@@ -452,51 +1042,43 @@ ccid_reader_identify_card(ccid_reader_t *reader, unsigned int slot)
 static int
 ccid_reader_getparams(ccid_reader_t *reader, unsigned int slot, unsigned char *parambuf, unsigned int size)
 {
-	ccid_command_t *cmd = NULL;
-	ccid_response_t *resp = NULL;
+	ccid_command_t cmd;
+	ccid_response_t resp;
 	unsigned int len;
 	int result = -1;
 
-	cmd = ccid_build_simple_packet(reader, slot, CCID_CMD_GETPARAMS);
+	if (!ccid_build_simple_packet(reader, &cmd, slot, CCID_CMD_GETPARAMS))
+		return -1;
 
-	resp = ccid_xfer(reader, cmd, CCID_RESP_PARAMS);
-	if (resp == NULL)
+	if (!ccid_xfer(reader, &cmd, CCID_RESP_PARAMS, &resp))
 		goto done;
 
-	len = buffer_available(resp->payload);
+	len = buffer_available(resp.payload);
 	if (len > size)
 		len = size;
-	if (buffer_get(resp->payload, parambuf, len))
+	if (buffer_get(resp.payload, parambuf, len))
 		result = len;
 done:
-	if (cmd)
-		ccid_command_free(cmd);
-	if (resp)
-		ccid_response_free(resp);
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
 	return result;
 }
 
 static bool
 ccid_reader_setparams(ccid_reader_t *reader, unsigned int slot, unsigned int t, const unsigned char *parambuf, unsigned int len)
 {
-	ccid_command_t *cmd = NULL;
-	ccid_response_t *resp = NULL;
+	ccid_command_t cmd;
+	ccid_response_t resp;
 	unsigned char ctl[3] = { t, 0, 0 };
-	bool okay = false;
-
-	cmd = ccid_build_command(reader, slot, CCID_CMD_GETPARAMS, ctl, parambuf, len);
+	bool okay;
 
-	resp = ccid_xfer(reader, cmd, CCID_RESP_PARAMS);
-	if (resp == NULL)
-		goto done;
+	if (!ccid_build_command(reader, &cmd, slot, CCID_CMD_GETPARAMS, ctl, parambuf, len))
+		return false;
 
-	okay = true;
+	okay = ccid_xfer(reader, &cmd, CCID_RESP_PARAMS, &resp);
 
-done:
-	if (cmd)
-		ccid_command_free(cmd);
-	if (resp)
-		ccid_response_free(resp);
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
 	return okay;
 }
 
@@ -521,34 +1103,490 @@ ccid_reader_select_protocol(ccid_reader_t *reader, unsigned int slot, unsigned i
 }
 #endif
 
+static bool
+ccid_build_apdu_command(ccid_reader_t *reader, ccid_command_t *cmd, unsigned int slot, buffer_t *apdu)
+{
+	int ins = -1;
+	bool okay;
+
+	if (buffer_available(apdu) >= 2)
+		ins = ((const unsigned char *) buffer_read_pointer(apdu))[1];
+
+	/* If the caller left room for the CCID header, avoid copying the APDU */
+	if (buffer_headroom(apdu) >= CCID_HDR_SIZE)
+		okay = ccid_build_command_inplace(reader, cmd, slot, CCID_CMD_XFRBLOCK, NULL, apdu);
+	else
+		okay = ccid_build_command(reader, cmd, slot, CCID_CMD_XFRBLOCK, NULL,
+				buffer_read_pointer(apdu),
+				buffer_available(apdu));
+	if (!okay)
+		return false;
+
+	cmd->ins = ins;
+	return true;
+}
+
+static buffer_t *
+ccid_reader_pcsc_xfer(ccid_reader_t *reader, buffer_t *apdu)
+{
+	buffer_t *rapdu;
+
+	if (ccid_reader_deadline_expired(reader)) {
+		error("Deadline expired, not sending APDU\n");
+		return NULL;
+	}
+
+	rapdu = buffer_pool_acquire(reader->pool, reader->max_message_size);
+	if (!pcsc_transmit(reader->pcsc, apdu, rapdu)) {
+		buffer_free(rapdu);
+		return NULL;
+	}
+
+	return rapdu;
+}
+
 buffer_t *
 ccid_reader_apdu_xfer(ccid_reader_t *reader, unsigned int slot, buffer_t *apdu)
 {
-	ccid_command_t *cmd = NULL;
-	ccid_response_t *resp = NULL;
+	ccid_command_t cmd;
+	ccid_response_t resp;
 	buffer_t *rapdu = NULL;
 
-	cmd = ccid_build_command(reader, slot, CCID_CMD_XFRBLOCK, NULL,
-			buffer_read_pointer(apdu),
-			buffer_available(apdu));
-	if (cmd == NULL)
-		goto done;
+	if (reader->pcsc)
+		return ccid_reader_pcsc_xfer(reader, apdu);
 
-	resp = ccid_xfer(reader, cmd, CCID_RESP_DATA);
-	if (resp == NULL)
-		goto done;
+	if (!ccid_build_apdu_command(reader, &cmd, slot, apdu))
+		return NULL;
 
-	rapdu = resp->payload;
-	resp->payload = NULL;
+	if (ccid_xfer(reader, &cmd, CCID_RESP_DATA, &resp)) {
+		rapdu = resp.payload;
+		resp.payload = NULL;
+	}
 
-done:
-	if (cmd)
-		ccid_command_free(cmd);
-	if (resp)
-		ccid_response_free(resp);
+	ccid_command_destroy(&cmd);
+	ccid_response_destroy(&resp);
 	return rapdu;
 }
 
+/*
+ * Non-blocking interface. The command is sent and its response received
+ * using asynchronous URBs, and ccid_reader_complete() picks up whatever
+ * the kernel has for us, applying the same rules as ccid_xfer(): stale
+ * packets are skipped, and the card may ask for more time.
+ */
+int
+ccid_reader_get_fd(const ccid_reader_t *reader)
+{
+	if (reader->dev == NULL)
+		return -1;
+	return uusb_dev_get_fd(reader->dev);
+}
+
+/*
+ * Returns the number of milliseconds until the command in flight times
+ * out, or -1 if there is none.
+ */
+long
+ccid_reader_get_timeout(const ccid_reader_t *reader)
+{
+	const ccid_async_t *as = &reader->async;
+	uint64_t now;
+
+	if (!as->busy)
+		return -1;
+
+	if ((now = monotonic_time_ms()) >= as->expires)
+		return 0;
+	return as->expires - now;
+}
+
+static void
+ccid_async_reset(ccid_reader_t *reader)
+{
+	ccid_async_t *as = &reader->async;
+
+	if (as->send_urb)
+		uusb_discard(reader->dev, as->send_urb);
+	if (as->recv_urb)
+		uusb_discard(reader->dev, as->recv_urb);
+
+	if (as->rbuf) {
+		buffer_free(as->rbuf);
+		as->rbuf = NULL;
+	}
+	if (as->result) {
+		buffer_free(as->result);
+		as->result = NULL;
+	}
+
+	ccid_command_destroy(&as->cmd);
+	as->busy = false;
+}
+
+/*
+ * Give up on the command in flight. If the reader may still be working on
+ * it, we have to abort it, which is done synchronously.
+ */
+void
+ccid_reader_cancel(ccid_reader_t *reader)
+{
+	ccid_async_t *as = &reader->async;
+	bool need_abort;
+	uint8_t slot;
+
+	if (!as->busy)
+		return;
+
+	need_abort = (as->result == NULL);
+	slot = as->cmd.slot;
+
+	ccid_async_reset(reader);
+	if (need_abort)
+		ccid_abort(reader, slot);
+}
+
+/*
+ * Like ccid_reader_cancel, but do not wait for the reader to confirm the
+ * abort. Whoever uses the reader next will find the confirmation in the
+ * pipe, and drain it when resyncing.
+ */
+void
+ccid_reader_cancel_nowait(ccid_reader_t *reader)
+{
+	ccid_async_t *as = &reader->async;
+	ccid_command_t cmd;
+	bool need_abort;
+	uint8_t slot;
+
+	if (!as->busy)
+		return;
+
+	need_abort = (as->result == NULL);
+	slot = as->cmd.slot;
+
+	ccid_async_reset(reader);
+	if (need_abort && ccid_abort_start(reader, slot, &cmd))
+		ccid_command_destroy(&cmd);
+}
+
+static bool
+ccid_async_recv(ccid_reader_t *reader)
+{
+	ccid_async_t *as = &reader->async;
+
+	as->rbuf = buffer_pool_acquire(reader->pool, reader->max_message_size);
+	if (!uusb_submit_recv(reader->dev, as->recv_urb, as->rbuf)) {
+		buffer_free(as->rbuf);
+		as->rbuf = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Send the command that has been built in reader->async.cmd. Whatever
+ * happens, the command is consumed.
+ */
+static bool
+ccid_async_submit(ccid_reader_t *reader, uint8_t expected_resp_type)
+{
+	ccid_async_t *as = &reader->async;
+	ccid_command_t *cmd = &as->cmd;
+	long timeout;
+
+	if (as->send_urb == NULL) {
+		as->send_urb = uusb_urb_alloc();
+		as->recv_urb = uusb_urb_alloc();
+	}
+
+	as->expected = expected_resp_type;
+	as->stat = ccid_latency_get_stat(&reader->latency, cmd->type, cmd->ins);
+	as->base_timeout = as->wait = ccid_command_timeout(reader, cmd, as->stat);
+	as->retries = CCID_MAX_RETRIES;
+	as->extensions = 0;
+	as->extended = false;
+
+	timeout = deadline_cap_timeout(reader->deadline, as->wait);
+	if (timeout == 0) {
+		error("Deadline expired, not sending CCID command\n");
+		goto failed;
+	}
+
+	debug("Submitting CCID packet (slot=%u seq=%u timeout=%ld)\n", cmd->slot, cmd->seq, timeout);
+	if (opt_debug > 1) {
+		buffer_t *pkt = cmd->pkt;
+
+		hexdump(buffer_read_pointer(pkt), buffer_available(pkt), debug2, 4);
+	}
+
+	as->start = monotonic_time_ms();
+	as->expires = as->start + timeout;
+
+	if (!ccid_async_recv(reader))
+		goto failed;
+
+	if (!uusb_submit_send(reader->dev, as->send_urb, cmd->pkt)) {
+		uusb_discard(reader->dev, as->recv_urb);
+		goto failed;
+	}
+
+	reader->ccid_seq = cmd->seq + 1;
+	as->busy = true;
+	return true;
+
+failed:
+	ccid_async_reset(reader);
+	return false;
+}
+
+static bool
+ccid_async_check_idle(const ccid_reader_t *reader)
+{
+	if (reader->pcsc) {
+		error("Non-blocking operation is not supported through pcscd\n");
+		return false;
+	}
+	if (reader->async.busy) {
+		error("CCID reader is busy with another command\n");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * The non-blocking counterpart of ccid_reader_resync(). Rather than draining
+ * the pipe first, we send a GETSLOTSTAT probe and skip whatever stale
+ * responses arrive ahead of the one that matches. If the caller tries
+ * again after a failed probe, we clear the endpoint halt first.
+ *
+ * Unlike ccid_reader_resync(), this never resets the device, which would
+ * block for a long time.
+ */
+bool
+ccid_reader_submit_resync(ccid_reader_t *reader, unsigned int attempt)
+{
+	if (!ccid_async_check_idle(reader))
+		return false;
+
+	if (attempt > 0) {
+		debug("CCID reader does not respond, clearing endpoint halt\n");
+		uusb_clear_halt(reader->dev);
+	}
+
+	if (!ccid_build_simple_packet(reader, &reader->async.cmd, 0, CCID_CMD_GETSLOTSTAT))
+		return false;
+
+	reader->async.cmd.timeout = ccid_probe_timeout(reader);
+	if (!ccid_async_submit(reader, CCID_RESP_SLOTSTAT))
+		return false;
+
+	reader->async.retries = CCID_DRAIN_MAX;
+	return true;
+}
+
+bool
+ccid_reader_submit_slot_status(ccid_reader_t *reader, unsigned int slot)
+{
+	if (!ccid_async_check_idle(reader)
+	 || !ccid_build_simple_packet(reader, &reader->async.cmd, slot, CCID_CMD_GETSLOTSTAT))
+		return false;
+
+	return ccid_async_submit(reader, CCID_RESP_SLOTSTAT);
+}
+
+/*
+ * Unlike ccid_reset_card(), this does not try one voltage after the other,
+ * but uses automatic voltage selection or the lowest supported voltage.
+ */
+bool
+ccid_reader_submit_poweron(ccid_reader_t *reader, unsigned int slot)
+{
+	unsigned char ctl[3] = { 0, 0, 0 };
+	unsigned int i;
+
+	if (!reader->auto_voltage) {
+		for (i = 0; i < 3 && !(reader->supported_voltages & (1 << i)); ++i)
+			;
+		if (i < 3)
+			ctl[0] = i + 1;
+	}
+
+	if (!ccid_async_check_idle(reader)
+	 || !ccid_build_command(reader, &reader->async.cmd, slot, CCID_CMD_ICCPOWERON, ctl, NULL, 0))
+		return false;
+
+	return ccid_async_submit(reader, CCID_RESP_DATA);
+}
+
+/*
+ * The APDU is borrowed until the command has completed or was cancelled.
+ */
+bool
+ccid_reader_submit_apdu(ccid_reader_t *reader, unsigned int slot, buffer_t *apdu)
+{
+	if (!ccid_async_check_idle(reader)
+	 || !ccid_build_apdu_command(reader, &reader->async.cmd, slot, apdu))
+		return false;
+
+	return ccid_async_submit(reader, CCID_RESP_DATA);
+}
+
+/*
+ * Process the packet received by the recv URB. Returns false if the
+ * command failed; otherwise, either the result has been stored, or
+ * we're waiting for another packet.
+ */
+static bool
+ccid_async_response(ccid_reader_t *reader)
+{
+	ccid_async_t *as = &reader->async;
+	ccid_response_t resp;
+	buffer_t *rbuf;
+	long timeout;
+
+	rbuf = as->rbuf;
+	as->rbuf = NULL;
+
+	if (uusb_urb_status(as->recv_urb) != 0) {
+		error("Failed to receive CCID response (status %d)\n", uusb_urb_status(as->recv_urb));
+		buffer_free(rbuf);
+		return false;
+	}
+
+	if (opt_debug > 1)
+		ccid_dump_response(rbuf);
+
+	switch (ccid_response_check(&as->cmd, as->expected, &resp, rbuf)) {
+	case CCID_CHECK_COMPLETE:
+		as->icc_status = resp.ctl[0] & 0x3;
+		as->result = resp.payload;
+		return true;
+
+	case CCID_CHECK_ERROR:
+		ccid_response_destroy(&resp);
+		return false;
+
+	case CCID_CHECK_MORE_TIME:
+		if (!ccid_grant_time_extension(&resp, as->base_timeout, &as->extensions, &as->wait)) {
+			ccid_response_destroy(&resp);
+			return false;
+		}
+
+		/* If this exceeds the deadline, we'll notice in ccid_reader_complete */
+		timeout = deadline_cap_timeout(reader->deadline, as->wait);
+		as->expires = monotonic_time_ms() + timeout;
+		break;
+
+	default:
+		if (as->retries-- == 0) {
+			error("%s: too many retries\n", __func__);
+			ccid_response_destroy(&resp);
+			return false;
+		}
+		break;
+	}
+
+	ccid_response_destroy(&resp);
+	return ccid_async_recv(reader);
+}
+
+/*
+ * Pick up the result of the command in flight, without blocking. When
+ * the command is done, the payload of the reader's response is returned
+ * in *payload_ret. If the command failed or timed out, it has been
+ * cancelled already when we return, without waiting for the reader to
+ * confirm the abort.
+ */
+xfer_status_t
+ccid_reader_complete(ccid_reader_t *reader, buffer_t **payload_ret)
+{
+	ccid_async_t *as = &reader->async;
+	uusb_urb_t *urb;
+
+	if (!as->busy) {
+		error("%s: no CCID command in flight\n", __func__);
+		return XFER_FAILED;
+	}
+
+	while (true) {
+		if (!uusb_reap(reader->dev, &urb))
+			goto failed;
+
+		if (urb == NULL)
+			break;
+
+		if (urb == as->send_urb && uusb_urb_status(urb) != 0) {
+			error("Failed to send CCID command (status %d)\n", uusb_urb_status(urb));
+			goto failed;
+		}
+
+		if (urb == as->recv_urb && !ccid_async_response(reader))
+			goto failed;
+	}
+
+	/* Wait for the send URB, too, before we let go of the command */
+	if (as->result && !uusb_urb_busy(as->send_urb)) {
+		ccid_latency_record(&reader->latency, as->stat, monotonic_time_ms() - as->start);
+
+		if (as->cmd.type == CCID_CMD_GETSLOTSTAT) {
+			if (as->icc_status == CCID_ICC_ABSENT) {
+				error("No smart card present\n");
+				goto failed;
+			}
+
+			debug("CCID reader reports card status 0x%x for slot %u\n", as->icc_status, as->cmd.slot);
+			reader->current_slot = as->cmd.slot;
+			reader->icc_status = as->icc_status;
+		} else if (as->cmd.type == CCID_CMD_ICCPOWERON) {
+			reader->icc_status = CCID_ICC_ACTIVE;
+		}
+
+		*payload_ret = as->result;
+		as->result = NULL;
+		ccid_async_reset(reader);
+		return XFER_DONE;
+	}
+
+	if (as->result == NULL && monotonic_time_ms() >= as->expires) {
+		if (ccid_extend_learned_timeout(reader, &as->cmd, as->stat, as->start, &as->extended, &as->wait)) {
+			long timeout = deadline_cap_timeout(reader->deadline, as->wait);
+
+			if (timeout != 0) {
+				as->expires = monotonic_time_ms() + timeout;
+				return XFER_PENDING;
+			}
+		}
+
+		/* Do not block the caller's event loop waiting for the abort
+		 * to be confirmed. The next resync drains the confirmation. */
+		error("Timed out waiting for CCID response\n");
+		ccid_reader_cancel_nowait(reader);
+		return XFER_FAILED;
+	}
+
+	return XFER_PENDING;
+
+failed:
+	ccid_async_reset(reader);
+	return XFER_FAILED;
+}
+
+/*
+ * Get a buffer from the reader's pool. Upper layers should use this for
+ * APDUs, so that a steady-state exchange does not need to allocate memory.
+ * The buffer comes with headroom for the CCID header.
+ */
+buffer_t *
+ccid_reader_alloc_buffer(ccid_reader_t *reader, size_t size)
+{
+	buffer_t *bp;
+
+	bp = buffer_pool_acquire(reader->pool, CCID_HDR_SIZE + size);
+	buffer_reserve_headroom(bp, CCID_HDR_SIZE);
+	return bp;
+}
+
 bool
 ccid_reader_set_features(ccid_reader_t *reader, const ccid_descriptor_t *ccid)
 {
@@ -0,0 +1,268 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * Session cache. When we're done talking to a card, we record what we know
+ * about it in a small file below /run. If we're invoked again before the
+ * card was unplugged or reset, we can skip power-on and application
+ * selection.
+ *
+ * Sessions are keyed by the dev_t of the USB device, which changes whenever
+ * the device is re-enumerated, plus the USB serial number if there is one.
+ */
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "scard.h"
+#include "util.h"
+
+typedef struct ifd_session {
+	char *			devnum;
+	char *			serial;
+	unsigned int		slot;
+	ifd_atrbuf_t		atr;
+	char *			driver;
+	int			variant;
+	unsigned int		aid_len;
+	unsigned char		aid[IFD_MAX_AID_LEN];
+} ifd_session_t;
+
+static void
+ifd_session_path(const char *dirname, uusb_dev_t *dev, char *path, size_t size)
+{
+	dev_t devnum = uusb_dev_get_devnum(dev);
+
+	snprintf(path, size, "%s/%u-%u", dirname, major(devnum), minor(devnum));
+}
+
+static char *
+ifd_session_devnum_string(uusb_dev_t *dev)
+{
+	dev_t devnum = uusb_dev_get_devnum(dev);
+	char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "%u:%u", major(devnum), minor(devnum));
+	return strdup(buffer);
+}
+
+static void
+ifd_session_destroy(ifd_session_t *sess)
+{
+	drop_string(&sess->devnum);
+	drop_string(&sess->serial);
+	drop_string(&sess->driver);
+}
+
+static bool
+ifd_session_parse_line(ifd_session_t *sess, char *line)
+{
+	char *key, *value;
+
+	line[strcspn(line, "\r\n")] = '\0';
+
+	key = line;
+	if ((value = strchr(line, ' ')) == NULL)
+		return false;
+	*value++ = '\0';
+
+	if (!strcmp(key, "dev")) {
+		assign_string(&sess->devnum, value);
+	} else if (!strcmp(key, "serial")) {
+		assign_string(&sess->serial, value);
+	} else if (!strcmp(key, "slot")) {
+		sess->slot = strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "atr")) {
+		sess->atr.len = parse_octet_string(value, sess->atr.data, sizeof(sess->atr.data));
+		if (sess->atr.len == 0)
+			return false;
+	} else if (!strcmp(key, "driver")) {
+		assign_string(&sess->driver, value);
+	} else if (!strcmp(key, "variant")) {
+		sess->variant = strtol(value, NULL, 10);
+	} else if (!strcmp(key, "application")) {
+		sess->aid_len = parse_octet_string(value, sess->aid, sizeof(sess->aid));
+		if (sess->aid_len == 0)
+			return false;
+	} else {
+		/* ignore unknown keys */
+	}
+
+	return true;
+}
+
+static bool
+ifd_session_load(const char *path, ifd_session_t *sess)
+{
+	char linebuf[512];
+	bool okay = true;
+	FILE *fp;
+
+	memset(sess, 0, sizeof(*sess));
+	if ((fp = fopen(path, "r")) == NULL)
+		return false;
+
+	while (okay && fgets(linebuf, sizeof(linebuf), fp) != NULL)
+		okay = ifd_session_parse_line(sess, linebuf);
+
+	fclose(fp);
+
+	if (!okay || !sess->devnum || !sess->driver || !sess->atr.len) {
+		debug("%s: bad session cache file\n", path);
+		ifd_session_destroy(sess);
+		return false;
+	}
+
+	return true;
+}
+
+static void
+ifd_session_write_octets(FILE *fp, const char *key, const unsigned char *data, unsigned int len)
+{
+	unsigned int i;
+
+	fprintf(fp, "%s ", key);
+	for (i = 0; i < len; ++i)
+		fprintf(fp, "%02x", data[i]);
+	fprintf(fp, "\n");
+}
+
+bool
+ifd_session_save(const char *dirname, uusb_dev_t *dev, const ifd_card_t *card)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX + 8];
+	const char *serial;
+	char *devnum;
+	FILE *fp;
+	int fd;
+
+	if (mkdir(dirname, 0700) < 0 && errno != EEXIST) {
+		debug("Cannot create %s: %m\n", dirname);
+		return false;
+	}
+
+	ifd_session_path(dirname, dev, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+	if ((fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0
+	 || (fp = fdopen(fd, "w")) == NULL) {
+		debug("Cannot write session cache %s: %m\n", tmppath);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	devnum = ifd_session_devnum_string(dev);
+	fprintf(fp, "dev %s\n", devnum);
+	free(devnum);
+
+	if ((serial = uusb_dev_get_serial(dev)) != NULL)
+		fprintf(fp, "serial %s\n", serial);
+	fprintf(fp, "slot %u\n", card->slot);
+	ifd_session_write_octets(fp, "atr", card->atr.data, card->atr.len);
+	fprintf(fp, "driver %s\n", card->name);
+	fprintf(fp, "variant %u\n", card->variant);
+	if (card->aid.len)
+		ifd_session_write_octets(fp, "application", card->aid.data, card->aid.len);
+
+	if (fclose(fp) != 0 || rename(tmppath, path) < 0) {
+		debug("Cannot update session cache %s: %m\n", path);
+		unlink(tmppath);
+		return false;
+	}
+
+	debug("Saved card session to %s\n", path);
+	return true;
+}
+
+void
+ifd_session_forget(const char *dirname, uusb_dev_t *dev)
+{
+	char path[PATH_MAX];
+
+	ifd_session_path(dirname, dev, path, sizeof(path));
+	if (unlink(path) == 0)
+		debug("Removed session cache %s\n", path);
+}
+
+/*
+ * Returns a card object for the cached session, if there is one and the
+ * card still seems to be in the state we left it in. The caller still has
+ * to connect to the card, which will invoke the driver's resume function.
+ */
+ifd_card_t *
+ifd_session_restore(const char *dirname, uusb_dev_t *dev, ccid_reader_t *reader, unsigned int slot)
+{
+	char path[PATH_MAX];
+	const char *serial;
+	ifd_session_t sess;
+	ifd_card_t *card = NULL;
+	char *devnum;
+
+	ifd_session_path(dirname, dev, path, sizeof(path));
+	if (!ifd_session_load(path, &sess))
+		return NULL;
+
+	devnum = ifd_session_devnum_string(dev);
+	serial = uusb_dev_get_serial(dev);
+
+	if (strcmp(sess.devnum, devnum)
+	 || (sess.serial == NULL) != (serial == NULL)
+	 || (serial && strcmp(sess.serial, serial))
+	 || sess.slot != slot) {
+		debug("Session cache %s refers to a different device\n", path);
+		goto out;
+	}
+
+	/* The card must not have been powered down or replaced since */
+	if (!ccid_reader_card_active(reader, slot)) {
+		debug("Card is no longer active, cannot resume session\n");
+		goto out;
+	}
+
+	card = ifd_create_card(&sess.atr, reader, slot);
+	if (card == NULL)
+		goto out;
+
+	if (strcmp(card->name, sess.driver) || card->variant != sess.variant) {
+		debug("Session cache %s refers to a different driver\n", path);
+		ifd_card_free(card);
+		card = NULL;
+		goto out;
+	}
+
+	ifd_card_set_application(card, sess.aid, sess.aid_len);
+	card->resumed = true;
+	infomsg("Resuming session with %s device\n", card->name);
+
+out:
+	if (card == NULL)
+		unlink(path);
+	free(devnum);
+	ifd_session_destroy(&sess);
+	return card;
+}
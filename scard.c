@@ -29,14 +29,6 @@
 /* Is this card specific or generic? */
 #define IFD_INS_GET_RESPONSE_APDU	0xc0
 
-typedef struct ifd_card_driver_registration {
-	struct ifd_card_driver_registration *next;
-	const ifd_atrbuf_t *	atr;
-	const char *		name;
-	ifd_card_driver_t *	driver;
-	int			variant;
-} ifd_card_driver_registration_t;
-
 typedef struct apdu {
 	uint8_t		cla;
 	uint8_t		ins;
@@ -46,7 +38,14 @@ typedef struct apdu {
 	uint8_t		data[0xff];
 } APDU;
 
-static ifd_card_driver_registration_t *ifd_card_drivers, **ifd_card_drivers_tail = &ifd_card_drivers;
+/*
+ * The driver registry is a constant table, so there's nothing to lock
+ * when several threads identify cards concurrently.
+ */
+static const ifd_card_driver_registration_t *const ifd_card_drivers[] = {
+	yubikey_drivers,
+	NULL
+};
 
 void
 ifd_atrbuf_set(ifd_atrbuf_t *atr, const void *data, size_t len)
@@ -58,15 +57,14 @@ ifd_atrbuf_set(ifd_atrbuf_t *atr, const void *data, size_t len)
 }
 
 static const char *
-ifd_atrbuf_to_string(const ifd_atrbuf_t *atr)
+ifd_atrbuf_to_string(const ifd_atrbuf_t *atr, char *namebuf, size_t size)
 {
-	static char namebuf[3 * IFD_MAX_ATR_LEN + 1];
 	unsigned int i, j;
 
-	if (atr->len > IFD_MAX_ATR_LEN)
+	if (atr->len > IFD_MAX_ATR_LEN || size < IFD_ATR_STRING_LEN)
 		return NULL;
 
-	memset(namebuf, 0, sizeof(namebuf));
+	memset(namebuf, 0, size);
 	for (i = j = 0; i < atr->len; ++i) {
 		if (j)
 			namebuf[j++] = ':';
@@ -83,21 +81,6 @@ ifd_atrbuf_equal(const ifd_atrbuf_t *atr1, const ifd_atrbuf_t *atr2)
 	return atr1->len == atr2->len && !memcmp(atr1->data, atr2->data, atr1->len);
 }
 
-void
-ifd_register_card_driver(const ifd_atrbuf_t *atr, const char *name, ifd_card_driver_t *driver, int variant)
-{
-	ifd_card_driver_registration_t *reg;
-
-	reg = calloc(1, sizeof(*reg));
-	reg->atr = atr;
-	reg->name = name;
-	reg->driver = driver;
-	reg->variant = variant;
-
-	*ifd_card_drivers_tail = reg;
-	ifd_card_drivers_tail = &reg->next;
-}
-
 static ifd_card_t *
 ifd_card_alloc(const ifd_atrbuf_t *atr, const char *name, const ifd_card_driver_t *driver, int variant)
 {
@@ -118,21 +101,52 @@ ifd_card_alloc(const ifd_atrbuf_t *atr, const char *name, const ifd_card_driver_
 ifd_card_t *
 ifd_create_card(const ifd_atrbuf_t *atr, ccid_reader_t *reader, unsigned int slot)
 {
-	ifd_card_driver_registration_t *reg;
-	ifd_card_t *card = NULL;
-
-	debug2("Trying to identify card; atr %s\n", ifd_atrbuf_to_string(atr));
-	for (reg = ifd_card_drivers; reg; reg = reg->next) {
-		debug("Checking %s; atr %s\n", reg->name, ifd_atrbuf_to_string(reg->atr));
-		if (ifd_atrbuf_equal(atr, reg->atr)) {
-			card = ifd_card_alloc(atr, reg->name, reg->driver, reg->variant);
-			card->reader = reader;
-			card->slot = slot;
-			break;
+	const ifd_card_driver_registration_t *const *table, *reg;
+	char atrbuf[IFD_ATR_STRING_LEN];
+	ifd_card_t *card;
+
+	debug2("Trying to identify card; atr %s\n", ifd_atrbuf_to_string(atr, atrbuf, sizeof(atrbuf)));
+	for (table = ifd_card_drivers; *table; ++table) {
+		for (reg = *table; reg->name; ++reg) {
+			debug("Checking %s; atr %s\n", reg->name, ifd_atrbuf_to_string(reg->atr, atrbuf, sizeof(atrbuf)));
+			if (ifd_atrbuf_equal(atr, reg->atr)) {
+				card = ifd_card_alloc(atr, reg->name, reg->driver, reg->variant);
+				card->reader = reader;
+				card->slot = slot;
+				return card;
+			}
 		}
 	}
 
-	return card;
+	return NULL;
+}
+
+/*
+ * The card does not own the reader it was created on.
+ */
+void
+ifd_card_free(ifd_card_t *card)
+{
+	if (card->xact) {
+		ifd_card_cancel(card);
+		free(card->xact);
+	}
+	free(card);
+}
+
+/*
+ * The deadline is owned by the reader. We check it before calling into
+ * the card driver, so that we fail with a clear message rather than
+ * some communication error deep down in the driver.
+ */
+static bool
+ifd_card_deadline_expired(const ifd_card_t *card)
+{
+	if (!ccid_reader_deadline_expired(card->reader))
+		return false;
+
+	error("Deadline expired\n");
+	return true;
 }
 
 bool
@@ -161,9 +175,29 @@ ifd_card_set_option(ifd_card_t *card, const char *option)
 	return true;
 }
 
+void
+ifd_card_set_application(ifd_card_t *card, const void *aid, size_t len)
+{
+	if (len > sizeof(card->aid.data))
+		len = 0;
+	memcpy(card->aid.data, aid, len);
+	card->aid.len = len;
+}
+
 bool
 ifd_card_connect(ifd_card_t *card)
 {
+	if (ifd_card_deadline_expired(card))
+		return false;
+
+	if (card->resumed) {
+		if (card->driver->resume == NULL)
+			return false;
+
+		debug("Resuming card session\n");
+		return card->driver->resume(card);
+	}
+
 	if (card->driver->connect == NULL)
 		return true;
 
@@ -179,6 +213,9 @@ ifd_card_verify(ifd_card_t *card, const char *pin, size_t pin_len, unsigned int
 		return false;
 	}
 
+	if (ifd_card_deadline_expired(card))
+		return false;
+
 	debug("Verifying PIN\n");
 	return card->driver->verify(card, pin, pin_len, tries_left);
 }
@@ -191,51 +228,105 @@ ifd_card_decipher(ifd_card_t *card, buffer_t *ciphertext)
 		return false;
 	}
 
+	if (ifd_card_deadline_expired(card))
+		return NULL;
+
 	debug("Decrypting %u bytes of ciphertext\n", buffer_available(ciphertext));
 	return card->driver->decipher(card, ciphertext);
 }
 
+buffer_t *
+ifd_card_sign(ifd_card_t *card, buffer_t *data, unsigned int key_len)
+{
+	if (card->driver->sign == NULL) {
+		debug("Driver does not support signing\n");
+		return NULL;
+	}
+
+	if (ifd_card_deadline_expired(card))
+		return NULL;
+
+	debug("Signing %u bytes of data\n", buffer_available(data));
+	return card->driver->sign(card, data, key_len);
+}
+
+buffer_t *
+ifd_card_read_certificate(ifd_card_t *card, unsigned int key_ref)
+{
+	if (card->driver->read_certificate == NULL) {
+		debug("Driver does not support reading certificates\n");
+		return NULL;
+	}
+
+	if (ifd_card_deadline_expired(card))
+		return NULL;
+
+	return card->driver->read_certificate(card, key_ref);
+}
+
+/*
+ * Strip the status word off the response APDU. On failure, the
+ * response is freed.
+ */
+static bool
+ifd_rapdu_get_status(buffer_t *rapdu, uint16_t *sw_ret)
+{
+	unsigned char sw[2];
+
+	if (!buffer_get_tail(rapdu, sw, 2)) {
+		error("Response APDU too short\n");
+		buffer_free(rapdu);
+		return false;
+	}
+
+	*sw_ret = (sw[0] << 8) | sw[1];
+	debug("Received response APDU, sw=%04x\n", *sw_ret);
+	return true;
+}
+
 static buffer_t *
 ifd_card_apdu(ifd_card_t *card, buffer_t *apdu, uint16_t *sw_ret)
 {
-	ccid_reader_t *reader = card->reader;
-	unsigned int slot = card->slot;
-	unsigned int rlen;
 	buffer_t *rapdu;
 
-	if (!(rapdu = ccid_reader_apdu_xfer(reader, slot, apdu)))
+	if (!(rapdu = ccid_reader_apdu_xfer(card->reader, card->slot, apdu)))
 		return NULL;
 
-	if ((rlen = buffer_available(rapdu)) < 2) {
-		error("Response APDU too short\n");
+	if (!ifd_rapdu_get_status(rapdu, sw_ret))
 		return NULL;
-	} else {
-		const unsigned char *swpos = buffer_write_pointer(rapdu) - 2;
-
-		*sw_ret = (swpos[0] << 8) | swpos[1];
-		rapdu->wpos -= 2;
-		debug("Received response APDU, sw=%04x\n", *sw_ret);
-	}
 
 	return rapdu;
 }
 
+/*
+ * Send an APDU and collect the complete response. If the card has more
+ * data for us than fits into one response, the chunks returned by
+ * GET RESPONSE are linked to the first buffer, so the result may be
+ * a buffer chain.
+ */
 buffer_t *
 ifd_card_xfer(ifd_card_t *card, buffer_t *apdu, uint16_t *sw_ret)
 {
 	buffer_t *rapdu;
+	size_t total;
 
 	if (!(rapdu = ifd_card_apdu(card, apdu, sw_ret)))
 		return NULL;
 
+	total = buffer_available(rapdu);
+
 	while ((*sw_ret & 0xFF00) == 0x6100) {
 		uint8_t lc = *sw_ret & 0xFF;
 		unsigned int len;
 		buffer_t *apdu2, *rapdu2;
 
+		if (ifd_card_deadline_expired(card))
+			goto failed;
+
 		len = lc?: 0x100;
 		debug2("Card signals %u additional response bytes\n", len);
-		apdu2 = ifd_build_apdu(0, IFD_INS_GET_RESPONSE_APDU, 0, 0, NULL, lc);
+		if (!(apdu2 = ifd_build_apdu(card, 0, IFD_INS_GET_RESPONSE_APDU, 0, 0, NULL, lc)))
+			goto failed;
 
 		rapdu2 = ifd_card_apdu(card, apdu2, sw_ret);
 		buffer_free(apdu2);
@@ -250,14 +341,72 @@ ifd_card_xfer(ifd_card_t *card, buffer_t *apdu, uint16_t *sw_ret)
 			goto failed;
 		}
 
-		if (!buffer_put(rapdu, buffer_read_pointer(rapdu2), buffer_available(rapdu2))) {
-			error("Response buffer too small\n");
+		total += len;
+		if (total > IFD_MAX_RESPONSE_SIZE) {
+			error("Card response exceeds %u bytes, giving up\n", IFD_MAX_RESPONSE_SIZE);
 			buffer_free(rapdu2);
 			goto failed;
 		}
-		buffer_free(rapdu2);
+
+		/* Link the chunk rather than copying it */
+		buffer_chain_append(rapdu, rapdu2);
+	}
+
+	return rapdu;
+
+failed:
+	if (rapdu)
+		buffer_free(rapdu);
+	return NULL;
+}
+
+/*
+ * Frame the next chunk of the request's data as an APDU. If there's more
+ * data than fits into a short APDU, we use command chaining.
+ */
+static bool
+ifd_request_frame_chunk(ifd_request_t *req, buffer_t *apdu, unsigned int *len_ret)
+{
+	unsigned int len = buffer_available(req->data);
+	uint8_t cla = req->cla;
+
+	if (len > 0xFF) {
+		len = 0xFF;
+		cla |= 0x10;
 	}
 
+	*len_ret = len;
+	return ifd_frame_apdu(apdu, req->data, len, cla, req->ins, req->p1, req->p2);
+}
+
+/*
+ * Send a request and collect the complete response. The request's data
+ * is consumed, but the caller still has to destroy the request.
+ * If the card rejects a chunk in the middle of a chained command, the
+ * response to that chunk is returned.
+ */
+buffer_t *
+ifd_card_transact(ifd_card_t *card, ifd_request_t *req, uint16_t *sw_ret)
+{
+	buffer_t *rapdu = NULL;
+
+	do {
+		unsigned int len;
+		buffer_t apdu;
+
+		if (!ifd_request_frame_chunk(req, &apdu, &len))
+			goto failed;
+
+		/* Only the response to the last command in the chain matters */
+		if (rapdu)
+			buffer_free(rapdu);
+
+		if (!(rapdu = ifd_card_xfer(card, &apdu, sw_ret)))
+			return NULL;
+
+		buffer_skip(req->data, len);
+	} while (buffer_available(req->data) && *sw_ret == 0x9000);
+
 	return rapdu;
 
 failed:
@@ -266,8 +415,230 @@ failed:
 	return NULL;
 }
 
+/*
+ * The request takes ownership of the data buffer.
+ */
+void
+ifd_request_init(ifd_request_t *req, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, buffer_t *data)
+{
+	req->cla = cla;
+	req->ins = ins;
+	req->p1 = p1;
+	req->p2 = p2;
+	req->data = data;
+}
+
+bool
+ifd_request_build(ifd_card_t *card, ifd_request_t *req, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2,
+			const void *data, unsigned int len)
+{
+	buffer_t *bp;
+
+	bp = ifd_alloc_apdu_data(card, len);
+	if (len && !buffer_put(bp, data, len)) {
+		buffer_free(bp);
+		return false;
+	}
+
+	ifd_request_init(req, cla, ins, p1, p2, bp);
+	return true;
+}
+
+void
+ifd_request_destroy(ifd_request_t *req)
+{
+	if (req->data)
+		buffer_free(req->data);
+	req->data = NULL;
+}
+
+/*
+ * Non-blocking interface. This does the same as ifd_card_transact(),
+ * but each APDU is submitted to the reader, and ifd_card_complete()
+ * advances to the next one as the responses come in.
+ */
+struct ifd_transaction {
+	bool			busy;
+	ifd_request_t		req;
+
+	/* View of the chunk of data in flight */
+	buffer_t		apdu;
+	unsigned int		chunk_len;
+
+	/* GET RESPONSE command in flight, if any */
+	buffer_t *		get_response;
+	unsigned int		expect_len;
+
+	/* The response collected so far */
+	buffer_t *		rapdu;
+	size_t			total;
+};
+
+bool
+ifd_card_can_step(const ifd_card_t *card)
+{
+	const ifd_card_driver_t *driver = card->driver;
+
+	return driver->select_request && driver->select_response
+	    && driver->verify_request && driver->verify_response
+	    && driver->decipher_request && driver->decipher_response;
+}
+
+static void
+ifd_transaction_reset(struct ifd_transaction *xact)
+{
+	ifd_request_destroy(&xact->req);
+	if (xact->get_response) {
+		buffer_free(xact->get_response);
+		xact->get_response = NULL;
+	}
+	if (xact->rapdu) {
+		buffer_free(xact->rapdu);
+		xact->rapdu = NULL;
+	}
+	xact->busy = false;
+}
+
+static bool
+ifd_card_submit_chunk(ifd_card_t *card, struct ifd_transaction *xact)
+{
+	return ifd_request_frame_chunk(&xact->req, &xact->apdu, &xact->chunk_len)
+	    && ccid_reader_submit_apdu(card->reader, card->slot, &xact->apdu);
+}
+
+static bool
+ifd_card_submit_get_response(ifd_card_t *card, struct ifd_transaction *xact, uint8_t lc)
+{
+	xact->expect_len = lc?: 0x100;
+	debug2("Card signals %u additional response bytes\n", xact->expect_len);
+
+	if (!(xact->get_response = ifd_build_apdu(card, 0, IFD_INS_GET_RESPONSE_APDU, 0, 0, NULL, lc)))
+		return false;
+
+	return ccid_reader_submit_apdu(card->reader, card->slot, xact->get_response);
+}
+
+/*
+ * Submit the request to the card. The card takes ownership of the
+ * request's data, even if we fail.
+ */
+bool
+ifd_card_submit(ifd_card_t *card, ifd_request_t *req)
+{
+	struct ifd_transaction *xact;
+
+	if (card->xact == NULL)
+		card->xact = calloc(1, sizeof(*card->xact));
+	xact = card->xact;
+
+	if (xact->busy) {
+		error("Card is busy with another request\n");
+		ifd_request_destroy(req);
+		return false;
+	}
+
+	xact->req = *req;
+	req->data = NULL;
+	xact->total = 0;
+	xact->busy = true;
+
+	if (!ifd_card_submit_chunk(card, xact)) {
+		ifd_transaction_reset(xact);
+		return false;
+	}
+
+	return true;
+}
+
+xfer_status_t
+ifd_card_complete(ifd_card_t *card, buffer_t **rapdu_ret, uint16_t *sw_ret)
+{
+	struct ifd_transaction *xact = card->xact;
+	xfer_status_t status;
+	buffer_t *rapdu;
+	uint16_t sw;
+
+	if (xact == NULL || !xact->busy) {
+		error("%s: no request in flight\n", __func__);
+		return XFER_FAILED;
+	}
+
+	status = ccid_reader_complete(card->reader, &rapdu);
+	if (status == XFER_PENDING)
+		return XFER_PENDING;
+
+	if (status != XFER_DONE || !ifd_rapdu_get_status(rapdu, &sw))
+		goto failed;
+
+	if (xact->get_response) {
+		buffer_free(xact->get_response);
+		xact->get_response = NULL;
+
+		if (buffer_available(rapdu) != xact->expect_len) {
+			error("Card advertised %u more bytes or data, but GET_RESPONSE returned %u\n",
+					xact->expect_len, buffer_available(rapdu));
+			buffer_free(rapdu);
+			goto failed;
+		}
+
+		xact->total += xact->expect_len;
+		if (xact->total > IFD_MAX_RESPONSE_SIZE) {
+			error("Card response exceeds %u bytes, giving up\n", IFD_MAX_RESPONSE_SIZE);
+			buffer_free(rapdu);
+			goto failed;
+		}
+
+		buffer_chain_append(xact->rapdu, rapdu);
+	} else {
+		buffer_skip(xact->req.data, xact->chunk_len);
+
+		/* Only the response to the last command in the chain matters */
+		if (xact->rapdu)
+			buffer_free(xact->rapdu);
+		xact->rapdu = rapdu;
+		xact->total = buffer_available(rapdu);
+
+		if (buffer_available(xact->req.data) && sw == 0x9000) {
+			if (!ifd_card_submit_chunk(card, xact))
+				goto failed;
+			return XFER_PENDING;
+		}
+	}
+
+	if ((sw & 0xFF00) == 0x6100) {
+		if (!ifd_card_submit_get_response(card, xact, sw & 0xFF))
+			goto failed;
+		return XFER_PENDING;
+	}
+
+	*rapdu_ret = xact->rapdu;
+	*sw_ret = sw;
+	xact->rapdu = NULL;
+	ifd_transaction_reset(xact);
+	return XFER_DONE;
+
+failed:
+	ifd_transaction_reset(xact);
+	return XFER_FAILED;
+}
+
+void
+ifd_card_cancel(ifd_card_t *card)
+{
+	struct ifd_transaction *xact = card->xact;
+
+	if (xact == NULL || !xact->busy)
+		return;
+
+	ccid_reader_cancel(card->reader);
+	ifd_transaction_reset(xact);
+}
+
+/*
+ * Build a short APDU. The buffer comes from the reader's pool.
+ */
 buffer_t *
-ifd_build_apdu(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const void *data, unsigned int len)
+ifd_build_apdu(ifd_card_t *card, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const void *data, unsigned int len)
 {
 	buffer_t *apdu;
 	uint8_t lc = len;
@@ -277,7 +648,7 @@ ifd_build_apdu(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const void *dat
 		return NULL;
 	}
 
-	apdu = buffer_alloc_write(5 + len);
+	apdu = ccid_reader_alloc_buffer(card->reader, 5 + len);
 	if (buffer_put_u8(apdu, &cla)
 	 && buffer_put_u8(apdu, &ins)
 	 && buffer_put_u8(apdu, &p1)
@@ -286,5 +657,52 @@ ifd_build_apdu(uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, const void *dat
 	 && (data == NULL || buffer_put(apdu, data, len)))
 		return apdu;
 
+	buffer_free(apdu);
 	return NULL;
 }
+
+/*
+ * Allocate a buffer for APDU data of up to len bytes. The buffer has
+ * headroom for the APDU header (and the CCID header in front of that),
+ * so the data can be sent using ifd_frame_apdu() without copying.
+ */
+buffer_t *
+ifd_alloc_apdu_data(ifd_card_t *card, unsigned int len)
+{
+	buffer_t *bp;
+
+	bp = ccid_reader_alloc_buffer(card->reader, IFD_APDU_HDR_SIZE + len);
+	buffer_reserve_headroom(bp, IFD_APDU_HDR_SIZE);
+	return bp;
+}
+
+/*
+ * Set up apdu as a view of the next len bytes of data, with the APDU header
+ * written into the headroom in front of them. When sending long data using
+ * command chaining, the headroom for the next chunk is the tail of the
+ * chunk we just sent.
+ * The view shares its memory with data and must not be freed.
+ */
+bool
+ifd_frame_apdu(buffer_t *apdu, buffer_t *data, unsigned int len,
+		uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2)
+{
+	unsigned char *hdr;
+
+	if (len > 0xFF || len > buffer_available(data)
+	 || buffer_headroom(data) < IFD_APDU_HDR_SIZE) {
+		error("%s: cannot frame %u bytes of data\n", __func__, len);
+		return false;
+	}
+
+	hdr = data->data + data->rpos - IFD_APDU_HDR_SIZE;
+	hdr[0] = cla;
+	hdr[1] = ins;
+	hdr[2] = p1;
+	hdr[3] = p2;
+	hdr[4] = len;
+
+	buffer_init_read(apdu, data->data, data->rpos + len);
+	apdu->rpos = data->rpos - IFD_APDU_HDR_SIZE;
+	return true;
+}
@@ -26,19 +26,66 @@
 #include "uusb.h"
 
 #define IFD_MAX_ATR_LEN		64
+/* Size of the buffer needed by ifd_atrbuf_to_string */
+#define IFD_ATR_STRING_LEN	(3 * IFD_MAX_ATR_LEN + 1)
+#define IFD_MAX_AID_LEN		16
+
+/* CLA, INS, P1, P2, Lc */
+#define IFD_APDU_HDR_SIZE	5
+
+/* Upper bound on the size of a reassembled response */
+#define IFD_MAX_RESPONSE_SIZE	65536
 
 typedef struct ifd_atrbuf {
 	unsigned int		len;
 	unsigned char		data[IFD_MAX_ATR_LEN];
 } ifd_atrbuf_t;
 
+/*
+ * A command APDU, with the data kept separately from the header. The data
+ * buffer should come from ifd_alloc_apdu_data(). If there is more data
+ * than fits into a short APDU, it is sent using command chaining.
+ */
+typedef struct ifd_request {
+	uint8_t			cla, ins, p1, p2;
+	buffer_t *		data;
+} ifd_request_t;
+
 typedef struct ifd_card_driver {
 	bool			(*set_option)(ifd_card_t *, const char *key, const char *value);
 	bool			(*connect)(ifd_card_t *);
+	/* Pick up a session restored from the session cache. This should
+	 * not select the application again, but merely check that the card
+	 * is still in the state we left it in. */
+	bool			(*resume)(ifd_card_t *);
 	bool			(*verify)(ifd_card_t *, const char *pin, size_t pin_len, unsigned int *tries_left);
 	buffer_t * 		(*decipher)(ifd_card_t *, buffer_t *ciphertext);
+	/* Sign data (for RSA, a DigestInfo) with a key of key_len bytes */
+	buffer_t *		(*sign)(ifd_card_t *, buffer_t *data, unsigned int key_len);
+	/* Returns the DER certificate stored alongside a key, if any */
+	buffer_t *		(*read_certificate)(ifd_card_t *, unsigned int key_ref);
+
+	/* For the non-blocking session API, each operation is split into
+	 * building the request, and interpreting the card's response. */
+	bool			(*select_request)(ifd_card_t *, ifd_request_t *);
+	bool			(*select_response)(ifd_card_t *, buffer_t *rapdu, uint16_t sw);
+	bool			(*verify_request)(ifd_card_t *, const char *pin, size_t pin_len, ifd_request_t *);
+	bool			(*verify_response)(ifd_card_t *, buffer_t *rapdu, uint16_t sw, unsigned int *tries_left);
+	bool			(*decipher_request)(ifd_card_t *, buffer_t *ciphertext, ifd_request_t *);
+	buffer_t *		(*decipher_response)(ifd_card_t *, buffer_t *rapdu, uint16_t sw);
 } ifd_card_driver_t;
 
+/*
+ * Each driver provides a table of the cards it handles,
+ * terminated by an entry with a NULL name.
+ */
+typedef struct ifd_card_driver_registration {
+	const ifd_atrbuf_t *	atr;
+	const char *		name;
+	const ifd_card_driver_t *driver;
+	int			variant;
+} ifd_card_driver_registration_t;
+
 typedef struct ifd_card {
 	const char *		name;
 	ifd_atrbuf_t		atr;
@@ -48,11 +95,23 @@ typedef struct ifd_card {
 	ccid_reader_t *		reader;
 	unsigned int		slot;
 
+	/* The application selected by the driver */
+	struct {
+		unsigned int	len;
+		unsigned char	data[IFD_MAX_AID_LEN];
+	} aid;
+
+	/* Set if the card was restored from the session cache */
+	bool			resumed;
+
 	/* If the card has an application level PIN, set to true.
 	 * It's still possible, though, that a given key can be used without
 	 * presenting the application PIN. */
 	bool			pin_required;
 
+	/* The request in flight, when using the non-blocking interface */
+	struct ifd_transaction *xact;
+
 	union {
 		struct {
 			unsigned char	key_slot;
@@ -60,17 +119,42 @@ typedef struct ifd_card {
 	};
 } ifd_card_t;
 
-extern void		yubikey_init(void);
+
+extern const ifd_card_driver_registration_t yubikey_drivers[];
+
+/* Card Authentication, no pin required */
+#define YKPIV_DEFAULT_KEY_SLOT		0x9e
 
 extern void		ifd_atrbuf_set(ifd_atrbuf_t *, const void *, size_t len);
-extern void		ifd_register_card_driver(const ifd_atrbuf_t *, const char *name, ifd_card_driver_t *, int variant);
 extern ifd_card_t *	ifd_create_card(const ifd_atrbuf_t *, ccid_reader_t *, unsigned int slot);
+extern void		ifd_card_free(ifd_card_t *);
 extern bool		ifd_card_set_option(ifd_card_t *, const char *);
+extern void		ifd_card_set_application(ifd_card_t *, const void *aid, size_t len);
 extern bool		ifd_card_connect(ifd_card_t *);
 extern buffer_t *	ifd_card_xfer(ifd_card_t *card, buffer_t *apdu, uint16_t *sw);
 extern bool		ifd_card_verify(ifd_card_t *, const char *pin, size_t pin_len, unsigned int *tries_left);
 extern buffer_t *	ifd_card_decipher(ifd_card_t *card, buffer_t *ciphertext);
+extern buffer_t *	ifd_card_sign(ifd_card_t *card, buffer_t *data, unsigned int key_len);
+extern buffer_t *	ifd_card_read_certificate(ifd_card_t *card, unsigned int key_ref);
+extern buffer_t *	ifd_card_transact(ifd_card_t *, ifd_request_t *, uint16_t *sw);
+
+extern bool		ifd_card_can_step(const ifd_card_t *);
+extern bool		ifd_card_submit(ifd_card_t *, ifd_request_t *);
+extern xfer_status_t	ifd_card_complete(ifd_card_t *, buffer_t **rapdu_ret, uint16_t *sw);
+extern void		ifd_card_cancel(ifd_card_t *);
+
+extern void		ifd_request_init(ifd_request_t *, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2, buffer_t *data);
+extern bool		ifd_request_build(ifd_card_t *, ifd_request_t *, uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2,
+				const void *data, unsigned int len);
+extern void		ifd_request_destroy(ifd_request_t *);
+
+extern ifd_card_t *	ifd_session_restore(const char *dirname, uusb_dev_t *, ccid_reader_t *, unsigned int slot);
+extern bool		ifd_session_save(const char *dirname, uusb_dev_t *, const ifd_card_t *);
+extern void		ifd_session_forget(const char *dirname, uusb_dev_t *);
 
-extern buffer_t *	ifd_build_apdu(uint8_t, uint8_t, uint8_t, uint8_t, const void *, unsigned int);
+extern buffer_t *	ifd_build_apdu(ifd_card_t *, uint8_t, uint8_t, uint8_t, uint8_t, const void *, unsigned int);
+extern buffer_t *	ifd_alloc_apdu_data(ifd_card_t *, unsigned int len);
+extern bool		ifd_frame_apdu(buffer_t *apdu, buffer_t *data, unsigned int len,
+				uint8_t cla, uint8_t ins, uint8_t p1, uint8_t p2);
 
 #endif /* SCARD_H */
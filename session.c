@@ -0,0 +1,522 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * A resumable state machine on top of the non-blocking reader and card
+ * interfaces. Each state has exactly one command in flight; when its
+ * response comes in, we process it and submit the command for the next
+ * state.
+ *
+ * Creating the session does not talk to the reader at all. Getting the
+ * reader into a known state is the first step of the state machine.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "session.h"
+#include "scard.h"
+#include "bufparser.h"
+#include "util.h"
+
+/* Probe, then clear halt and probe again */
+#define SESSION_RESYNC_ATTEMPTS	2
+
+enum {
+	SESSION_START,
+	SESSION_RESYNC,
+	SESSION_SLOT_STATUS,
+	SESSION_POWER_ON,
+	SESSION_SELECT,
+	SESSION_PROBE_PIN,
+	SESSION_WAIT_PIN,
+	SESSION_VERIFY,
+	SESSION_DECIPHER,
+	SESSION_DONE,
+	SESSION_FAILED,
+};
+
+struct utoken_session {
+	int			state;
+	unsigned int		resync_attempts;
+
+	ccid_reader_t *		reader;
+	unsigned int		slot;
+	ifd_card_t *		card;
+
+	unsigned int		num_card_options;
+	char **			card_options;
+
+	/* Both are owned by the caller */
+	const char *		pin;
+	buffer_t *		ciphertext;
+
+	/* The user is still typing the PIN */
+	bool			pin_pending;
+
+	buffer_t *		cleartext;
+};
+
+/*
+ * The pin and ciphertext are borrowed, and must remain valid until
+ * the session is done. The deadline (0 for none) applies to the
+ * whole session.
+ */
+utoken_session_t *
+utoken_session_create(uusb_dev_t *dev, const char *pin, buffer_t *ciphertext, uint64_t deadline)
+{
+	utoken_session_t *sess;
+	ccid_reader_t *reader;
+
+	if (!(reader = ccid_reader_create_nonblocking(dev, NULL, deadline))) {
+		error("Unable to create reader for USB device\n");
+		return NULL;
+	}
+
+	sess = calloc(1, sizeof(*sess));
+	sess->state = SESSION_START;
+	sess->reader = reader;
+	sess->pin = pin;
+	sess->ciphertext = ciphertext;
+	return sess;
+}
+
+void
+utoken_session_free(utoken_session_t *sess)
+{
+	unsigned int i;
+
+	if (sess->card)
+		ifd_card_free(sess->card);
+
+	ccid_reader_cancel(sess->reader);
+	ccid_reader_free(sess->reader);
+
+	for (i = 0; i < sess->num_card_options; ++i)
+		free(sess->card_options[i]);
+	free(sess->card_options);
+
+	if (sess->cleartext)
+		buffer_free_secret(sess->cleartext);
+	free(sess);
+}
+
+/*
+ * Abandon the session. Unlike utoken_session_free, this does not wait for
+ * the reader to confirm that it has stopped working on our command.
+ */
+void
+utoken_session_cancel(utoken_session_t *sess)
+{
+	ccid_reader_cancel_nowait(sess->reader);
+	if (sess->card)
+		ifd_card_cancel(sess->card);
+
+	if (sess->state != SESSION_DONE)
+		sess->state = SESSION_FAILED;
+}
+
+/*
+ * Card options are applied once we know what card we're talking to.
+ */
+bool
+utoken_session_set_card_option(utoken_session_t *sess, const char *option)
+{
+	if (sess->state != SESSION_START) {
+		error("Too late to set card options\n");
+		return false;
+	}
+
+	sess->card_options = realloc(sess->card_options,
+			(sess->num_card_options + 1) * sizeof(char *));
+	sess->card_options[sess->num_card_options++] = strdup(option);
+	return true;
+}
+
+/*
+ * The PIN is not known yet. The session goes as far as probing whether
+ * the card needs one, and then waits for utoken_session_set_pin().
+ */
+void
+utoken_session_wait_for_pin(utoken_session_t *sess)
+{
+	sess->pin_pending = true;
+}
+
+/*
+ * A NULL pin means that the user did not give us one. Like the pin passed
+ * to utoken_session_create, it is borrowed.
+ */
+void
+utoken_session_set_pin(utoken_session_t *sess, const char *pin)
+{
+	sess->pin = pin;
+	sess->pin_pending = false;
+}
+
+/*
+ * Use this to set the latency cache.
+ */
+ccid_reader_t *
+utoken_session_get_reader(const utoken_session_t *sess)
+{
+	return sess->reader;
+}
+
+int
+utoken_session_get_fd(const utoken_session_t *sess)
+{
+	return ccid_reader_get_fd(sess->reader);
+}
+
+/*
+ * Returns the time in milliseconds after which utoken_session_step() should
+ * be called even if the fd has not become ready, or -1 if the session does
+ * not need to be stepped anymore (or not before the PIN has been set).
+ */
+long
+utoken_session_get_timeout(const utoken_session_t *sess)
+{
+	switch (sess->state) {
+	case SESSION_START:
+		return 0;
+	case SESSION_DONE:
+	case SESSION_FAILED:
+		return -1;
+	}
+
+	return ccid_reader_get_timeout(sess->reader);
+}
+
+buffer_t *
+utoken_session_take_cleartext(utoken_session_t *sess)
+{
+	buffer_t *cleartext = sess->cleartext;
+
+	sess->cleartext = NULL;
+	return cleartext;
+}
+
+/*
+ * Submit the request, and move on to the given state. The card consumes
+ * the request, whether we succeed or not.
+ */
+static xfer_status_t
+utoken_session_submit(utoken_session_t *sess, ifd_request_t *req, int next_state)
+{
+	if (!ifd_card_submit(sess->card, req))
+		return XFER_FAILED;
+
+	sess->state = next_state;
+	return XFER_DONE;
+}
+
+static xfer_status_t
+utoken_session_start(utoken_session_t *sess)
+{
+	if (!ccid_reader_submit_resync(sess->reader, sess->resync_attempts++))
+		return XFER_FAILED;
+
+	sess->state = SESSION_RESYNC;
+	return XFER_DONE;
+}
+
+/*
+ * A previous process may have left stale responses in the pipe, or an
+ * endpoint stalled. The probe skips the former; if it fails, try once
+ * more after clearing the halt.
+ */
+static xfer_status_t
+utoken_session_resync_done(utoken_session_t *sess)
+{
+	xfer_status_t status;
+	buffer_t *payload;
+
+	status = ccid_reader_complete(sess->reader, &payload);
+	if (status == XFER_PENDING)
+		return status;
+
+	if (status == XFER_FAILED) {
+		if (sess->resync_attempts >= SESSION_RESYNC_ATTEMPTS) {
+			error("Unable to establish communication with CCID reader\n");
+			return XFER_FAILED;
+		}
+		return utoken_session_start(sess);
+	}
+
+	buffer_free(payload);
+
+	if (!ccid_reader_submit_slot_status(sess->reader, sess->slot)) {
+		error("Cannot get slot status\n");
+		return XFER_FAILED;
+	}
+
+	sess->state = SESSION_SLOT_STATUS;
+	return XFER_DONE;
+}
+
+static xfer_status_t
+utoken_session_slot_status_done(utoken_session_t *sess)
+{
+	xfer_status_t status;
+	buffer_t *payload;
+
+	if ((status = ccid_reader_complete(sess->reader, &payload)) != XFER_DONE)
+		return status;
+	buffer_free(payload);
+
+	if (!ccid_reader_submit_poweron(sess->reader, sess->slot))
+		return XFER_FAILED;
+
+	sess->state = SESSION_POWER_ON;
+	return XFER_DONE;
+}
+
+static xfer_status_t
+utoken_session_power_on_done(utoken_session_t *sess)
+{
+	xfer_status_t status;
+	ifd_atrbuf_t atr;
+	ifd_request_t req;
+	buffer_t *payload;
+	ifd_card_t *card;
+	unsigned int i;
+
+	if ((status = ccid_reader_complete(sess->reader, &payload)) != XFER_DONE) {
+		if (status == XFER_FAILED)
+			error("Unable to power on card\n");
+		return status;
+	}
+
+	ifd_atrbuf_set(&atr, buffer_read_pointer(payload), buffer_available(payload));
+	buffer_free(payload);
+
+	if (!(card = ifd_create_card(&atr, sess->reader, sess->slot))) {
+		error("Unable to identify card\n");
+		return XFER_FAILED;
+	}
+
+	infomsg("Found %s device\n", card->name);
+	sess->card = card;
+
+	if (!ifd_card_can_step(card)) {
+		error("%s driver does not support non-blocking operation\n", card->name);
+		return XFER_FAILED;
+	}
+
+	for (i = 0; i < sess->num_card_options; ++i) {
+		if (!ifd_card_set_option(card, sess->card_options[i]))
+			return XFER_FAILED;
+	}
+
+	if (!card->driver->select_request(card, &req))
+		return XFER_FAILED;
+
+	return utoken_session_submit(sess, &req, SESSION_SELECT);
+}
+
+static xfer_status_t
+utoken_session_select_done(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	xfer_status_t status;
+	ifd_request_t req;
+	buffer_t *rapdu;
+	uint16_t sw;
+	bool okay;
+
+	if ((status = ifd_card_complete(card, &rapdu, &sw)) != XFER_DONE)
+		return status;
+
+	okay = card->driver->select_response(card, rapdu, sw);
+	buffer_free(rapdu);
+	if (!okay)
+		return XFER_FAILED;
+
+	debug("Trying empty password to see whether a PIN is required\n");
+	if (!card->driver->verify_request(card, NULL, 0, &req))
+		return XFER_FAILED;
+
+	return utoken_session_submit(sess, &req, SESSION_PROBE_PIN);
+}
+
+static xfer_status_t
+utoken_session_submit_decipher(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	ifd_request_t req;
+
+	debug("Decrypting %u bytes of ciphertext\n", buffer_available(sess->ciphertext));
+	if (!card->driver->decipher_request(card, sess->ciphertext, &req))
+		return XFER_FAILED;
+
+	return utoken_session_submit(sess, &req, SESSION_DECIPHER);
+}
+
+static xfer_status_t
+utoken_session_submit_pin(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	ifd_request_t req;
+
+	if (sess->pin == NULL)
+		return utoken_session_submit_decipher(sess);
+
+	debug("Verifying PIN\n");
+	if (!card->driver->verify_request(card, sess->pin, strlen(sess->pin), &req))
+		return XFER_FAILED;
+
+	return utoken_session_submit(sess, &req, SESSION_VERIFY);
+}
+
+static xfer_status_t
+utoken_session_probe_pin_done(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	xfer_status_t status;
+	buffer_t *rapdu;
+	uint16_t sw;
+
+	if ((status = ifd_card_complete(card, &rapdu, &sw)) != XFER_DONE)
+		return status;
+
+	if (card->driver->verify_response(card, rapdu, sw, NULL))
+		card->pin_required = false;
+	else
+		debug("This card has a PIN.\n");
+	buffer_free(rapdu);
+
+	/* No need to wait for a PIN the card does not want */
+	if (sess->pin_pending && card->pin_required) {
+		debug("Waiting for the PIN to be entered\n");
+		sess->state = SESSION_WAIT_PIN;
+		return XFER_DONE;
+	}
+
+	return utoken_session_submit_pin(sess);
+}
+
+static xfer_status_t
+utoken_session_verify_done(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	unsigned int tries_left = 0;
+	xfer_status_t status;
+	buffer_t *rapdu;
+	uint16_t sw;
+	bool okay;
+
+	if ((status = ifd_card_complete(card, &rapdu, &sw)) != XFER_DONE)
+		return status;
+
+	okay = card->driver->verify_response(card, rapdu, sw, &tries_left);
+	buffer_free(rapdu);
+
+	if (!okay) {
+		error("Wrong PIN, %u attempts left\n", tries_left);
+		return XFER_FAILED;
+	}
+
+	infomsg("Successfully verified PIN.\n");
+	return utoken_session_submit_decipher(sess);
+}
+
+static xfer_status_t
+utoken_session_decipher_done(utoken_session_t *sess)
+{
+	ifd_card_t *card = sess->card;
+	xfer_status_t status;
+	buffer_t *rapdu;
+	uint16_t sw;
+
+	if ((status = ifd_card_complete(card, &rapdu, &sw)) != XFER_DONE)
+		return status;
+
+	sess->cleartext = card->driver->decipher_response(card, rapdu, sw);
+	buffer_free_secret(rapdu);
+
+	if (sess->cleartext == NULL) {
+		error("Card failed to decrypt secret\n");
+		return XFER_FAILED;
+	}
+
+	sess->state = SESSION_DONE;
+	return XFER_DONE;
+}
+
+/*
+ * Advance the session as far as we can without blocking. Returns
+ * XFER_PENDING while we're waiting for the device, and XFER_DONE or
+ * XFER_FAILED once the session has come to an end.
+ */
+xfer_status_t
+utoken_session_step(utoken_session_t *sess)
+{
+	xfer_status_t status;
+
+	while (true) {
+		switch (sess->state) {
+		case SESSION_START:
+			status = utoken_session_start(sess);
+			break;
+		case SESSION_RESYNC:
+			status = utoken_session_resync_done(sess);
+			break;
+		case SESSION_SLOT_STATUS:
+			status = utoken_session_slot_status_done(sess);
+			break;
+		case SESSION_POWER_ON:
+			status = utoken_session_power_on_done(sess);
+			break;
+		case SESSION_SELECT:
+			status = utoken_session_select_done(sess);
+			break;
+		case SESSION_PROBE_PIN:
+			status = utoken_session_probe_pin_done(sess);
+			break;
+		case SESSION_WAIT_PIN:
+			if (sess->pin_pending)
+				return XFER_PENDING;
+			status = utoken_session_submit_pin(sess);
+			break;
+		case SESSION_VERIFY:
+			status = utoken_session_verify_done(sess);
+			break;
+		case SESSION_DECIPHER:
+			status = utoken_session_decipher_done(sess);
+			break;
+		case SESSION_DONE:
+			return XFER_DONE;
+		default:
+			return XFER_FAILED;
+		}
+
+		if (status == XFER_PENDING)
+			return XFER_PENDING;
+
+		/* Like utoken_session_cancel, this must not block */
+		if (status == XFER_FAILED) {
+			ccid_reader_cancel_nowait(sess->reader);
+			if (sess->card)
+				ifd_card_cancel(sess->card);
+			sess->state = SESSION_FAILED;
+		}
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "uusb.h"
+
+/*
+ * Non-blocking decryption session. The session drives one token through
+ * resync, slot status, power on, application selection, PIN verification
+ * and decryption, without ever waiting for the device.
+ *
+ * Usage: poll the fd returned by utoken_session_get_fd() for POLLOUT, and
+ * call utoken_session_step() whenever it fires, or when the number of
+ * milliseconds returned by utoken_session_get_timeout() has elapsed.
+ * Once step returns XFER_DONE, the cleartext can be picked up.
+ *
+ * If the PIN is still being entered when the session is created, call
+ * utoken_session_wait_for_pin(), and hand it over with
+ * utoken_session_set_pin() once it is available.
+ */
+typedef struct utoken_session	utoken_session_t;
+
+extern utoken_session_t *utoken_session_create(uusb_dev_t *, const char *pin, buffer_t *ciphertext,
+				uint64_t deadline);
+extern void		utoken_session_free(utoken_session_t *);
+extern void		utoken_session_cancel(utoken_session_t *);
+extern bool		utoken_session_set_card_option(utoken_session_t *, const char *option);
+extern void		utoken_session_wait_for_pin(utoken_session_t *);
+extern void		utoken_session_set_pin(utoken_session_t *, const char *pin);
+extern ccid_reader_t *	utoken_session_get_reader(const utoken_session_t *);
+extern int		utoken_session_get_fd(const utoken_session_t *);
+extern long		utoken_session_get_timeout(const utoken_session_t *);
+extern xfer_status_t	utoken_session_step(utoken_session_t *);
+extern buffer_t *	utoken_session_take_cleartext(utoken_session_t *);
+
+#endif /* SESSION_H */
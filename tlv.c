@@ -0,0 +1,213 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+/*
+ * BER-TLV as used by ISO 7816-4 card applications (PIV, OpenPGP, ...)
+ *
+ * Decoding works in place on a buffer chain, without copying or allocating
+ * anything. Encoding writes forward, straight into the buffer that will
+ * be sent to the card; the caller computes the length of constructed
+ * elements up front using tlv_encoded_size().
+ */
+
+#include "tlv.h"
+#include "util.h"
+
+void
+tlv_cursor_init(tlv_cursor_t *tc, const buffer_t *bp)
+{
+	buffer_cursor_init(&tc->pos, bp);
+	tc->left = buffer_cursor_available(&tc->pos);
+}
+
+static bool
+tlv_cursor_get(tlv_cursor_t *tc, void *dest, size_t count)
+{
+	if (count > tc->left || !buffer_cursor_get(&tc->pos, dest, count))
+		return false;
+
+	tc->left -= count;
+	return true;
+}
+
+static bool
+tlv_get_tag(tlv_cursor_t *tc, unsigned int *tag_ret)
+{
+	unsigned int tag, n = 0;
+	uint8_t b;
+
+	if (!tlv_cursor_get(tc, &b, 1))
+		return false;
+	tag = b;
+
+	/* Multi-byte tag */
+	if ((b & 0x1f) == 0x1f) {
+		do {
+			if (++n > 3 || !tlv_cursor_get(tc, &b, 1))
+				return false;
+			tag = (tag << 8) | b;
+		} while (b & 0x80);
+	}
+
+	*tag_ret = tag;
+	return true;
+}
+
+static bool
+tlv_get_length(tlv_cursor_t *tc, size_t *len_ret)
+{
+	unsigned int i, n;
+	size_t len;
+	uint8_t b;
+
+	if (!tlv_cursor_get(tc, &b, 1))
+		return false;
+
+	if (b < 0x80) {
+		*len_ret = b;
+		return true;
+	}
+
+	/* We do not support the indefinite form (0x80) */
+	n = b & 0x7f;
+	if (n == 0 || n > 3)
+		return false;
+
+	for (i = 0, len = 0; i < n; ++i) {
+		if (!tlv_cursor_get(tc, &b, 1))
+			return false;
+		len = (len << 8) | b;
+	}
+
+	*len_ret = len;
+	return true;
+}
+
+/*
+ * Get the next element at the current level. The value is not copied;
+ * item->value is a cursor over it, which can be used to descend into
+ * constructed elements.
+ */
+bool
+tlv_next(tlv_cursor_t *tc, tlv_t *item)
+{
+	if (!tlv_get_tag(tc, &item->tag)
+	 || !tlv_get_length(tc, &item->len))
+		return false;
+
+	if (item->len > tc->left) {
+		debug("%s: tag %x length %lu exceeds enclosing element\n", __func__,
+				item->tag, (unsigned long) item->len);
+		return false;
+	}
+
+	item->value.pos = tc->pos;
+	item->value.left = item->len;
+
+	return tlv_cursor_get(tc, NULL, item->len);
+}
+
+bool
+tlv_find(tlv_cursor_t *tc, unsigned int tag, tlv_t *item)
+{
+	while (!tlv_eof(tc)) {
+		if (!tlv_next(tc, item))
+			return false;
+		if (item->tag == tag)
+			return true;
+	}
+
+	return false;
+}
+
+bool
+tlv_get_value(tlv_t *item, void *dest, size_t size)
+{
+	tlv_cursor_t value = item->value;
+
+	if (item->len > size)
+		return false;
+	return tlv_cursor_get(&value, dest, item->len);
+}
+
+static unsigned int
+tlv_tag_size(unsigned int tag)
+{
+	if (tag > 0xffffff)
+		return 4;
+	if (tag > 0xffff)
+		return 3;
+	if (tag > 0xff)
+		return 2;
+	return 1;
+}
+
+static unsigned int
+tlv_length_size(size_t len)
+{
+	if (len < 0x80)
+		return 1;
+	if (len < 0x100)
+		return 2;
+	if (len < 0x10000)
+		return 3;
+	return 4;
+}
+
+/*
+ * Size of an element with the given tag and value length, including
+ * its header.
+ */
+size_t
+tlv_encoded_size(unsigned int tag, size_t len)
+{
+	return tlv_tag_size(tag) + tlv_length_size(len) + len;
+}
+
+bool
+tlv_put_header(buffer_t *bp, unsigned int tag, size_t len)
+{
+	unsigned char hdr[8];
+	unsigned int i, n = 0;
+
+	if (len > 0xffffff)
+		return false;
+
+	for (i = tlv_tag_size(tag); i--; )
+		hdr[n++] = tag >> (8 * i);
+
+	i = tlv_length_size(len);
+	if (i == 1) {
+		hdr[n++] = len;
+	} else {
+		hdr[n++] = 0x80 | (i - 1);
+		for (--i; i--; )
+			hdr[n++] = len >> (8 * i);
+	}
+
+	return buffer_put(bp, hdr, n);
+}
+
+bool
+tlv_put(buffer_t *bp, unsigned int tag, const void *value, size_t len)
+{
+	return tlv_put_header(bp, tag, len)
+	    && buffer_put(bp, value, len);
+}
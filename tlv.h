@@ -0,0 +1,58 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef TLV_H
+#define TLV_H
+
+#include "bufparser.h"
+
+/*
+ * A cursor over BER-TLV encoded data. It is bounded by the length of
+ * the enclosing element, so a malformed length can never make us read
+ * past the end of that element.
+ */
+typedef struct tlv_cursor {
+	buffer_cursor_t		pos;
+	size_t			left;
+} tlv_cursor_t;
+
+typedef struct tlv {
+	unsigned int		tag;
+	size_t			len;
+	tlv_cursor_t		value;
+} tlv_t;
+
+extern void		tlv_cursor_init(tlv_cursor_t *, const buffer_t *);
+extern bool		tlv_next(tlv_cursor_t *, tlv_t *);
+extern bool		tlv_find(tlv_cursor_t *, unsigned int tag, tlv_t *);
+extern bool		tlv_get_value(tlv_t *, void *dest, size_t size);
+
+extern size_t		tlv_encoded_size(unsigned int tag, size_t len);
+extern bool		tlv_put_header(buffer_t *, unsigned int tag, size_t len);
+extern bool		tlv_put(buffer_t *, unsigned int tag, const void *value, size_t len);
+
+static inline bool
+tlv_eof(const tlv_cursor_t *tc)
+{
+	return tc->left == 0;
+}
+
+#endif /* TLV_H */
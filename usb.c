@@ -23,6 +23,7 @@
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <linux/usbdevice_fs.h>
 #include <string.h>
 #include <stdio.h>
@@ -37,6 +38,13 @@
 
 #define SYSFS_USB_DEVICES	"/sys/bus/usb/devices"
 
+/* How often we look for the device while waiting for it to show up */
+#define USB_DISCOVERY_INTERVAL	100
+
+/* Where we share autosuspend state between processes; this is also
+ * where the command line tool keeps its lock queue. */
+#define USB_AWAKE_DIR		"/run/lock/utoken-decrypt"
+
 bool
 usb_parse_type(const char *string, uusb_type_t *type)
 {
@@ -70,32 +78,43 @@ bad:
 	return false;
 }
 
-static char *
-usb_find_device(bool (*match_fn)(const char *path, const void *data), const void *data)
+/*
+ * Collect the sysfs paths of up to max matching devices.
+ */
+static unsigned int
+usb_find_devices(bool (*match_fn)(const char *path, const void *data), const void *data,
+		char **result, unsigned int max)
 {
-	char *result = NULL;
+	unsigned int count = 0;
 	DIR *dir;
 	struct dirent *d;
 
 	if (!(dir = opendir(SYSFS_USB_DEVICES))) {
 		error("Cannot open %s: %m\n", SYSFS_USB_DEVICES);
-		return NULL;
+		return 0;
 	}
 
-	while ((d = readdir(dir)) != NULL) {
+	while (count < max && (d = readdir(dir)) != NULL) {
 		char sysfs_dir[PATH_MAX];
 
 		if (d->d_name[0] == '.')
 			continue;
 
 		snprintf(sysfs_dir, sizeof(sysfs_dir), "%s/%s", SYSFS_USB_DEVICES, d->d_name);
-		if (match_fn(sysfs_dir, data)) {
-			result = strdup(sysfs_dir);
-			break;
-		}
+		if (match_fn(sysfs_dir, data))
+			result[count++] = strdup(sysfs_dir);
 	}
 
 	closedir(dir);
+	return count;
+}
+
+static char *
+usb_find_device(bool (*match_fn)(const char *path, const void *data), const void *data)
+{
+	char *result = NULL;
+
+	usb_find_devices(match_fn, data, &result, 1);
 	return result;
 }
 
@@ -164,6 +183,28 @@ sysfs_read_line(const char *sysfs_dir, const char *name)
 	return result;
 }
 
+static bool
+sysfs_write_line(const char *sysfs_dir, const char *name, const char *value)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	bool ok;
+
+	snprintf(path, sizeof(path), "%s/%s", sysfs_dir, name);
+	if ((fp = fopen(path, "w")) == NULL) {
+		debug("Cannot open %s for writing: %m\n", path);
+		return false;
+	}
+
+	ok = fprintf(fp, "%s\n", value) >= 0;
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok)
+		debug("Cannot write to %s: %m\n", path);
+	return ok;
+}
+
 static unsigned int
 sysfs_read_integer_base(const char *sysfs_dir, const char *name, unsigned int base)
 {
@@ -272,6 +313,7 @@ __uusb_attach_device(uusb_dev_t *dev)
 		return false;
 	}
 
+	dev->devnum = linuxdev;
 	dev->dev_path = strdup(path);
 	return true;
 }
@@ -281,9 +323,171 @@ __uusb_identify_device(uusb_dev_t *dev)
 {
 	dev->type.idVendor = sysfs_read_hexadecimal(dev->sysfs_dir, "idVendor");
 	dev->type.idProduct = sysfs_read_hexadecimal(dev->sysfs_dir, "idProduct");
+
+	/* Not all devices have a serial number */
+	dev->serial = sysfs_read_line(dev->sysfs_dir, "serial");
 	return true;
 }
 
+/*
+ * Keep the device from being autosuspended while we're using it. Resuming
+ * a suspended device adds latency to the first transfer, so we want to do
+ * this as early as possible.
+ *
+ * Several processes may use the same device, so the original setting of
+ * power/control is kept in a state file next to the lock queue. Every
+ * process holding the device awake has a shared flock on that file, and
+ * whoever lets go last restores the setting. The flock on power/control
+ * itself serializes the bookkeeping. If we cannot create the state file,
+ * we fall back to doing the bookkeeping within this process only.
+ */
+static bool	usb_keep_awake = false;
+
+/* Leave autosuspend disabled when we're done, so that the next process
+ * finds the device resumed. */
+void
+usb_set_keep_awake(bool keep)
+{
+	usb_keep_awake = keep;
+}
+
+static int
+uusb_awake_lock(uusb_dev_t *dev)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/power/control", dev->sysfs_dir);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		debug("Cannot open %s: %m\n", path);
+		return -1;
+	}
+
+	flock(fd, LOCK_EX);
+	return fd;
+}
+
+static void
+uusb_awake_state_path(const uusb_dev_t *dev, char *path, size_t size)
+{
+	snprintf(path, size, "%s/%u-%u.awake", USB_AWAKE_DIR, major(dev->devnum), minor(dev->devnum));
+}
+
+static char *
+uusb_awake_state_read(int fd)
+{
+	char buffer[64];
+	ssize_t n;
+
+	n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+	if (n <= 0)
+		return NULL;
+
+	buffer[n] = '\0';
+	buffer[strcspn(buffer, "\r\n")] = '\0';
+	return buffer[0]? strdup(buffer) : NULL;
+}
+
+static void
+uusb_awake_state_write(int fd, const char *value)
+{
+	if (ftruncate(fd, 0) < 0
+	 || (value && pwrite(fd, value, strlen(value), 0) < 0))
+		debug("Cannot update autosuspend state: %m\n");
+}
+
+bool
+uusb_dev_hold_awake(uusb_dev_t *dev)
+{
+	char path[PATH_MAX], *control;
+	int ctl_fd, fd;
+	bool ok;
+
+	if (dev->awake_count++)
+		return true;
+
+	if ((ctl_fd = uusb_awake_lock(dev)) < 0)
+		return false;
+
+	if ((control = sysfs_read_line(dev->sysfs_dir, "power/control")) == NULL) {
+		close(ctl_fd);
+		return false;
+	}
+
+	uusb_awake_state_path(dev, path, sizeof(path));
+	if ((mkdir(USB_AWAKE_DIR, 0755) < 0 && errno != EEXIST)
+	 || (fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0) {
+		debug("Cannot create %s, not sharing autosuspend state: %m\n", path);
+		if (strcmp(control, "on"))
+			dev->saved_power_control = strdup(control);
+	} else {
+		/* Nobody else is holding the device awake. Anything in the file
+		 * is left over from a process that went away without cleaning
+		 * up, and still is the original setting. */
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+			char *saved = uusb_awake_state_read(fd);
+
+			if (saved == NULL && strcmp(control, "on"))
+				uusb_awake_state_write(fd, control);
+			free(saved);
+		}
+
+		flock(fd, LOCK_SH);
+		dev->awake_fd = fd;
+	}
+
+	ok = !strcmp(control, "on") || sysfs_write_line(dev->sysfs_dir, "power/control", "on");
+	if (ok)
+		usb_debug("Disabled autosuspend for %s (was %s)\n", dev->sysfs_dir, control);
+
+	free(control);
+	close(ctl_fd);
+	return ok;
+}
+
+void
+uusb_dev_release_awake(uusb_dev_t *dev)
+{
+	char path[PATH_MAX], *saved = NULL;
+	int ctl_fd;
+
+	if (dev->awake_count == 0 || --(dev->awake_count))
+		return;
+
+	ctl_fd = uusb_awake_lock(dev);
+
+	if (dev->awake_fd >= 0) {
+		if (usb_keep_awake) {
+			/* Make sure nobody restores it after us */
+			uusb_awake_state_write(dev->awake_fd, NULL);
+		} else if (flock(dev->awake_fd, LOCK_EX | LOCK_NB) == 0) {
+			/* We're the last ones */
+			saved = uusb_awake_state_read(dev->awake_fd);
+			uusb_awake_state_path(dev, path, sizeof(path));
+			unlink(path);
+		}
+
+		close(dev->awake_fd);
+		dev->awake_fd = -1;
+	} else if (!usb_keep_awake) {
+		saved = dev->saved_power_control;
+		dev->saved_power_control = NULL;
+	}
+	drop_string(&dev->saved_power_control);
+
+	if (saved) {
+		usb_debug("Restoring power/control=%s for %s\n", saved, dev->sysfs_dir);
+		sysfs_write_line(dev->sysfs_dir, "power/control", saved);
+		free(saved);
+	}
+
+	if (ctl_fd >= 0)
+		close(ctl_fd);
+}
+
+/*
+ * The device takes ownership of sysfs_dir, even if we fail.
+ */
 static uusb_dev_t *
 __usb_open(char *sysfs_dir)
 {
@@ -292,26 +496,31 @@ __usb_open(char *sysfs_dir)
 	dev = calloc(1, sizeof(*dev));
 	dev->sysfs_dir = sysfs_dir;
 	dev->fd = -1;
+	dev->lock_fd = -1;
+	dev->awake_fd = -1;
 
 	if (!__uusb_attach_device(dev)) {
 		error("Cannot attach system device file\n");
-		return NULL;
+		goto failed;
 	}
 
 	if (!__uusb_identify_device(dev)) {
 		error("Cannot identify USB device\n");
-		return NULL;
+		goto failed;
 	}
 
+	/* Disable autosuspend before anything else touches the device */
+	uusb_dev_hold_awake(dev);
+
 	if (!__uusb_process_descriptors(dev)) {
 		error("Error parsing USB descriptors\n");
-		return NULL;
+		goto failed;
 	}
 
 	dev->fd = open(dev->dev_path, O_RDWR);
 	if (dev->fd < 0) {
 		error("Unable to open %s: %m\n", dev->dev_path);
-		return NULL;
+		goto failed;
 	}
 
 	infomsg("Opened USB device %04x:%04x at %u:%u; path %s\n",
@@ -319,19 +528,87 @@ __usb_open(char *sysfs_dir)
 			dev->devaddr.bus, dev->devaddr.dev,
 			dev->dev_path);
 	return dev;
+
+failed:
+	usb_close(dev);
+	return NULL;
 }
 
+/*
+ * If a deadline is given, keep looking until the device shows up (which
+ * may take a moment during boot) or until we run out of time.
+ */
 uusb_dev_t *
-usb_open_type(const uusb_type_t *type)
+usb_open_type(const uusb_type_t *type, uint64_t deadline)
 {
 	char *sysfs_dir;
 
-	if (!(sysfs_dir = usb_find_device(usb_match_type, type)))
-		return NULL;
+	while (!(sysfs_dir = usb_find_device(usb_match_type, type))) {
+		long wait = deadline_cap_timeout(deadline, USB_DISCOVERY_INTERVAL);
+
+		if (deadline == 0 || wait == 0)
+			return NULL;
+
+		usleep(wait * 1000);
+	}
 
 	return __usb_open(sysfs_dir);
 }
 
+/*
+ * Open all devices of the given type, up to max. With a deadline, wait
+ * for at least one of them to show up. Devices that cannot be opened
+ * are skipped.
+ */
+unsigned int
+usb_open_all_type(const uusb_type_t *type, uint64_t deadline, uusb_dev_t **devs, unsigned int max)
+{
+	char *sysfs_dirs[max];
+	unsigned int i, found, count = 0;
+
+	while (!(found = usb_find_devices(usb_match_type, type, sysfs_dirs, max))) {
+		long wait = deadline_cap_timeout(deadline, USB_DISCOVERY_INTERVAL);
+
+		if (deadline == 0 || wait == 0)
+			return 0;
+
+		usleep(wait * 1000);
+	}
+
+	for (i = 0; i < found; ++i) {
+		uusb_dev_t *dev;
+
+		if ((dev = __usb_open(sysfs_dirs[i])) != NULL)
+			devs[count++] = dev;
+	}
+
+	return count;
+}
+
+/*
+ * Release everything associated with the device. Any reader created
+ * on top of the device must have been freed before.
+ */
+void
+usb_close(uusb_dev_t *dev)
+{
+	if (dev->fd >= 0)
+		close(dev->fd);
+	uusb_dev_unlock(dev);
+
+	/* Drop the reference taken in __usb_open, plus any the caller forgot */
+	if (dev->awake_count) {
+		dev->awake_count = 1;
+		uusb_dev_release_awake(dev);
+	}
+
+	uusb_free_descriptors(dev);
+	drop_string(&dev->sysfs_dir);
+	drop_string(&dev->dev_path);
+	drop_string(&dev->serial);
+	free(dev);
+}
+
 static bool
 uusb_select_interface(uusb_dev_t *dev, const uusb_config_t *config, const uusb_interface_t *interface)
 {
@@ -366,15 +643,16 @@ uusb_select_interface(uusb_dev_t *dev, const uusb_config_t *config, const uusb_i
 static bool
 uusb_set_endpoints(uusb_dev_t *dev, uusb_interface_t *interface)
 {
-	unsigned int i;
+	uusb_endpoint_descriptor_t endpoint[UUSB_MAX_ENDPOINTS];
+	unsigned int i, num_endpoints;
 
 	dev->endpoints.ep_o = -1;
 	dev->endpoints.ep_i = -1;
 	dev->endpoints.ep_intr = -1;
 
-	for (i = 0; i < interface->num_endpoints; ++i) {
-		uusb_endpoint_t *ep = &interface->endpoint[i];
-		const uusb_endpoint_descriptor_t *d = &ep->descriptor;
+	num_endpoints = uusb_interface_get_endpoints(interface, endpoint, UUSB_MAX_ENDPOINTS);
+	for (i = 0; i < num_endpoints; ++i) {
+		const uusb_endpoint_descriptor_t *d = &endpoint[i];
 		unsigned char ep_type = d->bmAttributes & UUSB_ENDPOINT_TYPE_MASK;
 		unsigned char ep_dir = d->bEndpointAddress & UUSB_ENDPOINT_DIR_MASK;
 
@@ -410,6 +688,7 @@ uusb_dev_select_ccid_interface(uusb_dev_t *dev, const struct ccid_descriptor **c
 			 && uusb_set_endpoints(dev, interface)
 			 && uusb_select_interface(dev, config, interface)) {
 				infomsg("Successfully selected CCID interface\n");
+				dev->interface_num = interface->descriptor.bInterfaceNumber;
 				*ccid_ret = ccid;
 				return true;
 			}
@@ -437,50 +716,306 @@ uusb_bulk(uusb_dev_t *dev, uint8_t ep, unsigned char *buffer, unsigned int len,
         bulk.len = len;
         bulk.timeout = timeout;
         if ((rc = ioctl(dev->fd, USBDEVFS_BULK, &bulk)) < 0) {
-		error("%s: ioctl failed: %m\n", __func__);
+		/* Timeouts are reported by the caller, who knows what they mean */
+		if (errno == ETIMEDOUT)
+			debug2("%s: endpoint 0x%02x timed out\n", __func__, ep);
+		else if (errno == EPIPE)
+			error("%s: endpoint 0x%02x stalled\n", __func__, ep);
+		else
+			error("%s: ioctl failed: %m\n", __func__);
                 return rc;
         }
 
 #if 0
 	if (opt_debug > 1 && (ep & UUSB_ENDPOINT_DIR_MASK) == UUSB_ENDPOINT_IN) {
 		debug("uusb_bulk received packet from endpoint 0x%02x, timeout %ld ms\n", ep, timeout);
-		hexdump(buffer, bulk.len, debug2, 4);
+		hexdump(buffer, rc, debug2, 4);
 	}
 #endif
 
-        return bulk.len;
+        return rc;
 }
 
+/*
+ * Clear a halt condition on the bulk endpoints
+ */
 bool
-uusb_send(uusb_dev_t *dev, buffer_t *pkt)
+uusb_clear_halt(uusb_dev_t *dev)
+{
+	int eps[2] = { dev->endpoints.ep_o, dev->endpoints.ep_i };
+	unsigned int i;
+	bool okay = true;
+
+	for (i = 0; i < 2; ++i) {
+		unsigned int ep = eps[i];
+
+		debug("Clearing halt on endpoint 0x%02x\n", ep);
+		if (ioctl(dev->fd, USBDEVFS_CLEAR_HALT, &ep) < 0) {
+			error("ioctl(USBDEVFS_CLEAR_HALT): %m\n");
+			okay = false;
+		}
+	}
+
+	return okay;
+}
+
+/*
+ * Reset the device. This is the last resort when the device does not talk
+ * to us anymore. We need to claim the interface again afterwards.
+ */
+bool
+uusb_reset(uusb_dev_t *dev)
+{
+	unsigned int interface_num = dev->interface_num;
+
+	infomsg("Resetting USB device %s\n", dev->dev_path);
+	if (ioctl(dev->fd, USBDEVFS_RESET, NULL) < 0) {
+		error("ioctl(USBDEVFS_RESET): %m\n");
+		return false;
+	}
+
+	if (interface_num != 0
+	 && ioctl(dev->fd, USBDEVFS_CLAIMINTERFACE, &interface_num) < 0
+	 && errno != EBUSY) {
+		error("ioctl(USBDEVFS_CLAIMINTERFACE): %m\n");
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Send a class specific request to the interface we selected
+ */
+bool
+uusb_interface_request(uusb_dev_t *dev, uint8_t request, uint16_t value, long timeout)
+{
+	struct usbdevfs_ctrltransfer ctrl;
+
+	ctrl.bRequestType = 0x21;	/* host to device, class, interface */
+	ctrl.bRequest = request;
+	ctrl.wValue = value;
+	ctrl.wIndex = dev->interface_num;
+	ctrl.wLength = 0;
+	ctrl.timeout = timeout;
+	ctrl.data = NULL;
+
+	if (ioctl(dev->fd, USBDEVFS_CONTROL, &ctrl) < 0) {
+		error("%s: ioctl failed: %m\n", __func__);
+		return false;
+	}
+
+	return true;
+}
+
+const uusb_type_t *
+uusb_dev_get_type(const uusb_dev_t *dev)
+{
+	return &dev->type;
+}
+
+dev_t
+uusb_dev_get_devnum(const uusb_dev_t *dev)
+{
+	return dev->devnum;
+}
+
+const char *
+uusb_dev_get_serial(const uusb_dev_t *dev)
+{
+	return dev->serial;
+}
+
+bool
+uusb_send(uusb_dev_t *dev, buffer_t *pkt, long timeout)
 {
 	return uusb_bulk(dev, dev->endpoints.ep_o, 
 			(void *) buffer_read_pointer(pkt),
 			buffer_available(pkt),
-			10000) >= 0;
+			timeout) >= 0;
 }
 
-buffer_t *
-uusb_recv(uusb_dev_t *dev, size_t maxlen, long timeout)
+/*
+ * Receive a packet into the tailroom of the buffer provided by the caller
+ */
+bool
+uusb_recv(uusb_dev_t *dev, buffer_t *pkt, long timeout)
 {
-	buffer_t *pkt;
 	int len;
 
-	/* Allocate a response packet large enough to hold the max response size */
-	pkt = buffer_alloc_write(maxlen);
-	memset(buffer_write_pointer(pkt), 0xAA, buffer_tailroom(pkt));
-
 	len = uusb_bulk(dev, dev->endpoints.ep_i, 
-			(void *) buffer_write_pointer(pkt),
+			buffer_write_pointer(pkt),
 			buffer_tailroom(pkt),
 			timeout);
-	if (len < 0) {
-		buffer_free(pkt);
-		return NULL;
-	}
+	if (len < 0)
+		return false;
 
 	/* there should be a buffer_* function for this */
 	pkt->wpos += len;
+	return true;
+}
+
+/*
+ * Asynchronous bulk transfers, for callers that drive the device from an
+ * event loop. When a URB has completed, the device fd polls as writable,
+ * and the URB can be reaped without blocking.
+ */
+struct uusb_urb {
+	struct usbdevfs_urb	urb;
+	buffer_t *		pkt;
+	bool			busy;
+	int			status;
+};
+
+uusb_urb_t *
+uusb_urb_alloc(void)
+{
+	return calloc(1, sizeof(uusb_urb_t));
+}
+
+/*
+ * The URB must not be in flight anymore; use uusb_discard() first.
+ */
+void
+uusb_urb_free(uusb_urb_t *urb)
+{
+	free(urb);
+}
+
+bool
+uusb_urb_busy(const uusb_urb_t *urb)
+{
+	return urb->busy;
+}
+
+/*
+ * Returns 0 if the URB completed successfully, or a negative errno value.
+ */
+int
+uusb_urb_status(const uusb_urb_t *urb)
+{
+	return urb->status;
+}
+
+int
+uusb_dev_get_fd(const uusb_dev_t *dev)
+{
+	return dev->fd;
+}
+
+static bool
+uusb_submit(uusb_dev_t *dev, uusb_urb_t *urb, uint8_t ep, buffer_t *pkt, void *data, unsigned int len)
+{
+	if (urb->busy) {
+		error("%s: URB is still in flight\n", __func__);
+		return false;
+	}
+
+	memset(&urb->urb, 0, sizeof(urb->urb));
+	urb->urb.type = USBDEVFS_URB_TYPE_BULK;
+	urb->urb.endpoint = ep;
+	urb->urb.buffer = data;
+	urb->urb.buffer_length = len;
+	urb->urb.usercontext = urb;
 
-	return pkt;
+	if (ioctl(dev->fd, USBDEVFS_SUBMITURB, &urb->urb) < 0) {
+		error("%s: ioctl failed: %m\n", __func__);
+		return false;
+	}
+
+	urb->pkt = pkt;
+	urb->status = 0;
+	urb->busy = true;
+	return true;
+}
+
+/*
+ * Queue the packet for sending. The buffer must stay put until the URB
+ * has been reaped.
+ */
+bool
+uusb_submit_send(uusb_dev_t *dev, uusb_urb_t *urb, buffer_t *pkt)
+{
+	return uusb_submit(dev, urb, dev->endpoints.ep_o, pkt,
+			(void *) buffer_read_pointer(pkt),
+			buffer_available(pkt));
+}
+
+/*
+ * Queue a receive into the tailroom of the buffer. When the URB is
+ * reaped, the data received is appended to the buffer.
+ */
+bool
+uusb_submit_recv(uusb_dev_t *dev, uusb_urb_t *urb, buffer_t *pkt)
+{
+	return uusb_submit(dev, urb, dev->endpoints.ep_i, pkt,
+			buffer_write_pointer(pkt),
+			buffer_tailroom(pkt));
+}
+
+static uusb_urb_t *
+uusb_urb_complete(struct usbdevfs_urb *kurb)
+{
+	uusb_urb_t *urb = kurb->usercontext;
+
+	urb->busy = false;
+	urb->status = kurb->status;
+
+	if (urb->status != 0)
+		debug2("URB for endpoint 0x%02x completed with status %d\n", kurb->endpoint, urb->status);
+	else if (kurb->endpoint & UUSB_ENDPOINT_DIR_MASK)
+		urb->pkt->wpos += kurb->actual_length;
+
+	return urb;
+}
+
+/*
+ * Reap a completed URB, without blocking. If none has completed yet,
+ * *urb_ret is set to NULL. Returns false on errors, such as when the
+ * device has gone away.
+ */
+bool
+uusb_reap(uusb_dev_t *dev, uusb_urb_t **urb_ret)
+{
+	struct usbdevfs_urb *kurb;
+
+	*urb_ret = NULL;
+	if (ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &kurb) < 0) {
+		if (errno == EAGAIN)
+			return true;
+		error("%s: ioctl failed: %m\n", __func__);
+		return false;
+	}
+
+	*urb_ret = uusb_urb_complete(kurb);
+	return true;
+}
+
+/*
+ * Cancel a URB, and wait for the kernel to hand it back. Other URBs
+ * reaped while we wait are marked complete as usual.
+ */
+void
+uusb_discard(uusb_dev_t *dev, uusb_urb_t *urb)
+{
+	struct usbdevfs_urb *kurb;
+
+	if (!urb->busy)
+		return;
+
+	/* EINVAL means the URB has completed already */
+	if (ioctl(dev->fd, USBDEVFS_DISCARDURB, &urb->urb) < 0 && errno != EINVAL)
+		debug("%s: ioctl failed: %m\n", __func__);
+
+	while (urb->busy) {
+		if (ioctl(dev->fd, USBDEVFS_REAPURB, &kurb) < 0) {
+			if (errno == EINTR)
+				continue;
+			error("%s: cannot reap URB: %m\n", __func__);
+			urb->busy = false;
+			break;
+		}
+
+		uusb_urb_complete(kurb);
+	}
 }
@@ -23,6 +23,7 @@
 #include <ctype.h>
 #include <stdbool.h>
 #include <iconv.h>
+#include <time.h>
 
 #include "util.h"
 
@@ -71,12 +72,63 @@ parse_octet_string(const char *string, unsigned char *buffer, size_t bufsz)
 	return i;
 }
 
-const char *
-print_octet_string(const unsigned char *data, unsigned int len)
+static int
+base64_value(char cc)
+{
+	if ('A' <= cc && cc <= 'Z')
+		return cc - 'A';
+	if ('a' <= cc && cc <= 'z')
+		return cc - 'a' + 26;
+	if ('0' <= cc && cc <= '9')
+		return cc - '0' + 52;
+	if (cc == '+')
+		return 62;
+	if (cc == '/')
+		return 63;
+	return -1;
+}
+
+/*
+ * Decode standard base64. Whitespace is ignored, padding is optional.
+ * Returns the number of octets, or 0 on error.
+ */
+unsigned int
+parse_base64(const char *string, unsigned char *buffer, size_t bufsz)
 {
-	static char buffer[3 * 64 + 1];
+	unsigned int i = 0, nbits = 0;
+	uint32_t bits = 0;
+	char cc;
+
+	while ((cc = *string++) != '\0' && cc != '=') {
+		int value;
+
+		if (isspace(cc))
+			continue;
+
+		if ((value = base64_value(cc)) < 0) {
+			debug("%s: bad character in base64 string\n", __func__);
+			return 0;
+		}
 
-	if (len < 32) {
+		bits = (bits << 6) | value;
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			if (i >= bufsz) {
+				debug("%s: base64 string too long for buffer\n", __func__);
+				return 0;
+			}
+			buffer[i++] = bits >> nbits;
+		}
+	}
+
+	return i;
+}
+
+const char *
+print_octet_string(const unsigned char *data, unsigned int len, char *buffer, size_t size)
+{
+	if (len < 32 && size >= 3 * len + 1) {
 		unsigned int i;
 		char *s;
 
@@ -89,13 +141,22 @@ print_octet_string(const unsigned char *data, unsigned int len)
 		}
 		*s = '\0';
 	} else {
-		snprintf(buffer, sizeof(buffer), "<%u bytes of data>", len);
+		snprintf(buffer, size, "<%u bytes of data>", len);
 	}
 
 	return buffer;
 
 }
 
+uint64_t
+monotonic_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 void
 hexdump(const void *data, size_t size, void (*print_fn)(const char *, ...), unsigned int indent)
 {
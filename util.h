@@ -25,9 +25,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 
 
-extern unsigned int	opt_debug;
+/* Each thread has its own debug level; new threads start out at 0 */
+extern __thread unsigned int opt_debug;
 
 static inline void
 debug(const char *fmt, ...)
@@ -117,8 +120,40 @@ assign_string(char **var, const char *string)
 		*var = strdup(string);
 }
 
+extern uint64_t		monotonic_time_ms(void);
+
+/*
+ * Deadlines are absolute points in time on the monotonic clock, measured in
+ * milliseconds. A deadline of 0 means there is no deadline.
+ */
+static inline bool
+deadline_expired(uint64_t deadline)
+{
+	return deadline && monotonic_time_ms() >= deadline;
+}
+
+static inline long
+deadline_cap_timeout(uint64_t deadline, long timeout)
+{
+	uint64_t now;
+
+	if (deadline == 0)
+		return timeout;
+
+	if ((now = monotonic_time_ms()) >= deadline)
+		return 0;
+
+	if (deadline - now < (uint64_t) timeout)
+		timeout = deadline - now;
+	return timeout;
+}
 extern void		hexdump(const void *data, size_t size, void (*)(const char *, ...), unsigned int indent);
-extern const char *	print_octet_string(const unsigned char *data, unsigned int len);
+/* Size of the buffer needed by print_octet_string */
+#define OCTET_STRING_BUFSZ	(3 * 32 + 1)
+
+extern const char *	print_octet_string(const unsigned char *data, unsigned int len, char *buffer, size_t size);
+extern unsigned int	parse_octet_string(const char *string, unsigned char *buffer, size_t bufsz);
+extern unsigned int	parse_base64(const char *string, unsigned char *buffer, size_t bufsz);
 
 #if 0
 extern bool		__convert_from_utf16le(char *in_string, size_t in_bytes, char *out_string, size_t out_bytes);
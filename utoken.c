@@ -0,0 +1,142 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utoken.h"
+#include "scard.h"
+#include "util.h"
+
+struct utoken {
+	uusb_dev_t *		dev;
+	ccid_reader_t *		reader;
+	ifd_card_t *		card;
+	bool			pin_verified;
+};
+
+static utoken_t *
+utoken_connect(utoken_t *token, uint64_t deadline)
+{
+	ccid_reader_set_deadline(token->reader, deadline);
+
+	if (!ccid_reader_select_slot(token->reader, 0)
+	 || !(token->card = ccid_reader_identify_card(token->reader, 0))
+	 || !ifd_card_connect(token->card)) {
+		utoken_close(token);
+		return NULL;
+	}
+
+	return token;
+}
+
+/*
+ * Open the first token of the given type, and wait for our turn on it
+ * unless lock_dir is NULL.
+ */
+utoken_t *
+utoken_open(const uusb_type_t *type, const char *lock_dir, uint64_t deadline)
+{
+	utoken_t *token;
+	uusb_dev_t *dev;
+
+	if (!(dev = usb_open_type(type, deadline))) {
+		debug("Did not find USB device\n");
+		return NULL;
+	}
+
+	if (lock_dir && !uusb_dev_lock(dev, lock_dir, deadline)) {
+		usb_close(dev);
+		return NULL;
+	}
+
+	token = calloc(1, sizeof(*token));
+	token->dev = dev;
+
+	if (!(token->reader = ccid_reader_create(dev, NULL, deadline))) {
+		error("Unable to create reader for USB device\n");
+		utoken_close(token);
+		return NULL;
+	}
+
+	return utoken_connect(token, deadline);
+}
+
+utoken_t *
+utoken_open_pcsc(const char *reader_name, uint64_t deadline)
+{
+	utoken_t *token;
+
+	token = calloc(1, sizeof(*token));
+	if (!(token->reader = ccid_reader_create_pcsc(reader_name, deadline))) {
+		free(token);
+		return NULL;
+	}
+
+	return utoken_connect(token, deadline);
+}
+
+void
+utoken_close(utoken_t *token)
+{
+	if (token->card)
+		ifd_card_free(token->card);
+	if (token->reader)
+		ccid_reader_free(token->reader);
+	if (token->dev)
+		usb_close(token->dev);
+	free(token);
+}
+
+void
+utoken_set_deadline(utoken_t *token, uint64_t deadline)
+{
+	ccid_reader_set_deadline(token->reader, deadline);
+}
+
+bool
+utoken_set_card_option(utoken_t *token, const char *option)
+{
+	return ifd_card_set_option(token->card, option);
+}
+
+bool
+utoken_verify_pin(utoken_t *token, const char *pin, unsigned int *retries_left)
+{
+	unsigned int dummy;
+
+	if (retries_left == NULL)
+		retries_left = &dummy;
+
+	token->pin_verified = ifd_card_verify(token->card, pin, strlen(pin), retries_left);
+	return token->pin_verified;
+}
+
+bool
+utoken_pin_verified(const utoken_t *token)
+{
+	return token->pin_verified;
+}
+
+buffer_t *
+utoken_decrypt(utoken_t *token, buffer_t *ciphertext)
+{
+	return ifd_card_decipher(token->card, ciphertext);
+}
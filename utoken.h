@@ -0,0 +1,51 @@
+/*
+ *   Copyright (C) 2023 SUSE LLC
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * Written by Olaf Kirch <okir@suse.com>
+ */
+
+
+#ifndef UTOKEN_H
+#define UTOKEN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uusb.h"
+#include "bufparser.h"
+
+/*
+ * The library interface to a token: find it, claim it, bring up the
+ * card, and then verify the PIN and decrypt as often as needed. The
+ * token stays connected until it is closed, so that a caller can
+ * unlock several secrets with one PIN verification.
+ *
+ * The deadline applies to everything up to the next call of
+ * utoken_set_deadline(); 0 means no deadline.
+ */
+typedef struct utoken		utoken_t;
+
+extern utoken_t *	utoken_open(const uusb_type_t *type, const char *lock_dir, uint64_t deadline);
+extern utoken_t *	utoken_open_pcsc(const char *reader_name, uint64_t deadline);
+extern void		utoken_close(utoken_t *);
+extern void		utoken_set_deadline(utoken_t *, uint64_t deadline);
+extern bool		utoken_set_card_option(utoken_t *, const char *option);
+extern bool		utoken_verify_pin(utoken_t *, const char *pin, unsigned int *retries_left);
+extern bool		utoken_pin_verified(const utoken_t *);
+extern buffer_t *	utoken_decrypt(utoken_t *, buffer_t *ciphertext);
+
+#endif /* UTOKEN_H */
@@ -44,22 +44,84 @@ typedef struct ccid_reader	ccid_reader_t;
 typedef struct ccid_descriptor	ccid_descriptor_t;
 typedef struct buffer		buffer_t;
 typedef struct ifd_card		ifd_card_t;
+typedef struct uusb_urb		uusb_urb_t;
+
+/* Progress of a non-blocking operation */
+typedef enum {
+	XFER_PENDING,
+	XFER_DONE,
+	XFER_FAILED,
+} xfer_status_t;
 
 extern bool		usb_parse_type(const char *string, uusb_type_t *type);
 
 /* Find device by vendor/product id */
-extern uusb_dev_t *	usb_open_type(const uusb_type_t *);
+extern uusb_dev_t *	usb_open_type(const uusb_type_t *, uint64_t deadline);
+extern unsigned int	usb_open_all_type(const uusb_type_t *, uint64_t deadline, uusb_dev_t **, unsigned int max);
 /* Alternative idea: find device(s) that have a CCID descriptor */
+extern void		usb_close(uusb_dev_t *);
+
+/* Keep the device from being autosuspended. A device is held awake from the
+ * moment it is opened until it is closed; a long-running service can take
+ * additional references to keep it resumed while it expects requests. */
+extern bool		uusb_dev_hold_awake(uusb_dev_t *);
+extern void		uusb_dev_release_awake(uusb_dev_t *);
+extern void		usb_set_keep_awake(bool);
+
+/* Queue up behind other processes using the same device. The lock is
+ * dropped when the device is closed. */
+extern bool		uusb_dev_lock(uusb_dev_t *, const char *dirname, uint64_t deadline);
+extern unsigned int	uusb_dev_lock_all(uusb_dev_t **, unsigned int ndevs, const char *dirname, uint64_t deadline);
+extern void		uusb_dev_unlock(uusb_dev_t *);
 
 extern bool		uusb_parse_descriptors(uusb_dev_t *dev, const unsigned char *data, size_t len);
 extern bool		uusb_dev_select_ccid_interface(uusb_dev_t *, const struct ccid_descriptor **);
-extern bool		uusb_send(uusb_dev_t *, buffer_t *);
-extern buffer_t *	uusb_recv(uusb_dev_t *, size_t maxlen, long timeout);
+extern const uusb_type_t *uusb_dev_get_type(const uusb_dev_t *);
+extern dev_t		uusb_dev_get_devnum(const uusb_dev_t *);
+extern const char *	uusb_dev_get_serial(const uusb_dev_t *);
+extern bool		uusb_send(uusb_dev_t *, buffer_t *, long timeout);
+extern bool		uusb_clear_halt(uusb_dev_t *);
+extern bool		uusb_reset(uusb_dev_t *);
+extern bool		uusb_interface_request(uusb_dev_t *, uint8_t request, uint16_t value, long timeout);
+extern bool		uusb_recv(uusb_dev_t *, buffer_t *, long timeout);
 
-extern ccid_reader_t *	ccid_reader_create(uusb_dev_t *);
+extern int		uusb_dev_get_fd(const uusb_dev_t *);
+extern uusb_urb_t *	uusb_urb_alloc(void);
+extern void		uusb_urb_free(uusb_urb_t *);
+extern bool		uusb_urb_busy(const uusb_urb_t *);
+extern int		uusb_urb_status(const uusb_urb_t *);
+extern bool		uusb_submit_send(uusb_dev_t *, uusb_urb_t *, buffer_t *);
+extern bool		uusb_submit_recv(uusb_dev_t *, uusb_urb_t *, buffer_t *);
+extern bool		uusb_reap(uusb_dev_t *, uusb_urb_t **);
+extern void		uusb_discard(uusb_dev_t *, uusb_urb_t *);
+
+extern ccid_reader_t *	ccid_reader_create(uusb_dev_t *, const char *latency_cache, uint64_t deadline);
+extern ccid_reader_t *	ccid_reader_create_nonblocking(uusb_dev_t *, const char *latency_cache, uint64_t deadline);
+extern ccid_reader_t *	ccid_reader_create_pcsc(const char *reader_name, uint64_t deadline);
+extern void		ccid_reader_free(ccid_reader_t *);
 extern bool		ccid_reader_select_slot(ccid_reader_t *, unsigned int slot);
+extern bool		ccid_reader_card_active(const ccid_reader_t *, unsigned int slot);
 extern ifd_card_t *	ccid_reader_identify_card(ccid_reader_t *, unsigned int slot);
+extern bool		ccid_reader_poweroff(ccid_reader_t *, unsigned int slot);
 extern buffer_t *	ccid_reader_apdu_xfer(ccid_reader_t * reader, unsigned int slot, buffer_t *apdu);
+extern buffer_t *	ccid_reader_alloc_buffer(ccid_reader_t *, size_t size);
+extern void		ccid_reader_set_latency_cache(ccid_reader_t *, const char *dirname);
+extern void		ccid_reader_set_deadline(ccid_reader_t *, uint64_t deadline);
+extern bool		ccid_reader_deadline_expired(const ccid_reader_t *);
+extern bool		ccid_reader_save_latency(ccid_reader_t *);
+
+/* Non-blocking interface. At most one command can be in flight per reader;
+ * poll the fd for POLLOUT and call ccid_reader_complete() when it fires,
+ * or when the timeout has elapsed. */
+extern int		ccid_reader_get_fd(const ccid_reader_t *);
+extern long		ccid_reader_get_timeout(const ccid_reader_t *);
+extern bool		ccid_reader_submit_resync(ccid_reader_t *, unsigned int attempt);
+extern bool		ccid_reader_submit_slot_status(ccid_reader_t *, unsigned int slot);
+extern bool		ccid_reader_submit_poweron(ccid_reader_t *, unsigned int slot);
+extern bool		ccid_reader_submit_apdu(ccid_reader_t *, unsigned int slot, buffer_t *apdu);
+extern xfer_status_t	ccid_reader_complete(ccid_reader_t *, buffer_t **payload_ret);
+extern void		ccid_reader_cancel(ccid_reader_t *);
+extern void		ccid_reader_cancel_nowait(ccid_reader_t *);
 
 
 #endif /* UUSB_H */
@@ -80,16 +80,11 @@ typedef struct uusb_endpoint_descriptor {
 	uint8_t		bmAttributes;
 } uusb_endpoint_descriptor_t;
 
-#define UUSB_MAX_CONFIGS	8
-#define UUSB_MAX_INTERFACES	8
-#define UUSB_MAX_ENDPOINTS	4
+/* The USB spec allows for at most 15 IN and 15 OUT endpoints per interface */
+#define UUSB_MAX_ENDPOINTS	32
 
 typedef struct uusb_interface	uusb_interface_t;
 
-typedef struct uusb_endpoint {
-	uusb_endpoint_descriptor_t descriptor;
-} uusb_endpoint_t;
-
 typedef const struct uusb_intf_type {
 	const char *	name;
 	uusb_classproto_t classproto;
@@ -104,43 +99,62 @@ struct uusb_interface {
 
 	ccid_descriptor_t *ccid;
 
-	unsigned int	num_endpoints;
-	uusb_endpoint_t	endpoint[UUSB_MAX_ENDPOINTS];
+	/* Class specific and endpoint descriptors following the interface
+	 * descriptor. Endpoints are only parsed when needed. */
+	const unsigned char *extra;
+	unsigned int	extra_len;
 };
 
 typedef struct uusb_config {
 	uusb_config_descriptor_t descriptor;
 
 	unsigned int	num_interfaces;
-	uusb_interface_t interface[UUSB_MAX_INTERFACES];
+	uusb_interface_t *interface;
 } uusb_config_t;
 
 typedef struct uusb_dev {
 	char *		sysfs_dir;
 	char *		dev_path;
+	dev_t		devnum;
+	char *		serial;
 	int		fd;
 
+	unsigned int	awake_count;
+	char *		saved_power_control;
+	int		awake_fd;	/* shared autosuspend state, see usb.c */
+
+	/* Our ticket in the queue for this device, see lock.c */
+	int		lock_fd;
+	char *		lock_path;
+
 	struct {
 		int	ep_o;
 		int	ep_i;
 		int	ep_intr;
 	} endpoints;
+	int		interface_num;
 
 	uusb_type_t	type;
 	uusb_devaddr_t	devaddr;
 	uusb_device_descriptor_t descriptor;
 
+	/* Configs, interfaces and the raw descriptors all live in a
+	 * single allocation, sized to what the device actually has. */
+	void *		descriptor_arena;
 	unsigned int	num_configs;
-	uusb_config_t	config[UUSB_MAX_CONFIGS];
+	uusb_config_t *	config;
 } uusb_dev_t;
 
 extern bool		usb_parse_type(const char *string, uusb_type_t *type);
 
 /* Find device by vendor/product id */
-extern uusb_dev_t *	usb_open_type(const uusb_type_t *);
+extern uusb_dev_t *	usb_open_type(const uusb_type_t *, uint64_t deadline);
 /* Alternative idea: find device(s) that have a CCID descriptor */
 
 extern bool		uusb_parse_descriptors(uusb_dev_t *dev, const unsigned char *data, size_t len);
+extern void		uusb_free_descriptors(uusb_dev_t *dev);
+extern unsigned int	uusb_interface_get_endpoints(const uusb_interface_t *,
+				uusb_endpoint_descriptor_t *, unsigned int max);
 
 
 #ifdef USB_DEBUG
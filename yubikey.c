@@ -21,6 +21,7 @@
 
 #include "scard.h"
 #include "bufparser.h"
+#include "tlv.h"
 #include "util.h"
 
 #define YKPIV_INS_VERIFY		0x20
@@ -51,10 +52,10 @@
 
 #define MAKE_ATR(s)	{ .len = sizeof(s) - 1, .data = s }
 
-static ifd_atrbuf_t	atr_neo_r3 = MAKE_ATR("\x3b\xfc\x13\x00\x00\x81\x31\xfe\x15\x59\x75\x62\x69\x6b\x65\x79\x4e\x45\x4f\x72\x33\xe1");
-static ifd_atrbuf_t	atr_yubikey4 = MAKE_ATR("\x3b\xf8\x13\x00\x00\x81\x31\xfe\x15\x59\x75\x62\x69\x6b\x65\x79\x34\xd4");
-static ifd_atrbuf_t	atr_yubikey5 = MAKE_ATR("\x3b\xfd\x13\x00\x00\x81\x31\xfe\x15\x80\x73\xc0\x21\xc0\x57\x59\x75\x62\x69\x4b\x65\x79\x40");
-static ifd_atrbuf_t	atr_yubikey5_p1 = MAKE_ATR("\x3b\xf8\x13\x00\x00\x81\x31\xfe\x15\x01\x59\x75\x62\x69\x4b\x65\x79\xc1");
+static const ifd_atrbuf_t	atr_neo_r3 = MAKE_ATR("\x3b\xfc\x13\x00\x00\x81\x31\xfe\x15\x59\x75\x62\x69\x6b\x65\x79\x4e\x45\x4f\x72\x33\xe1");
+static const ifd_atrbuf_t	atr_yubikey4 = MAKE_ATR("\x3b\xf8\x13\x00\x00\x81\x31\xfe\x15\x59\x75\x62\x69\x6b\x65\x79\x34\xd4");
+static const ifd_atrbuf_t	atr_yubikey5 = MAKE_ATR("\x3b\xfd\x13\x00\x00\x81\x31\xfe\x15\x80\x73\xc0\x21\xc0\x57\x59\x75\x62\x69\x4b\x65\x79\x40");
+static const ifd_atrbuf_t	atr_yubikey5_p1 = MAKE_ATR("\x3b\xf8\x13\x00\x00\x81\x31\xfe\x15\x01\x59\x75\x62\x69\x4b\x65\x79\xc1");
 
 enum {
 	YK_VARIANT_NEO_R3,
@@ -65,54 +66,73 @@ enum {
 
 static bool		yubikey_set_card_option(ifd_card_t *card, const char *key, const char *value);
 static bool		yubikey_connect(ifd_card_t *card);
+static bool		yubikey_resume(ifd_card_t *card);
 static bool		yubikey_verify(ifd_card_t *card, const char *pin, size_t pin_len, unsigned int *tries_left);
 static buffer_t *	yubikey_decipher(ifd_card_t *card, buffer_t *ciphertext);
-
-static ifd_card_driver_t	yubikey_driver = {
+static buffer_t *	yubikey_sign(ifd_card_t *card, buffer_t *data, unsigned int key_len);
+static buffer_t *	yubikey_read_certificate(ifd_card_t *card, unsigned int key_ref);
+static bool		yubikey_select_request(ifd_card_t *card, ifd_request_t *req);
+static bool		yubikey_select_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw);
+static bool		yubikey_verify_request(ifd_card_t *card, const char *pin, size_t pin_len, ifd_request_t *req);
+static bool		yubikey_verify_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw, unsigned int *tries_left);
+static bool		yubikey_decipher_request(ifd_card_t *card, buffer_t *ciphertext, ifd_request_t *req);
+static buffer_t *	yubikey_decipher_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw);
+
+static const ifd_card_driver_t	yubikey_driver = {
 	.set_option	= yubikey_set_card_option,
 	.connect	= yubikey_connect,
+	.resume		= yubikey_resume,
 	.verify		= yubikey_verify,
 	.decipher	= yubikey_decipher,
+	.sign		= yubikey_sign,
+	.read_certificate = yubikey_read_certificate,
+
+	.select_request	= yubikey_select_request,
+	.select_response = yubikey_select_response,
+	.verify_request	= yubikey_verify_request,
+	.verify_response = yubikey_verify_response,
+	.decipher_request = yubikey_decipher_request,
+	.decipher_response = yubikey_decipher_response,
+};
+
+const ifd_card_driver_registration_t yubikey_drivers[] = {
+	{ &atr_neo_r3,		"YubiKey Neo R3",	&yubikey_driver,	YK_VARIANT_NEO_R3 },
+	{ &atr_yubikey4,	"YubiKey 4",		&yubikey_driver,	YK_VARIANT_YUBIKEY_4 },
+	{ &atr_yubikey5,	"YubiKey 5",		&yubikey_driver,	YK_VARIANT_YUBIKEY_5 },
+	{ &atr_yubikey5_p1,	"YubiKey 5",		&yubikey_driver,	YK_VARIANT_YUBIKEY_5_P1 },
+	{ NULL }
 };
 
-void
-yubikey_init(void)
+static unsigned const char	piv_aid[] = { 0xa0, 0x00, 0x00, 0x03, 0x08 };
+
+static bool
+yubikey_select_request(ifd_card_t *card, ifd_request_t *req)
 {
-	ifd_register_card_driver(&atr_neo_r3, "YubiKey Neo R3", &yubikey_driver, YK_VARIANT_NEO_R3);
-	ifd_register_card_driver(&atr_yubikey4, "YubiKey 4", &yubikey_driver, YK_VARIANT_YUBIKEY_4);
-	ifd_register_card_driver(&atr_yubikey5, "YubiKey 5", &yubikey_driver, YK_VARIANT_YUBIKEY_5);
-	ifd_register_card_driver(&atr_yubikey5_p1, "YubiKey 5", &yubikey_driver, YK_VARIANT_YUBIKEY_5_P1);
+	return ifd_request_build(card, req, 0x00, YKPIV_INS_SELECT_APPLICATION, 0x04, 0x00,
+			piv_aid, sizeof(piv_aid));
 }
 
-bool
-yubikey_select_application(ifd_card_t *card, const void *aid, size_t aid_len)
+static bool
+yubikey_select_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw)
 {
-	buffer_t *apdu, *rapdu = NULL;
-	bool rv = false;
-	uint16_t sw;
-
-	apdu = ifd_build_apdu(0x00, YKPIV_INS_SELECT_APPLICATION, 0x04, 0x00, aid, aid_len);
-	if (!apdu) {
-		error("failed to build APDU\n");
+	if (sw != YKPIV_SUCCESS) {
+		error("Failed to select application: card reports status %04x\n", sw);
 		return false;
 	}
 
-	rapdu = ifd_card_xfer(card, apdu, &sw);
-	if (rapdu == NULL) {
-		error("Failed to select application: communication error\n");
-		goto done;
-	} else if (sw != YKPIV_SUCCESS) {
-		error("Failed to select application: card reports status %04x\n", sw);
-		goto done;
-	}
+	ifd_card_set_application(card, piv_aid, sizeof(piv_aid));
+	infomsg("Successfully selected PIV application\n");
 
-	rv = true;
+	/* Select an appropriate PIV key slot.
+	 * 9a: PIV Authentication, pin required
+	 * 9e: Card Authentication, no pin required
+	 * 82-95: nominally, for retired key management, but could also be
+	 *	abused for FDE.
+	 */
+	if (card->yubikey.key_slot == 0)
+		card->yubikey.key_slot = YKPIV_DEFAULT_KEY_SLOT;
 
-done:
-	buffer_free(apdu);
-	if (rapdu)
-		buffer_free(rapdu);
-	return rv;
+	return true;
 }
 
 bool
@@ -138,23 +158,28 @@ yubikey_set_card_option(ifd_card_t *card, const char *key, const char *value)
 bool
 yubikey_connect(ifd_card_t *card)
 {
-	static unsigned const char piv_aid[] = { 0xa0, 0x00, 0x00, 0x03, 0x08 };
+	ifd_request_t req;
+	buffer_t *rapdu;
+	uint16_t sw;
+	bool rv;
 
 	debug("%s()\n", __func__);
 
-	if (!yubikey_select_application(card, piv_aid, sizeof(piv_aid)))
+	if (!yubikey_select_request(card, &req))
 		return false;
 
-	infomsg("Successfully selected PIV application\n");
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
 
-	/* Select an appropriate PIV key slot.
-	 * 9a: PIV Authentication, pin required
-	 * 9e: Card Authentication, no pin required
-	 * 82-95: nominally, for retired key management, but could also be
-	 *	abused for FDE.
-	 */
-	if (card->yubikey.key_slot == 0)
-		card->yubikey.key_slot = 0x9e;
+	if (rapdu == NULL) {
+		error("Failed to select application: communication error\n");
+		return false;
+	}
+
+	rv = yubikey_select_response(card, rapdu, sw);
+	buffer_free(rapdu);
+	if (!rv)
+		return false;
 
 	debug("Trying empty password to see whether a PIN is required\n");
 	if (yubikey_verify(card, NULL, 0, NULL))
@@ -165,154 +190,179 @@ yubikey_connect(ifd_card_t *card)
 	return true;
 }
 
+/*
+ * The PIV application should still be selected from the last time we talked
+ * to the card. A VERIFY without data is cheap, and tells us that PIV is
+ * still selected.
+ *
+ * If it succeeds, we cannot tell a card without a PIN from one whose PIN
+ * is still verified by a process that did not power it off (for instance,
+ * because it crashed). So unlike yubikey_select, we never conclude that
+ * no PIN is required.
+ */
 bool
-yubikey_verify(ifd_card_t *card, const char *pin, size_t pin_len, unsigned int *tries_left)
+yubikey_resume(ifd_card_t *card)
 {
-	unsigned char padded_pin[8];
-	buffer_t *apdu, *rapdu = NULL;
+	ifd_request_t req;
+	buffer_t *rapdu;
 	bool rv = false;
-	uint16_t sw;
+	uint16_t sw = 0;
 
-	if (pin == NULL) {
-		apdu = ifd_build_apdu(0x00, YKPIV_INS_VERIFY, 0x00, 0x80, NULL, 0);
-	} else if (pin_len > sizeof(padded_pin)) {
-		error("PIN too long\n");
-		return false;
-	} else {
-		memset(padded_pin, 0xFF, sizeof(padded_pin));
-		memcpy(padded_pin, pin, pin_len);
+	debug("%s()\n", __func__);
 
-		apdu = ifd_build_apdu(0x00, YKPIV_INS_VERIFY, 0x00, 0x80,
-				padded_pin, sizeof(padded_pin));
+	if (card->aid.len != sizeof(piv_aid) || memcmp(card->aid.data, piv_aid, sizeof(piv_aid))) {
+		debug("Cached session does not refer to the PIV application\n");
+		return false;
 	}
 
-	if (!apdu) {
-		error("failed to build APDU\n");
+	if (card->yubikey.key_slot == 0)
+		card->yubikey.key_slot = YKPIV_DEFAULT_KEY_SLOT;
+
+	if (!yubikey_verify_request(card, NULL, 0, &req))
 		return false;
-	}
 
-	rapdu = ifd_card_xfer(card, apdu, &sw);
-	if (rapdu == NULL) {
-		error("Failed to select application: communication error\n");
-		goto done;
-	} else if ((sw & 0xFF00) == 0x6300) {
-		unsigned int nleft = sw & 0x000F;
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
 
-		if (tries_left)
-			*tries_left = nleft;
-		debug("Incorrect password, %u tries left\n", nleft);
-		goto done;
-	} else if (sw != YKPIV_SUCCESS) {
-		error("Failed to select application: card reports status %04x\n", sw);
-		goto done;
+	if (rapdu == NULL) {
+		debug("Communication error while resuming session\n");
+	} else if (sw == YKPIV_SUCCESS) {
+		debug("Card does not ask for a PIN, not trusting its security status\n");
+		rv = true;
+	} else if ((sw & 0xFF00) == 0x6300 || sw == YKPIV_ERR_AUTH_BLOCKED) {
+		debug("This card has a PIN.\n");
+		rv = true;
+	} else {
+		debug("Card reports status %04x, PIV application no longer selected\n", sw);
 	}
 
-	rv = true;
-
-done:
-	buffer_free(apdu);
 	if (rapdu)
 		buffer_free(rapdu);
 	return rv;
 }
 
-static inline unsigned int
-enc_push_byte(unsigned char *encoded, unsigned int pos, uint8_t byte)
+static bool
+yubikey_verify_request(ifd_card_t *card, const char *pin, size_t pin_len, ifd_request_t *req)
 {
-	encoded[--pos] = byte;
-	return pos;
-}
+	unsigned char padded_pin[8];
+	bool rv;
 
-static inline unsigned int
-enc_push_length(unsigned char *encoded, unsigned int pos, unsigned int len)
-{
-	pos = enc_push_byte(encoded, pos, len);
-	if (len < 0x80) {
-		/* done */
-	} else if (len < 0x100) {
-		pos = enc_push_byte(encoded, pos, 0x81);
-	} else {
-		pos = enc_push_byte(encoded, pos, len >> 8);
-		pos = enc_push_byte(encoded, pos, 0x82);
+	if (pin == NULL)
+		return ifd_request_build(card, req, 0x00, YKPIV_INS_VERIFY, 0x00, 0x80, NULL, 0);
+
+	if (pin_len > sizeof(padded_pin)) {
+		error("PIN too long\n");
+		return false;
 	}
 
-	return pos;
+	memset(padded_pin, 0xFF, sizeof(padded_pin));
+	memcpy(padded_pin, pin, pin_len);
+
+	rv = ifd_request_build(card, req, 0x00, YKPIV_INS_VERIFY, 0x00, 0x80,
+			padded_pin, sizeof(padded_pin));
+	explicit_bzero(padded_pin, sizeof(padded_pin));
+	return rv;
 }
 
-static inline int
-decode_length(const unsigned char *encoded, unsigned int *pos_p)
+static bool
+yubikey_verify_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw, unsigned int *tries_left)
 {
-	unsigned int pos = *pos_p;
-	unsigned int len;
-
-	len = encoded[pos++];
-	if (len == 0x81) {
-		len = encoded[pos++];
-	} else if (len == 0x82) {
-		len = encoded[pos++];
-		len = (len << 8) | encoded[pos++];
+	if ((sw & 0xFF00) == 0x6300) {
+		unsigned int nleft = sw & 0x000F;
+
+		if (tries_left)
+			*tries_left = nleft;
+		debug("Incorrect password, %u tries left\n", nleft);
+		return false;
 	}
-	*pos_p = pos;
-	return len;
+
+	if (sw != YKPIV_SUCCESS) {
+		error("Failed to verify PIN: card reports status %04x\n", sw);
+		return false;
+	}
+
+	return true;
 }
 
-static inline unsigned int
-enc_push(unsigned char *encoded, unsigned int pos, const void *data, unsigned int count)
+bool
+yubikey_verify(ifd_card_t *card, const char *pin, size_t pin_len, unsigned int *tries_left)
 {
-	if (count > pos)
-		return 0;
+	ifd_request_t req;
+	buffer_t *rapdu;
+	uint16_t sw;
+	bool rv;
+
+	if (!yubikey_verify_request(card, pin, pin_len, &req))
+		return false;
+
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
 
-	pos -= count;
-	memcpy(encoded + pos, data, count);
-	return pos;
+	if (rapdu == NULL) {
+		error("Failed to verify PIN: communication error\n");
+		return false;
+	}
+
+	rv = yubikey_verify_response(card, rapdu, sw, tries_left);
+	buffer_free(rapdu);
+	return rv;
 }
 
 /*
- * Encode this thing back to front. The weird length encoding makes things easier this way.
+ * Build the dynamic authentication template for a GENERAL AUTHENTICATE
+ * command: 7C { 82 (empty response placeholder), 81 (challenge) }.
+ * For RSA keys, decipher and sign are the same raw private key
+ * operation; only the padding differs.
+ * The data is encoded straight into a buffer that can be sent without
+ * further copying.
  */
 static buffer_t *
-yubikey_encode_decipher_args(uint8_t algorithm, const void *ciphertext, unsigned int in_len)
+yubikey_encode_decipher_args(ifd_card_t *card, const void *ciphertext, unsigned int in_len)
 {
-	unsigned char encoded[1024];
-	unsigned int pos, count;
+	size_t inner_len, total_len;
 	buffer_t *result;
 
-	memset(encoded, 0, sizeof(encoded));
-	pos = sizeof(encoded);
-	if (in_len + 32 > pos)
-		return NULL;
-
-	pos = enc_push(encoded, pos, ciphertext, in_len);
-	pos = enc_push_length(encoded, pos, in_len);
+	/* ECC decipher would use tag 0x85 rather than 0x81 */
+	inner_len = tlv_encoded_size(0x82, 0) + tlv_encoded_size(0x81, in_len);
+	total_len = tlv_encoded_size(0x7c, inner_len);
 
-	pos = enc_push_byte(encoded, pos, 0x81); /* ECC decipher would be 0x85 */
-	pos = enc_push_byte(encoded, pos, 0x00);
-	pos = enc_push_byte(encoded, pos, 0x82);
-	pos = enc_push_length(encoded, pos, sizeof(encoded) - pos);
-	pos = enc_push_byte(encoded, pos, 0x7c);
-
-	count = sizeof(encoded) - pos;
+	result = ifd_alloc_apdu_data(card, total_len);
+	if (!tlv_put_header(result, 0x7c, inner_len)
+	 || !tlv_put_header(result, 0x82, 0)
+	 || !tlv_put(result, 0x81, ciphertext, in_len)) {
+		buffer_free(result);
+		return NULL;
+	}
 
-	result = buffer_alloc_write(1024);
-	buffer_put(result, encoded + pos, count);
 	return result;
 }
 
-static bool
-yubikey_decode_decipher_resp(buffer_t *resp)
+/*
+ * The response is a dynamic authentication template (tag 7C), with the
+ * result in tag 82. The response may be a buffer chain; we parse it in
+ * place and copy only the contents of tag 82.
+ */
+static buffer_t *
+yubikey_decode_auth_resp(buffer_t *resp)
 {
-	const unsigned char *data = buffer_read_pointer(resp);
-	unsigned int i = 0;
-
-	if (data[i++] != 0x7c)
-		return false;
-	(void) decode_length(data, &i);
+	tlv_cursor_t cursor;
+	tlv_t template, item;
+	buffer_t *result;
 
-	if (data[i++] != 0x82)
-		return false;
+	tlv_cursor_init(&cursor, resp);
+	if (!tlv_find(&cursor, 0x7c, &template)
+	 || !tlv_find(&template.value, 0x82, &item)) {
+		error("Unable to parse response to private key operation\n");
+		return NULL;
+	}
 
-	(void) decode_length(data, &i);
-	return buffer_skip(resp, i);
+	result = buffer_alloc_secret(item.len);
+	if (!tlv_get_value(&item, buffer_write_pointer(result), item.len)) {
+		buffer_free(result);
+		return NULL;
+	}
+	result->wpos = item.len;
+	return result;
 }
 
 static bool
@@ -337,20 +387,11 @@ pkcs1_type2_padding_remove(buffer_t *bp)
 	return false;
 }
 
-static buffer_t *
-yubikey_decipher(ifd_card_t *card, buffer_t *ciphertext)
+static bool
+yubikey_rsa_request(ifd_card_t *card, const void *input, unsigned int in_len, ifd_request_t *req)
 {
-	unsigned int key = card->yubikey.key_slot;
-	unsigned int in_len;
 	uint8_t algorithm;
-	buffer_t *data, *apdu = NULL, *rapdu = NULL, *cleartext = NULL;
-
-	in_len = buffer_available(ciphertext);
-
-	if (opt_debug > 1) {
-		debug("Trying to decipher %u bytes of data\n", in_len);
-		hexdump(buffer_read_pointer(ciphertext), in_len, debug2, 4);
-	}
+	buffer_t *data;
 
 	/* For now, assume it's always RSA */
 	switch (in_len) {
@@ -364,63 +405,226 @@ yubikey_decipher(ifd_card_t *card, buffer_t *ciphertext)
 
 	default:
 		error("Unexpected ciphertext size, unable to determine public key algorithm\n");
-		return NULL;
+		return false;
 	}
 
-	data = yubikey_encode_decipher_args(algorithm, buffer_read_pointer(ciphertext), in_len);
+	if (!(data = yubikey_encode_decipher_args(card, input, in_len)))
+		return false;
 
-	while (buffer_available(data)) {
-		unsigned int len = buffer_available(data);
-		uint8_t cla = 0x00;
-		uint16_t sw;
+	ifd_request_init(req, 0x00, YKPIV_INS_AUTHENTICATE, algorithm, card->yubikey.key_slot, data);
+	return true;
+}
 
-		if (len > 0xFF) {
-			len = 0xFF;
-			cla |= 0x10;
-		}
+static bool
+yubikey_decipher_request(ifd_card_t *card, buffer_t *ciphertext, ifd_request_t *req)
+{
+	unsigned int in_len;
 
-		apdu = ifd_build_apdu(cla, YKPIV_INS_AUTHENTICATE, algorithm, key,
-				buffer_read_pointer(data),
-				len);
-
-		rapdu = ifd_card_xfer(card, apdu, &sw);
-		buffer_free(apdu);
-
-		if (rapdu == NULL) {
-			error("Failed to decipher: communication error\n");
-			goto done;
-		} else {
-			switch (sw) {
-			case YKPIV_SUCCESS:
-				break;
-			case YKPIV_ERR_SECURITY_STATUS:
-				error("To use this key, you have to present a valid PIN first\n");
-				goto done;
-			default:
-				error("Failed to decipher: card reports status %04x\n", sw);
-				goto done;
-			}
-		}
+	in_len = buffer_available(ciphertext);
 
-		buffer_skip(data, len);
+	if (opt_debug > 1) {
+		debug("Trying to decipher %u bytes of data\n", in_len);
+		hexdump(buffer_read_pointer(ciphertext), in_len, debug2, 4);
 	}
 
-	if (!yubikey_decode_decipher_resp(rapdu))
-		goto done;
+	return yubikey_rsa_request(card, buffer_read_pointer(ciphertext), in_len, req);
+}
+
+static bool
+yubikey_auth_status_ok(uint16_t sw, const char *what)
+{
+	switch (sw) {
+	case YKPIV_SUCCESS:
+		return true;
+	case YKPIV_ERR_SECURITY_STATUS:
+		error("To use this key, you have to present a valid PIN first\n");
+		return false;
+	default:
+		error("Failed to %s: card reports status %04x\n", what, sw);
+		return false;
+	}
+}
+
+static buffer_t *
+yubikey_decipher_response(ifd_card_t *card, buffer_t *rapdu, uint16_t sw)
+{
+	buffer_t *padded;
+
+	if (!yubikey_auth_status_ok(sw, "decipher"))
+		return NULL;
 
-	/* The response APDU should now contain the padded secret. We expect pkcs1 type 2 padding */
-	if (pkcs1_type2_padding_remove(rapdu)) {
-		cleartext = rapdu;
-		rapdu = NULL;
+	if (!(padded = yubikey_decode_auth_resp(rapdu)))
+		return NULL;
 
-		debug("Returning cleartext\n");
-		hexdump(buffer_read_pointer(cleartext), buffer_available(cleartext), debug, 4);
+	/* This should now contain the padded secret. We expect pkcs1 type 2 padding */
+	if (!pkcs1_type2_padding_remove(padded)) {
+		buffer_free_secret(padded);
+		return NULL;
 	}
 
-done:
-	if (data)
-		buffer_free(data);
-	if (rapdu)
-		buffer_free(rapdu);
+	debug("Returning cleartext\n");
+	hexdump(buffer_read_pointer(padded), buffer_available(padded), debug, 4);
+	return padded;
+}
+
+static buffer_t *
+yubikey_decipher(ifd_card_t *card, buffer_t *ciphertext)
+{
+	ifd_request_t req;
+	buffer_t *rapdu, *cleartext;
+	uint16_t sw;
+
+	if (!yubikey_decipher_request(card, ciphertext, &req))
+		return NULL;
+
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
+
+	if (rapdu == NULL) {
+		error("Failed to decipher: communication error\n");
+		return NULL;
+	}
+
+	cleartext = yubikey_decipher_response(card, rapdu, sw);
+	buffer_free_secret(rapdu);
 	return cleartext;
 }
+
+/*
+ * Apply PKCS#1 v1.5 type 1 padding, and run the result through the
+ * private key.
+ */
+static buffer_t *
+yubikey_sign(ifd_card_t *card, buffer_t *data, unsigned int key_len)
+{
+	unsigned int len = buffer_available(data);
+	ifd_request_t req;
+	buffer_t *padded, *rapdu, *signature = NULL;
+	unsigned char *p;
+	uint16_t sw;
+
+	if (len + 11 > key_len) {
+		error("Data too large to be signed with a %u bit key\n", 8 * key_len);
+		return NULL;
+	}
+
+	padded = buffer_alloc_secret(key_len);
+	p = buffer_write_pointer(padded);
+	p[0] = 0x00;
+	p[1] = 0x01;
+	memset(p + 2, 0xff, key_len - len - 3);
+	p[key_len - len - 1] = 0x00;
+	memcpy(p + key_len - len, buffer_read_pointer(data), len);
+	padded->wpos = key_len;
+
+	if (!yubikey_rsa_request(card, p, key_len, &req)) {
+		buffer_free_secret(padded);
+		return NULL;
+	}
+	buffer_free_secret(padded);
+
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
+
+	if (rapdu == NULL) {
+		error("Failed to sign: communication error\n");
+		return NULL;
+	}
+
+	if (yubikey_auth_status_ok(sw, "sign"))
+		signature = yubikey_decode_auth_resp(rapdu);
+
+	buffer_free(rapdu);
+	return signature;
+}
+
+/*
+ * Each PIV key slot has a data object for its certificate. The object
+ * wraps the DER certificate (tag 70) and a flag byte (tag 71) saying
+ * whether it has been compressed.
+ */
+static const struct {
+	uint8_t		key_slot;
+	uint32_t	object;
+} yubikey_cert_objects[] = {
+	{ 0x9a,	0x5fc105 },
+	{ 0x9c,	0x5fc10a },
+	{ 0x9d,	0x5fc10b },
+	{ 0x9e,	0x5fc101 },
+	{ 0 }
+};
+
+static buffer_t *
+yubikey_read_certificate(ifd_card_t *card, unsigned int key_ref)
+{
+	unsigned char tag[5] = { 0x5c, 0x03 };
+	ifd_request_t req;
+	tlv_cursor_t cursor;
+	tlv_t object, item;
+	buffer_t *rapdu, *cert = NULL;
+	uint8_t info = 0;
+	uint16_t sw;
+	unsigned int i;
+
+	for (i = 0; yubikey_cert_objects[i].key_slot; ++i) {
+		if (yubikey_cert_objects[i].key_slot == key_ref)
+			break;
+	}
+	if (yubikey_cert_objects[i].key_slot == 0) {
+		error("No certificate object for key slot %02x\n", key_ref);
+		return NULL;
+	}
+
+	tag[2] = yubikey_cert_objects[i].object >> 16;
+	tag[3] = yubikey_cert_objects[i].object >> 8;
+	tag[4] = yubikey_cert_objects[i].object;
+
+	if (!ifd_request_build(card, &req, 0x00, YKPIV_INS_GET_DATA, 0x3f, 0xff, tag, sizeof(tag)))
+		return NULL;
+
+	rapdu = ifd_card_transact(card, &req, &sw);
+	ifd_request_destroy(&req);
+	if (rapdu == NULL)
+		return NULL;
+
+	if (sw == YKPIV_ERR_FILE_NOT_FOUND) {
+		debug("No certificate in key slot %02x\n", key_ref);
+		goto out;
+	}
+	if (sw != YKPIV_SUCCESS) {
+		error("Failed to read certificate: card reports status %04x\n", sw);
+		goto out;
+	}
+
+	tlv_cursor_init(&cursor, rapdu);
+	if (!tlv_find(&cursor, 0x53, &object)) {
+		error("Unable to parse certificate object for key slot %02x\n", key_ref);
+		goto out;
+	}
+
+	cursor = object.value;
+	if (tlv_find(&cursor, 0x71, &item) && item.len == 1)
+		tlv_get_value(&item, &info, 1);
+	if (info & 0x01) {
+		debug("Certificate in key slot %02x is compressed, ignored\n", key_ref);
+		goto out;
+	}
+
+	cursor = object.value;
+	if (!tlv_find(&cursor, 0x70, &item)) {
+		error("Certificate object for key slot %02x has no certificate\n", key_ref);
+		goto out;
+	}
+
+	cert = buffer_alloc_write(item.len);
+	if (!tlv_get_value(&item, buffer_write_pointer(cert), item.len)) {
+		buffer_free(cert);
+		cert = NULL;
+		goto out;
+	}
+	cert->wpos = item.len;
+
+out:
+	buffer_free(rapdu);
+	return cert;
+}